@@ -1,27 +1,66 @@
 #include "timelapse.h"
+#include "capture_jobs.h"
+#include "cpu_budget.h"
+#include "frame_cleaner.h"
+#include "job_board.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "part_encoder.h"
+#include "preview.h"
+#include "render_jobs.h"
+#include "segment_store.h"
+#include "session_state.h"
+#include "stage_stats.h"
+#include "thumbnails.h"
 
 #include <httplib.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <thread>
 #include <atomic>
 #include <condition_variable>
 #include <csignal>
-#include <fstream>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
 
 extern std::atomic<bool> shouldRecordStop;
-extern std::atomic<bool> shouldCreateStop;
 
 extern std::filesystem::path FRAME_PATH;
 extern std::filesystem::path TIMELAPSE_PATH;
 
 static httplib::Server *globalServer = nullptr;
 
+// each preview viewer holds one of the server's worker threads for as long as it watches
+static constexpr int PREVIEW_MAX_VIEWERS = 4;
 
-// stops running camera process and then shuts down httplib server
+// long polls on /jobs hold a worker thread too, for at most JOB_WAIT_MAX_MS, further watchers are answered right away
+static constexpr int JOB_MAX_WATCHERS = 4;
+static constexpr int JOB_WAIT_MAX_MS = 30000;
+
+// a download holds a worker thread until the client has the whole file, further downloads are turned away
+static constexpr int DOWNLOAD_MAX_CLIENTS = 4;
+
+// bytes handed to httplib per provider call, so a download is counted as the client takes it
+static constexpr size_t DOWNLOAD_CHUNK_BYTES = 256 * 1024;
+
+// worker threads left for commands with every preview, watcher and download slot taken
+static constexpr int COMMAND_THREADS = 8;
+
+static std::atomic<int> jobWatchers{0};
+static std::atomic<int> activeDownloads{0};
+
+
+// stops running camera processes and then shuts down httplib server, renders are cancelled once the server has stopped
 void shutdownServer() {
   shouldRecordStop.store(true);
-  shouldCreateStop.store(true);
+
+  // preview streams and job watchers end on their own so the server's worker threads can be joined
+  closePreviews();
+  closeJobs();
 
   if (globalServer) {
     globalServer->stop();
@@ -29,6 +68,70 @@ void shutdownServer() {
 }
 
 
+// resolves the camera param (an index or libcamera ID, the first camera if absent), answering the request if there is no such camera
+static bool requestCamera(const httplib::Request& req, httplib::Response& res, std::string &cameraId, std::filesystem::path &framesDir) {
+
+  std::string camera = req.has_param("camera") ? req.get_param_value("camera") : "";
+
+  if (findCamera(camera, cameraId, framesDir) < 0) {
+    res.status = 404;
+    std::cerr << "No camera " << camera << std::endl;
+    res.set_content("Error: no such camera, see /cameras.\n", "text/plain");
+    return false;
+  }
+
+  return true;
+}
+
+
+// with since= (a sequence number from the X-Job-Sequence header) waits up to wait= ms until a job changes after it,
+// returns the sequence number the answer reflects
+static uint64_t waitForJobs(const httplib::Request& req) {
+
+  uint64_t sequence = jobsSequence();
+  if (!req.has_param("since") || std::stoull(req.get_param_value("since")) != sequence) {
+    return sequence;
+  }
+
+  int waitMs = req.has_param("wait") ? std::clamp(std::stoi(req.get_param_value("wait")), 0, JOB_WAIT_MAX_MS) : JOB_WAIT_MAX_MS;
+
+  if (jobWatchers.fetch_add(1) < JOB_MAX_WATCHERS) {
+    waitJobs(sequence, std::chrono::milliseconds(waitMs));
+  }
+  jobWatchers.fetch_sub(1);
+
+  return sequence;
+}
+
+
+// parses HH:MM into minutes after midnight
+static bool parseTimeOfDay(const std::string &value, int &minute) {
+
+  int hours = 0;
+  int minutes = 0;
+  char end = '\0';
+
+  if (std::sscanf(value.c_str(), "%d:%d%c", &hours, &minutes, &end) != 2 || hours < 0 || hours > 24 || minutes < 0 || minutes > 59) {
+    return false;
+  }
+
+  minute = hours * 60 + minutes;
+  return minute <= 24 * 60;
+}
+
+
+// parses x,y,width,height fractions of the field of view
+static bool parseCrop(const std::string &value, CropRegion &crop) {
+
+  char end;
+  if (std::sscanf(value.c_str(), "%lf,%lf,%lf,%lf%c", &crop.x, &crop.y, &crop.width, &crop.height, &end) != 4) {
+    return false;
+  }
+
+  return crop.x >= 0 && crop.y >= 0 && crop.width > 0 && crop.height > 0 && crop.x + crop.width <= 1 && crop.y + crop.height <= 1;
+}
+
+
 // first handles interrupting a timelapse if currently running, then interrupts server
 void interruptHandler(int signum) {
   if (signum) {
@@ -44,36 +147,59 @@ int main() {
   std::signal(SIGINT, interruptHandler);
   std::signal(SIGHUP, interruptHandler);
 
+  // ffmpeg exiting early should show up as a write error on its pipe, not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+
   httplib::Server svr;
   globalServer = &svr;
 
-  std::unique_ptr<std::thread> camThread;
-  std::unique_ptr<std::thread> createTimelapseThread;
+  // previews, job watchers and downloads never take the last threads, so commands are answered while they wait
+  svr.new_task_queue = [] {
+    return new httplib::ThreadPool(COMMAND_THREADS + PREVIEW_MAX_VIEWERS + JOB_MAX_WATCHERS + DOWNLOAD_MAX_CLIENTS);
+  };
+
+  // recordings run as jobs on one worker thread per camera
+  CaptureJobs captureJobs;
+  captureJobs.start([](const RecordOptions &request) {
+    return recordTimelapseHandler(request);
+  });
+
+  if (WARM_CAMERAS) {
+    std::cout << "Keeping cameras set up between recordings" << std::endl;
+  }
+
+  // requests name cameras by index or ID, resolving them from a running manager saves enumerating the cameras each time
+  bool managerOpen = openCameraManager() == 0;
+  if (!managerOpen) {
+    std::cerr << "Can't start the camera manager, cameras are looked up per request" << std::endl;
+  }
+
+  // frame directories are cleared in the background, one at a time
+  FrameCleaner frameCleaner;
+  frameCleaner.start();
 
-  std::atomic<bool> isCamRunning{false};
-  std::atomic<bool> isCreatingTimelapse{false};
-  std::atomic<bool> isDownloadingTimelapse{false};
+  // renders run one at a time next to capture
+  RenderJobs renderJobs;
+  renderJobs.start([](const RenderOptions &request, RenderControl &control) {
+    return createTimelapseHandler(request, &control);
+  });
+
+
+  // cameras are addressed by the camera param, an index or libcamera ID (see /cameras), and default to the first camera
+  svr.Get("/start-cam", [&captureJobs, &renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
 
+    std::string cameraId;
+    std::filesystem::path framesDir;
+    if (!requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
 
-  svr.Get("/start-cam", [&isCamRunning, &camThread, &isCreatingTimelapse](const httplib::Request& req, httplib::Response& res) {
-    
-    if (isCamRunning.load()) {
+    if (captureJobs.active(cameraId)) {
       res.status = 500;
       std::cerr << "Camera has already been started." << std::endl;
       res.set_content("Error: camera has already been started.\n", "text/plain");
-    } else if (isCreatingTimelapse.load()) {
-      res.status = 500;
-      std::cerr << "Cannot start camera while timelapse is being created." << std::endl; 
-      res.set_content("Error: cannot start camera while timelapse is being created.\n", "text/plain");
     } else {
 
-      std::cout << "CAMERA STARTED by " << req.remote_addr << std::endl;
-
-      // join previous thread if it exists
-      if (camThread && camThread->joinable()) {
-        camThread->join();
-      }
-
       int length = 0;
       if (req.has_param("length")) {
         length = std::stoi(req.get_param_value("length"));
@@ -88,32 +214,237 @@ int main() {
         std::cout << "No cap-interval parameter specified" << std::endl;
       }
 
-      isCamRunning.store(true);
-      shouldRecordStop.store(false);
+      RecordOptions options;
+      options.timelapseLength = length;
+      options.capInterval = capInterval;
+      options.cameraId = cameraId;
+      options.framesDir = framesDir;
 
-      camThread = std::make_unique<std::thread>([length, capInterval, &isCamRunning]() {
-          int err = recordTimelapseHandler(length, capInterval);
-          isCamRunning.store(false);
-          
-          std::cout << "Timelapse finished with code " << err << std::endl;
-      });
+      if (req.has_param("cores")) {
+        options.cores = parseCoreList(req.get_param_value("cores"));
+      }
+
+      if (req.has_param("width")) {
+        options.width = std::stoi(req.get_param_value("width"));
+      }
+
+      if (req.has_param("height")) {
+        options.height = std::stoi(req.get_param_value("height"));
+      }
+
+      if (req.has_param("format")) {
+        std::string format = req.get_param_value("format");
+        if (format == "yuv420") {
+          options.format = CaptureFormat::Yuv420;
+        } else if (format == "nv12") {
+          options.format = CaptureFormat::Nv12;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'format'" << std::endl;
+          res.set_content("Error: invalid param value for 'format' (expected 'yuv420' or 'nv12').\n", "text/plain");
+          return;
+        }
+      }
+
+      if (req.has_param("sensor-mode")) {
+        std::string mode = req.get_param_value("sensor-mode");
+        if (mode == "auto") {
+          options.sensorMode = SensorMode::Auto;
+        } else if (mode == "binned") {
+          options.sensorMode = SensorMode::Binned;
+        } else if (mode == "full") {
+          options.sensorMode = SensorMode::Full;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'sensor-mode'" << std::endl;
+          res.set_content("Error: invalid param value for 'sensor-mode' (expected 'auto', 'binned' or 'full').\n", "text/plain");
+          return;
+        }
+      }
+
+      if (req.has_param("crop") && !parseCrop(req.get_param_value("crop"), options.crop)) {
+        res.status = 500;
+        std::cerr << "Invalid param value for 'crop'" << std::endl;
+        res.set_content("Error: invalid param value for 'crop' (expected x,y,width,height as fractions of the field of view).\n", "text/plain");
+        return;
+      }
+
+      if (req.has_param("encoders")) {
+        options.encoderThreads = std::stoi(req.get_param_value("encoders"));
+      }
+      if (req.has_param("queue-depth")) {
+        options.encoderQueueDepth = std::stoi(req.get_param_value("queue-depth"));
+      }
+      if (req.has_param("writer-buffers")) {
+        options.writerBuffers = std::stoi(req.get_param_value("writer-buffers"));
+      }
+      if (req.has_param("sync-every")) {
+        options.syncEvery = std::stoi(req.get_param_value("sync-every"));
+      }
+      if (req.has_param("queue-policy")) {
+        std::string policy = req.get_param_value("queue-policy");
+        if (policy == "block") {
+          options.queuePolicy = QueuePolicy::Block;
+        } else if (policy == "drop-oldest") {
+          options.queuePolicy = QueuePolicy::DropOldest;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'queue-policy'" << std::endl;
+          res.set_content("Error: invalid param value for 'queue-policy' (expected 'block' or 'drop-oldest').\n", "text/plain");
+          return;
+        }
+      }
 
-      res.set_content("Timelapse started\n", "text/plain");
+      if (req.has_param("encoder")) {
+        std::string encoder = req.get_param_value("encoder");
+        if (encoder == "sw") {
+          options.encoder = EncoderBackend::Software;
+        } else if (encoder == "hw") {
+          options.encoder = EncoderBackend::V4l2;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'encoder'" << std::endl;
+          res.set_content("Error: invalid param value for 'encoder' (expected 'sw' or 'hw').\n", "text/plain");
+          return;
+        }
+      }
+      if (req.has_param("store")) {
+        std::string store = req.get_param_value("store");
+        if (store == "files") {
+          options.frameStore = FrameStore::Files;
+        } else if (store == "segments") {
+          options.frameStore = FrameStore::Segments;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'store'" << std::endl;
+          res.set_content("Error: invalid param value for 'store' (expected 'files' or 'segments').\n", "text/plain");
+          return;
+        }
+      }
+      if (req.has_param("segment-frames")) {
+        options.segmentFrames = std::stoi(req.get_param_value("segment-frames"));
+      }
+      if (req.has_param("in-flight")) {
+        options.pipelined = (req.get_param_value("in-flight") == "true");
+      }
+      if (req.has_param("live")) {
+        options.liveEncode = (req.get_param_value("live") == "true");
+      }
+      if (req.has_param("stills")) {
+        options.writeStills = (req.get_param_value("stills") != "false");
+      }
+      if (req.has_param("fps")) {
+        options.liveFps = std::stoi(req.get_param_value("fps"));
+      }
+      if (req.has_param("preset")) {
+        options.livePreset = std::stoi(req.get_param_value("preset"));
+      }
+      if (req.has_param("crf")) {
+        options.liveCrf = std::stoi(req.get_param_value("crf"));
+      }
+      if (req.has_param("filename")) {
+        options.liveFilename = req.get_param_value("filename");
+      }
+      if (req.has_param("parts")) {
+        options.encodeParts = (req.get_param_value("parts") == "true");
+      }
+      if (req.has_param("part-frames")) {
+        options.partFrames = std::stoi(req.get_param_value("part-frames"));
+      }
+      if (req.has_param("adaptive")) {
+        options.adaptive = (req.get_param_value("adaptive") == "true");
+      }
+      if (req.has_param("max-interval")) {
+        options.maxInterval = std::stoi(req.get_param_value("max-interval"));
+      }
+      if (req.has_param("change-threshold")) {
+        options.changeThreshold = std::stoi(req.get_param_value("change-threshold"));
+      }
+      if (req.has_param("duplicate-still")) {
+        options.duplicateStill = (req.get_param_value("duplicate-still") == "true");
+      }
+      if (req.has_param("stabilize")) {
+        std::string stabilize = req.get_param_value("stabilize");
+        if (stabilize == "off") {
+          options.stabilize = Stabilization::Off;
+        } else if (stabilize == "exposure") {
+          options.stabilize = Stabilization::Exposure;
+        } else if (stabilize == "full") {
+          options.stabilize = Stabilization::Full;
+        } else {
+          res.status = 500;
+          std::cerr << "Invalid param value for 'stabilize'" << std::endl;
+          res.set_content("Error: invalid param value for 'stabilize' (expected 'off', 'exposure' or 'full').\n", "text/plain");
+          return;
+        }
+      }
+      if (req.has_param("target-luma")) {
+        options.targetLuma = std::clamp(std::stoi(req.get_param_value("target-luma")), 1, 254);
+      }
+      if (req.has_param("quota-mb")) {
+        options.quotaBytes = std::stoull(req.get_param_value("quota-mb")) << 20;
+      }
+      if (req.has_param("min-free")) {
+        options.minFreePercent = std::clamp(std::stoi(req.get_param_value("min-free")), 0, 99);
+      }
+      if (req.has_param("resume")) {
+        options.resume = (req.get_param_value("resume") == "true");
+      }
+
+      if (frameCleaner.usesDirectory(framesDir)) {
+        res.status = 500;
+        std::cerr << "Cannot start recording while the frame directory is being cleared" << std::endl;
+        res.set_content("Error: cannot start recording while the frame directory is being cleared.\n", "text/plain");
+        return;
+      }
+
+      if (options.resume && !std::filesystem::exists(framesDir / SESSION_FILE)) {
+        res.status = 500;
+        std::cerr << "No session to resume" << std::endl;
+        res.set_content("Error: there is no recording session to resume.\n", "text/plain");
+        return;
+      }
+
+      // renders run next to capture, but a new session would overwrite the frames a render of its directory is reading (resuming only appends)
+      if (!options.resume && renderJobs.usesDirectory(framesDir)) {
+        res.status = 500;
+        std::cerr << "Cannot start a new session while its frame directory is being rendered" << std::endl;
+        res.set_content("Error: cannot start a new session while the frame directory is being rendered.\n", "text/plain");
+        return;
+      }
+
+      // a second start that raced this one past the check above is refused here
+      uint64_t id = captureJobs.submit(options);
+      if (id == 0) {
+        res.status = 500;
+        std::cerr << "Camera has already been started." << std::endl;
+        res.set_content("Error: camera has already been started.\n", "text/plain");
+        return;
+      }
+
+      std::cout << "CAMERA " << cameraId << " STARTED by " << req.remote_addr << " (capture job " << id << ")" << std::endl;
+      res.set_content("Timelapse started\njob=" + std::to_string(id) + "\n", "text/plain");
     }
   });
 
 
-  svr.Get("/stop-cam", [&isCamRunning](const httplib::Request& req, httplib::Response& res) {
-    
-    if (!isCamRunning.load()) {
+  // stops the camera given by the camera param, or every camera without it
+  svr.Get("/stop-cam", [&captureJobs](const httplib::Request& req, httplib::Response& res) {
+
+    std::string cameraId;
+    std::filesystem::path framesDir;
+    if (req.has_param("camera") && !requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
+
+    // a job that is still setting up its camera is stopped too, its recording never starts
+    if (!captureJobs.stopCamera(cameraId)) {
       res.status = 500;
       std::cerr << "No camera is currently running" << std::endl;
       res.set_content("Error: no camera is currently running.\n", "text/plain");
     } else {
 
       std::cout << "STOPPING CAMERA..." << std::endl;
-      
-      shouldRecordStop.store(true);
 
       std::cout << "Succesfully stopped camera process" << std::endl;
       res.set_content("Timelapse has been stopped\n", "text/plain");
@@ -121,136 +452,339 @@ int main() {
   });
 
 
-  svr.Get("/clear-frames", [&isCamRunning](const httplib::Request& req, httplib::Response& res) {
-    if (isCamRunning.load()) {
+  // clears FRAME_PATH, or the frame directory of the camera given by the camera param, as a background job (see /cleanup-jobs)
+  svr.Get("/clear-frames", [&captureJobs, &renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
+
+    std::string cameraId;
+    std::filesystem::path framesDir = FRAME_PATH;
+    if (req.has_param("camera") && !requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
+
+    if (req.has_param("all") && req.get_param_value("all") != "true") {
+      res.status = 500;
+      std::cerr << "Invalid param value for 'all'" << std::endl;
+      res.set_content("Error: invalid param value for 'all'.\n", "text/plain");
+    } else if (captureJobs.usesDirectory(framesDir)) {
       res.status = 500;
       std::cerr << "Frames attempted to clear while camera running" << std::endl;
       res.set_content("Error: cannot clear frames while camera is running.\n", "text/plain");
+    } else if (renderJobs.usesDirectory(framesDir)) {
+      res.status = 500;
+      std::cerr << "Frames attempted to clear while being rendered" << std::endl;
+      res.set_content("Error: cannot clear frames while they are being rendered.\n", "text/plain");
+    } else if (frameCleaner.usesDirectory(framesDir)) {
+      res.status = 500;
+      std::cerr << "Frames attempted to clear while already being cleared" << std::endl;
+      res.set_content("Error: the frames are already being cleared.\n", "text/plain");
     } else {
 
-      std::cout << "Clearing frames..." << std::endl;
+      // all=true removes every regular file in the frame directory, otherwise just the frames (and frame segments)
+      // along with the manifest, render lists, session state and encoded parts that only describe them
+      bool all = req.has_param("all");
+      uint64_t id = frameCleaner.submit(framesDir, all);
 
-      // remove all regular files in frame directory if specified
-      if (req.has_param("all")) {
-        if (req.get_param_value("all") != "true") {
-          res.status = 500;
-          std::cerr << "Invalid param value for 'all'" << std::endl;
-          res.set_content("Error: invalid param value for 'all'.\n", "text/plain");
-        } else {
+      std::cout << "Clearing frames... (cleanup job " << id << ")" << std::endl;
+      res.set_content(std::string(all ? "Clearing all files" : "Clearing frames") + " in the background\njob=" + std::to_string(id) + "\n", "text/plain");
+    }
+  });
 
-          for (const auto& file : std::filesystem::directory_iterator(FRAME_PATH)) {
-            if (file.is_regular_file()) {
-              std::filesystem::remove(file.path());
-            }
-          }
 
-          std::cout << "Removed all files in frame path" << std::endl;
-          
-          res.set_content("All files have been successfully cleared\n", "text/plain");
-        }
-      } else { // just remove frames if other files not specified
-        
-        for (const auto& file : std::filesystem::directory_iterator(FRAME_PATH)) {
-          if (file.is_regular_file() && file.path().extension() == ".jpg") {
-            std::filesystem::remove(file.path());
-          }
-        }
-        
-        res.set_content("Frames have been successfully cleared\n", "text/plain");
-      } 
+  // status of one cleanup job (id param) or of every known job
+  svr.Get("/cleanup-jobs", [&frameCleaner](const httplib::Request& req, httplib::Response& res) {
+
+    if (req.has_param("id")) {
+      CleanupStatus status;
+      if (!frameCleaner.find(std::stoull(req.get_param_value("id")), status)) {
+        res.status = 404;
+        res.set_content("Error: no such cleanup job.\n", "text/plain");
+        return;
+      }
+
+      res.set_content(formatCleanupStatus(status), "text/plain");
+      return;
+    }
+
+    std::string body;
+    for (const CleanupStatus &status : frameCleaner.list()) {
+      body += formatCleanupStatus(status);
     }
+
+    res.set_content(body.empty() ? "No cleanup jobs\n" : body, "text/plain");
   });
 
 
-  svr.Get("/create-timelapse", [&isCamRunning, &isCreatingTimelapse, &createTimelapseThread](const httplib::Request& req, httplib::Response& res) {
+  svr.Get("/create-timelapse", [&renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
 
-    if (isCamRunning.load()) {
+    // a finished session moved out of FRAME_PATH can be rendered while the next one records
+    std::string cameraId;
+    std::filesystem::path framesDir = FRAME_PATH;
+    if (req.has_param("camera") && !requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
+    if (req.has_param("frames")) {
+      framesDir = req.get_param_value("frames");
+      if (!std::filesystem::is_directory(framesDir)) {
+        res.status = 404;
+        std::cerr << "Cannot create timelapse, " << framesDir << " is not a directory" << std::endl;
+        res.set_content("Error: cannot create timelapse, the frames param does not point to an existing directory.\n", "text/plain");
+        return;
+      }
+    }
+
+    if (frameCleaner.usesDirectory(framesDir)) {
       res.status = 500;
-      std::cerr << "Camera is currently running, cannot create timelapse" << std::endl;
-      res.set_content("Error: cannot create timelapse, camera is currently running.\n", "text/plain");
-    } else if (isCreatingTimelapse.load()) {
+      std::cerr << "Cannot create timelapse, the frame directory is being cleared" << std::endl;
+      res.set_content("Error: cannot create timelapse, the frame directory is being cleared.\n", "text/plain");
+      return;
+    }
+
+    // check if directory has frames
+    if (std::filesystem::is_empty(framesDir)) {
       res.status = 500;
-      std::cerr << "Cannot create timelapse while timelapse is already being created" << std::endl;
-      res.set_content("Error: cannot create timelapse, timelapse is already being created.\n", "text/plain");
-    } else {
+      std::cerr << "Cannot create timelapse, no frames in frame directory" << std::endl;
+      res.set_content("Error: cannot create timelapse, there are no frames in frame directory.\n", "text/plain");
+      return;
+    }
 
-      // check if directory has frames
-      if (std::filesystem::is_empty(FRAME_PATH)) {
+    // check if timelapse directory exists
+    if (!std::filesystem::exists(TIMELAPSE_PATH) || !std::filesystem::is_directory(TIMELAPSE_PATH)) {
+      res.status = 404;
+      std::cerr << "Cannot create timelapse, the timelapse path does not point to an existing directory" << std::endl;
+      res.set_content("Error: cannot create timelapse, the timelapse path does not point to an existing directory.\n", "text/plain");
+      return;
+    }
+
+    RenderOptions request;
+    request.framesDir = framesDir;
+
+    // a profile sets every encode option, the params after it adjust single ones
+    std::string profileName = req.has_param("profile") ? req.get_param_value("profile") : "default";
+    if (!findRenderProfile(profileName, request.profile)) {
+      res.status = 500;
+      std::cerr << "Unknown render profile " << profileName << std::endl;
+      res.set_content("Error: unknown render profile, see /render-profiles.\n", "text/plain");
+      return;
+    }
+
+    RenderProfile &profile = request.profile;
+
+    if (req.has_param("fps")) {
+      request.fps = std::stoi(req.get_param_value("fps"));
+    }
+    if (req.has_param("filename")) {
+      request.filename = req.get_param_value("filename");
+    }
+    if (req.has_param("preset")) {
+      // the old numeric presets still work next to x264/x265 preset names
+      std::string preset = req.get_param_value("preset");
+      if (preset == "1") {
+        profile.preset = "medium";
+      } else if (preset == "2") {
+        profile.preset = "faster";
+      } else if (preset == "3") {
+        profile.preset = "veryfast";
+      } else {
+        profile.preset = preset;
+      }
+    }
+    if (req.has_param("crf")) {
+      int crf = std::stoi(req.get_param_value("crf"));
+      if (crf > -1 && crf <= 51) {
+        profile.crf = crf;
+      }
+    }
+    if (req.has_param("encoder") && !parseVideoCodec(req.get_param_value("encoder"), profile.codec)) {
+      res.status = 500;
+      std::cerr << "Invalid param value for 'encoder'" << std::endl;
+      res.set_content("Error: invalid param value for 'encoder' (x264, x265 or hw).\n", "text/plain");
+      return;
+    }
+    if (req.has_param("tune")) {
+      profile.tune = req.get_param_value("tune");
+    }
+    if (req.has_param("threads")) {
+      profile.threads = std::stoi(req.get_param_value("threads"));
+    }
+    if (req.has_param("width")) {
+      profile.width = std::stoi(req.get_param_value("width"));
+    }
+
+    // frame selection, picked from the manifest so only the frames used are ever read
+    FrameSelection &selection = request.selection;
+
+    if (req.has_param("stride")) {
+      selection.stride = std::max(1, std::stoi(req.get_param_value("stride")));
+    }
+    if (req.has_param("start-ms")) {
+      selection.startUnixMs = std::stoll(req.get_param_value("start-ms"));
+    }
+    if (req.has_param("end-ms")) {
+      selection.endUnixMs = std::stoll(req.get_param_value("end-ms"));
+    }
+    if (req.has_param("from") || req.has_param("to")) {
+      if (!parseTimeOfDay(req.get_param_value("from"), selection.dayStartMinute) ||
+          !parseTimeOfDay(req.get_param_value("to"), selection.dayEndMinute)) {
         res.status = 500;
-        std::cerr << "Cannot create timelapse, no frames in frame directory" << std::endl;
-        res.set_content("Error: cannot create timelapse, there are no frames in frame directory.\n", "text/plain");
+        std::cerr << "Invalid param value for 'from'/'to'" << std::endl;
+        res.set_content("Error: 'from' and 'to' must both be given as HH:MM.\n", "text/plain");
         return;
       }
+    }
+    if (req.has_param("max-length")) {
+      request.maxSeconds = std::stoi(req.get_param_value("max-length"));
+    }
+    if (req.has_param("deflicker")) {
+      request.deflicker = std::max(0, std::stoi(req.get_param_value("deflicker")));
+    }
+
+    // renders queue up behind each other instead of being refused
+    uint64_t id = renderJobs.submit(request);
+
+    std::cout << "CREATING TIMELAPSE... (render job " << id << ")" << std::endl;
+    res.set_content("Creating timelapse... this may take awhile\njob=" + std::to_string(id) + "\n", "text/plain");
+  });
+
+
+  // built in render profiles, as used by the profile param of /create-timelapse
+  svr.Get("/render-profiles", [](const httplib::Request& req, httplib::Response& res) {
+    std::string body;
+    for (const std::string &name : renderProfileNames()) {
+      RenderProfile profile;
+      findRenderProfile(name, profile);
+      body += formatRenderProfile(profile);
+    }
+    res.set_content(body, "text/plain");
+  });
+
 
-      // check if timelapse directory exists
-      if (!std::filesystem::exists(TIMELAPSE_PATH) || !std::filesystem::is_directory(TIMELAPSE_PATH)) {
+  // status of one render job (id param) or of every known job
+  svr.Get("/render-jobs", [&renderJobs](const httplib::Request& req, httplib::Response& res) {
+
+    if (req.has_param("id")) {
+      RenderJobStatus status;
+      if (!renderJobs.find(std::stoull(req.get_param_value("id")), status)) {
         res.status = 404;
-        std::cerr << "Cannot create timelapse, the timelapse path does not point to an existing directory" << std::endl;
-        res.set_content("Error: cannot create timelapse, the timelapse path does not point to an existing directory.\n", "text/plain");
+        res.set_content("Error: no such render job.\n", "text/plain");
         return;
       }
 
-      // join previous thread if it exists
-      if (createTimelapseThread && createTimelapseThread->joinable()) {
-        createTimelapseThread->join();
-      }
+      res.set_content(formatJobStatus(status), "text/plain");
+      return;
+    }
 
-      int fps = 0;
-      int preset = 0;
-      int crf = -1;
-      std::string requestedFilename = "";
+    std::string body;
+    for (const RenderJobStatus &status : renderJobs.list()) {
+      body += formatJobStatus(status);
+    }
 
-      if (req.has_param("fps")) {
-        fps = std::stoi(req.get_param_value("fps"));
-      }
-      if (req.has_param("preset")) {
-        preset = std::stoi(req.get_param_value("preset"));
-      }
-      if (req.has_param("crf")) {
-        crf = std::stoi(req.get_param_value("crf"));
-      }
-      if (req.has_param("filename")) {
-        requestedFilename = req.get_param_value("filename");
-      }
-      
-      std::cout << "CREATING TIMELAPSE..." << std::endl;
-      res.set_content("Creating timelapse... this may take awhile\n", "text/plain");
+    res.set_content(body.empty() ? "No render jobs\n" : body, "text/plain");
+  });
 
-      isCreatingTimelapse.store(true);
 
-      createTimelapseThread = std::make_unique<std::thread>([fps, preset, crf, requestedFilename, &res, &isCreatingTimelapse]() {
-        int err = createTimelapseHandler(fps, preset, crf, requestedFilename);
-        isCreatingTimelapse.store(false);
+  // every capture, render and cleanup job, oldest first, each line starting with its kind
+  // with since= and wait= this is a long poll that answers once a job changes (see waitForJobs())
+  svr.Get("/jobs", [&captureJobs, &renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
 
-        std::cout << "Timelapse creation finished with code " << err << std::endl;
-      });
+    uint64_t sequence = waitForJobs(req);
+
+    std::vector<std::pair<uint64_t, std::string>> lines;
+    for (const CaptureJobStatus &status : captureJobs.list()) {
+      lines.emplace_back(status.id, "kind=capture " + formatCaptureStatus(status));
+    }
+    for (const RenderJobStatus &status : renderJobs.list()) {
+      lines.emplace_back(status.id, "kind=render " + formatJobStatus(status));
+    }
+    for (const CleanupStatus &status : frameCleaner.list()) {
+      lines.emplace_back(status.id, "kind=cleanup " + formatCleanupStatus(status));
+    }
+
+    // job IDs are shared by every kind and only ever grow
+    std::sort(lines.begin(), lines.end());
+
+    std::string body;
+    for (const auto &[id, line] : lines) {
+      body += line;
     }
+
+    res.set_header("X-Job-Sequence", std::to_string(sequence));
+    res.set_content(body.empty() ? "No jobs\n" : body, "text/plain");
   });
 
 
-  svr.Get("/stop-create", [&isCreatingTimelapse](const httplib::Request& req, httplib::Response& res) {
-    
-    // check if timelapse is already being created and return an error if it is not
-    if (!isCreatingTimelapse.load()) {
+  // status, progress and ETA of one job, since= and wait= work as on /jobs
+  svr.Get("/jobs/:id", [&captureJobs, &renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
+
+    uint64_t sequence = waitForJobs(req);
+    uint64_t id = std::stoull(req.path_params.at("id"));
+
+    CaptureJobStatus capture;
+    RenderJobStatus render;
+    CleanupStatus cleanup;
+
+    res.set_header("X-Job-Sequence", std::to_string(sequence));
+
+    if (captureJobs.find(id, capture)) {
+      res.set_content("kind=capture " + formatCaptureStatus(capture), "text/plain");
+    } else if (renderJobs.find(id, render)) {
+      res.set_content("kind=render " + formatJobStatus(render), "text/plain");
+    } else if (frameCleaner.find(id, cleanup)) {
+      res.set_content("kind=cleanup " + formatCleanupStatus(cleanup), "text/plain");
+    } else {
+      res.status = 404;
+      res.set_content("Error: no such job.\n", "text/plain");
+    }
+  });
+
+
+  // cancels a job of any kind: a recording stops and keeps its frames, a render stops its ffmpeg, a cleanup stops after its batch
+  svr.Get("/jobs/:id/cancel", [&captureJobs, &renderJobs, &frameCleaner](const httplib::Request& req, httplib::Response& res) {
+
+    uint64_t id = std::stoull(req.path_params.at("id"));
+
+    if (captureJobs.cancel(id) || renderJobs.cancel(id) || frameCleaner.cancel(id)) {
+      std::cout << "CANCELLING JOB " << id << std::endl;
+      res.set_content("Job " + std::to_string(id) + " is being cancelled.\n", "text/plain");
+      return;
+    }
+
+    CaptureJobStatus capture;
+    RenderJobStatus render;
+    CleanupStatus cleanup;
+
+    if (captureJobs.find(id, capture) || renderJobs.find(id, render) || frameCleaner.find(id, cleanup)) {
       res.status = 500;
-      std::cerr << "No timelapse is currently being created" << std::endl;
-      res.set_content("Error: no timelapse is currently being created.\n", "text/plain");
-    } else { // stop timelapse creation (creating thread will read shouldCreateStop and will stop)
-      std::cout << "STOPPING TIMELAPSE CREATION..." << std::endl;
-      shouldCreateStop.store(true);
-      res.set_content("Timelapse creation is being stopped.\n", "text/plain");
+      std::cerr << "Job " << id << " is not queued or running" << std::endl;
+      res.set_content("Error: that job is not queued or running.\n", "text/plain");
+    } else {
+      res.status = 404;
+      res.set_content("Error: no such job.\n", "text/plain");
     }
   });
 
-  svr.Get("/download-timelapse", [&isDownloadingTimelapse](const httplib::Request& req, httplib::Response& res) {
-    
-    // check if timelapse is already being downloaded on client and return error if so
-    if (isDownloadingTimelapse.load()) {
+
+  svr.Get("/stop-create", [&renderJobs](const httplib::Request& req, httplib::Response& res) {
+
+    // stop one job if an id is given, otherwise every queued and running render
+    if (req.has_param("id")) {
+      if (!renderJobs.cancel(std::stoull(req.get_param_value("id")))) {
+        res.status = 500;
+        std::cerr << "Render job is not queued or running" << std::endl;
+        res.set_content("Error: that render job is not queued or running.\n", "text/plain");
+        return;
+      }
+    } else if (renderJobs.cancelAll() == 0) {
       res.status = 500;
-      std::cerr << "Timelapse is currently being downloaded" << std::endl;
-      res.set_content("Error: A timelapse is already being downloaded.\n", "text/plain");
+      std::cerr << "No timelapse is currently being created" << std::endl;
+      res.set_content("Error: no timelapse is currently being created.\n", "text/plain");
       return;
-    } 
+    }
+
+    std::cout << "STOPPING TIMELAPSE CREATION..." << std::endl;
+    res.set_content("Timelapse creation is being stopped.\n", "text/plain");
+  });
+
+  svr.Get("/download-timelapse", [](const httplib::Request& req, httplib::Response& res) {
 
     // check if client requested a filename and if the file exists on the timelapse server
     if (!req.has_param("filename")) {
@@ -275,52 +809,223 @@ int main() {
       return;
     }
 
-    std::cout << "CLIENT DOWNLOADING..." << filepath.string() << "..." << std::endl;
-
-    // create shared pointer to the timelapse
-    auto videoFile = std::make_shared<std::ifstream>(filepath, std::ios::binary);
-    if (!videoFile->is_open()) {
-      std::cerr << "Could not open timelapse file" << std::endl;
+    auto file = std::make_shared<MappedFile>();
+    int err = file->open(filepath);
+    if (err < 0) {
+      std::cerr << "Cannot map " << filepath << ": " << std::strerror(-err) << std::endl;
       res.status = 500;
-      std::string error = std::format("Error: Failed to open timelapse {}.\n", filepath.string());
-      res.set_content(error, "text/plain");
+      res.set_content("Error: cannot read the timelapse.\n", "text/plain");
+      return;
     }
 
-    // tell client to treat it as a file download and name the file
-    res.set_header("Content-Disposition", "attachment; filename=\"" + filepath.filename().string() + "\"");
+    if (activeDownloads.fetch_add(1) >= DOWNLOAD_MAX_CLIENTS) {
+      activeDownloads.fetch_sub(1);
+      std::cerr << "Too many downloads, refusing " << filepath << std::endl;
+      res.status = 503;
+      res.set_header("Retry-After", "30");
+      res.set_content("Error: too many downloads are running, try again later.\n", "text/plain");
+      return;
+    }
 
-    auto filesize = std::filesystem::file_size(filepath);
+    std::cout << "CLIENT DOWNLOADING..." << filepath.string() << "..." << std::endl;
 
-    isDownloadingTimelapse.store(true);
+    // tell client to treat it as a file download and name the file
+    res.set_header("Content-Disposition", "attachment; filename=\"" + filepath.filename().string() + "\"");
+    res.set_header("Accept-Ranges", "bytes");
 
+    // streamed straight from the mapping (no per chunk copies), httplib answers Range requests with 206 and asks for each range
+    // a chunk at a time, a client that goes away fails the write, so only bytes the socket accepted are counted
     res.set_content_provider(
-      filesize, 
-      "video/mp4",
-      [videoFile](size_t offset, size_t length, httplib::DataSink &sink) { // register the streaming lambda, passing the pointer to the timelapse file
-
-        // seek to position in file that httplib requests (cast to streamoff because that's what seekg takes)
-        videoFile->seekg(static_cast<std::streamoff>(offset));
-        
-        // create byte buffer that is size of requested chunk
-        std::vector<char> buffer(length);
-
-        // read data from the file into the buffer at chunk length
-        videoFile->read(buffer.data(), static_cast<std::streamsize>(length));
-
-        auto bytesRead = videoFile->gcount(); // returns how many bytes were read in the last read call
-        if (bytesRead <= 0) return false; // signals httplib to exit read loop if no more bytes were read
-       
-        // writes data in buffer to client socket (via httplib DataSink object)
-        sink.write(buffer.data(), bytesRead);
-        
+      file->size(), "video/mp4",
+      [file](size_t offset, size_t length, httplib::DataSink &sink) {
+        size_t chunk = std::min(length, DOWNLOAD_CHUNK_BYTES);
+        if (!sink.write(reinterpret_cast<const char *>(file->data()) + offset, chunk)) {
+          return false;
+        }
+        countMetric(Metric::DownloadBytes, chunk);
         return true;
       },
-      // clear isDownloadingTimelapse once httplib is done with lambda (finished streaming)
-      [&isDownloadingTimelapse](bool success) {
-        isDownloadingTimelapse.store(false);
+      [](bool success) {
+        activeDownloads.fetch_sub(1);
+        if (success) {
+          countMetric(Metric::Downloads);
+        }
+      });
+  });
+
+  // contact sheet (or scrub strip with layout=strip) of evenly spaced frames of a session, decoded at thumbnail size only
+  svr.Get("/thumbnails", [](const httplib::Request& req, httplib::Response& res) {
+
+    std::string cameraId;
+    std::filesystem::path framesDir = FRAME_PATH;
+    if (req.has_param("camera") && !requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
+    if (req.has_param("frames")) {
+      framesDir = req.get_param_value("frames");
+    }
+
+    if (!std::filesystem::is_directory(framesDir)) {
+      res.status = 404;
+      std::cerr << "Cannot create thumbnails, " << framesDir << " is not a directory" << std::endl;
+      res.set_content("Error: cannot create thumbnails, the frame directory does not exist.\n", "text/plain");
+      return;
+    }
+
+    SheetOptions options;
+
+    if (req.has_param("count")) {
+      options.frames = static_cast<size_t>(std::clamp(std::stoi(req.get_param_value("count")), 1, static_cast<int>(SHEET_MAX_FRAMES)));
+    }
+
+    if (req.has_param("columns")) {
+      options.columns = std::clamp(std::stoi(req.get_param_value("columns")), 0, static_cast<int>(SHEET_MAX_FRAMES));
+    }
+
+    if (req.has_param("scale")) {
+      options.scaleDenom = std::stoi(req.get_param_value("scale"));
+    }
+
+    if (req.has_param("quality")) {
+      options.quality = std::clamp(std::stoi(req.get_param_value("quality")), 1, 100);
+    }
+
+    if (req.has_param("layout")) {
+      std::string layout = req.get_param_value("layout");
+      if (layout == "grid") {
+        options.layout = SheetLayout::Grid;
+      } else if (layout == "strip") {
+        options.layout = SheetLayout::Strip;
+      } else {
+        res.status = 500;
+        std::cerr << "Invalid param value for 'layout'" << std::endl;
+        res.set_content("Error: invalid param value for 'layout' (expected 'grid' or 'strip').\n", "text/plain");
+        return;
       }
-    );
+    }
+
+    SheetImage sheet;
+    int err = contactSheet(framesDir, options, sheet);
 
+    if (err == -ENOENT) {
+      res.status = 404;
+      res.set_content("Error: there are no frames in the frame directory.\n", "text/plain");
+      return;
+    }
+    if (err == -E2BIG) {
+      res.status = 500;
+      res.set_content("Error: the sheet would be too large, use a lower count, fewer columns or a higher scale.\n", "text/plain");
+      return;
+    }
+    if (err < 0) {
+      res.status = 500;
+      std::cerr << "Cannot create thumbnails: " << std::strerror(-err) << std::endl;
+      res.set_content("Error: cannot create thumbnails.\n", "text/plain");
+      return;
+    }
+
+    // the sheet shows the session as it was when the request came in
+    res.set_header("Cache-Control", "no-cache");
+    res.set_content(reinterpret_cast<const char *>(sheet->data()), sheet->size(), "image/jpeg");
+  });
+
+  // per stage latencies of the current (or last) recording session
+  svr.Get("/stage-stats", [](const httplib::Request& req, httplib::Response& res) {
+    std::string report = stageReport();
+    res.set_content(report.empty() ? "No frames recorded yet\n" : report, "text/plain");
+  });
+
+  // live MJPEG preview of the camera while it records, every viewer is sent the same compressed frames
+  svr.Get("/preview", [](const httplib::Request& req, httplib::Response& res) {
+    std::string cameraId;
+    std::filesystem::path framesDir;
+    if (!requestCamera(req, res, cameraId, framesDir)) {
+      return;
+    }
+
+    PreviewHub &hub = previewHub(cameraId);
+    if (!hub.addViewer(PREVIEW_MAX_VIEWERS)) {
+      res.status = 503;
+      res.set_content("Error: too many preview viewers.\n", "text/plain");
+      return;
+    }
+
+    res.set_header("Cache-Control", "no-cache");
+
+    auto sequence = std::make_shared<uint64_t>(0);
+
+    res.set_chunked_content_provider("multipart/x-mixed-replace; boundary=frame", [sequence, &hub](size_t offset, httplib::DataSink &sink) {
+      PreviewFrame frame;
+
+      // frames only arrive while the camera is recording, in between the viewer just waits
+      if (!hub.waitFrame(*sequence, frame, std::chrono::milliseconds(1000))) {
+        return !hub.closed() && sink.is_writable();
+      }
+
+      std::string header = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(frame->size()) + "\r\n\r\n";
+
+      return sink.write(header.data(), header.size()) &&
+             sink.write(reinterpret_cast<const char *>(frame->data()), frame->size()) &&
+             sink.write("\r\n", 2);
+    }, [&hub](bool success) {
+      hub.removeViewer();
+    });
+  });
+
+  // counters, latencies and gauges in the Prometheus text format
+  svr.Get("/metrics", [&renderJobs](const httplib::Request& req, httplib::Response& res) {
+    std::string body = formatMetrics();
+
+    std::error_code ec;
+    std::filesystem::space_info space = std::filesystem::space(FRAME_PATH, ec);
+    if (!ec) {
+      appendMetric(body, "timelapse_frame_path_free_bytes", "gauge", "Bytes available to unprivileged users on FRAME_PATH.", static_cast<double>(space.available));
+      appendMetric(body, "timelapse_frame_path_size_bytes", "gauge", "Size of the filesystem holding FRAME_PATH.", static_cast<double>(space.capacity));
+    }
+
+    PipelineDepths depths = pipelineDepths();
+    appendMetric(body, "timelapse_cameras_recording", "gauge", "Cameras that are recording.", static_cast<double>(recordings().size()));
+    appendMetric(body, "timelapse_encoder_queue_depth", "gauge", "Completed frames waiting for an encoder thread.", static_cast<double>(depths.encoderQueue));
+    appendMetric(body, "timelapse_writer_queue_depth", "gauge", "Compressed frames waiting for storage.", static_cast<double>(depths.writerQueue));
+    appendMetric(body, "timelapse_preview_viewers", "gauge", "Clients watching the live preview.", previewViewers());
+    appendMetric(body, "timelapse_downloads_active", "gauge", "Timelapse downloads being sent.", activeDownloads.load());
+
+    int queued = 0;
+    int running = 0;
+    RenderJobStatus current;
+    for (const RenderJobStatus &status : renderJobs.list()) {
+      queued += (status.state == JobState::Queued) ? 1 : 0;
+      if (status.state == JobState::Running) {
+        running++;
+        current = status;
+      }
+    }
+
+    appendMetric(body, "timelapse_render_jobs_queued", "gauge", "Render jobs waiting to start.", queued);
+    appendMetric(body, "timelapse_render_jobs_running", "gauge", "Render jobs running.", running);
+    appendMetric(body, "timelapse_render_frames_done", "gauge", "Frames encoded by the running render.", static_cast<double>(current.framesDone));
+    appendMetric(body, "timelapse_render_frames_total", "gauge", "Frames the running render encodes, 0 if unknown.", static_cast<double>(current.totalFrames));
+    appendMetric(body, "timelapse_render_fps", "gauge", "Encode speed of the running render in frames per second.", current.encodeFps);
+
+    res.set_content(body, "text/plain; version=0.0.4");
+  });
+
+  // cameras on the system by index, the camera param of the other endpoints takes either
+  svr.Get("/cameras", [](const httplib::Request& req, httplib::Response& res) {
+    std::vector<RecordingInfo> active = recordings();
+    std::vector<std::string> ids = cameraIds();
+
+    std::string body;
+    for (size_t i = 0; i < ids.size(); i++) {
+      std::string cameraId;
+      std::filesystem::path framesDir;
+      findCamera(ids[i], cameraId, framesDir);
+
+      bool recording = std::any_of(active.begin(), active.end(), [&](const RecordingInfo &info) { return info.cameraId == ids[i]; });
+      body += "index=" + std::to_string(i) + " id=" + ids[i] + " recording=" + (recording ? "true" : "false") + " frames=" + framesDir.string() + "\n";
+    }
+
+    res.set_content(body.empty() ? "No cameras\n" : body, "text/plain");
   });
 
   svr.Get("/shutdown", [](const httplib::Request& req, httplib::Response& res) {
@@ -332,20 +1037,26 @@ int main() {
 
   svr.listen("0.0.0.0", 8000);
 
-  if (camThread) {
-    std::cout << "Server stopped, waiting for camera to finish..." << std::endl;
-    if (camThread->joinable()) {
-      camThread->join();
-    }
+  bool recording = captureJobs.busy();
+  if (recording) {
+    std::cout << "Server stopped, waiting for cameras to finish..." << std::endl;
+  }
+  captureJobs.stop();
+  if (recording) {
     std::cout << "Camera shutdown complete." << std::endl;
   }
+  if (managerOpen) {
+    closeCameraManager();
+  }
+  releaseWarmCameras();
 
-  if (createTimelapseThread) {
-    std::cout << "Server stopped, waiting for timelapse to finish..." << std::endl;
-    if (createTimelapseThread->joinable()) {
-      createTimelapseThread->join();
-    }
+  if (renderJobs.busy()) {
+    std::cout << "Server stopped, cancelling renders..." << std::endl;
   }
+  renderJobs.stop();
+
+  // a clear still running stops after its current batch, it can be started again to finish
+  frameCleaner.stop();
 
   globalServer = nullptr;
 
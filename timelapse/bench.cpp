@@ -0,0 +1,325 @@
+#include "jpeg_encoder.h"
+#include "frame_writer.h"
+#include "kernels.h"
+#include "stage_stats.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// replays YUV420 frames through the same encode and write stages as the recorder, without a camera
+
+
+struct BenchOptions {
+  int frames = 300;
+  int width = 1920;
+  int height = 1080;
+  int quality = 90;
+  int threads = 2;
+  int queueDepth = 4;
+  int writerBuffers = 8;
+  int syncEvery = 100;
+  bool scanlines = false; // force the scanline (convert) encode path
+  FrameStore store = FrameStore::Files; // layout of written frames
+  KernelPath kernels = kernelPath(); // pixel kernel implementation
+  std::string input; // raw I420 file, frames are cycled (empty generates synthetic frames)
+  std::string out; // directory frames are written to (empty skips the write stage)
+};
+
+
+struct BenchJob {
+  const uint8_t *frame = nullptr;
+  uint64_t index = 0;
+  uint64_t completedNs = 0;
+};
+
+
+static void usage() {
+  std::cout << "Usage: bench [--frames N] [--width W] [--height H] [--quality Q] [--threads N] [--queue-depth N]\n"
+            << "             [--writer-buffers N] [--sync-every N] [--scanlines] [--kernels scalar|neon]\n"
+            << "             [--input frames.yuv] [--out dir] [--store files|segments]" << std::endl;
+}
+
+
+// parses "--name value" pairs, returns false on anything it does not understand
+static bool parseArgs(int argc, char *argv[], BenchOptions &options) {
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--scanlines") {
+      options.scanlines = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      return false;
+    }
+    std::string value = argv[++i];
+
+    try {
+      if (arg == "--frames") options.frames = std::stoi(value);
+      else if (arg == "--width") options.width = std::stoi(value);
+      else if (arg == "--height") options.height = std::stoi(value);
+      else if (arg == "--quality") options.quality = std::stoi(value);
+      else if (arg == "--threads") options.threads = std::stoi(value);
+      else if (arg == "--queue-depth") options.queueDepth = std::stoi(value);
+      else if (arg == "--writer-buffers") options.writerBuffers = std::stoi(value);
+      else if (arg == "--sync-every") options.syncEvery = std::stoi(value);
+      else if (arg == "--kernels" && (value == "scalar" || value == "neon")) options.kernels = (value == "neon") ? KernelPath::Neon : KernelPath::Scalar;
+      else if (arg == "--store" && (value == "files" || value == "segments")) options.store = (value == "segments") ? FrameStore::Segments : FrameStore::Files;
+      else if (arg == "--input") options.input = value;
+      else if (arg == "--out") options.out = value;
+      else return false;
+    } catch (const std::exception &) {
+      return false;
+    }
+  }
+
+  return options.frames > 0 && options.width > 1 && options.height > 1 && options.threads > 0 && options.queueDepth > 0;
+}
+
+
+// a handful of distinct frames (moving gradient plus noise) so the encoder does not see the same frame every time
+static std::vector<uint8_t> syntheticFrames(int width, int height, int count, size_t frameSize) {
+
+  std::vector<uint8_t> data(frameSize * count);
+  int chromaWidth = (width + 1) / 2;
+  int chromaHeight = (height + 1) / 2;
+  uint32_t seed = 12345;
+
+  for (int f = 0; f < count; f++) {
+    uint8_t *y = data.data() + frameSize * f;
+    uint8_t *u = y + static_cast<size_t>(width) * height;
+    uint8_t *v = u + static_cast<size_t>(chromaWidth) * chromaHeight;
+
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        seed = seed * 1103515245 + 12345;
+        y[static_cast<size_t>(row) * width + col] = static_cast<uint8_t>(((col + f * 16) * 255 / width + row / 8 + ((seed >> 16) & 15)) & 0xff);
+      }
+    }
+
+    for (int row = 0; row < chromaHeight; row++) {
+      for (int col = 0; col < chromaWidth; col++) {
+        u[static_cast<size_t>(row) * chromaWidth + col] = static_cast<uint8_t>(128 + (col - chromaWidth / 2) * 64 / chromaWidth);
+        v[static_cast<size_t>(row) * chromaWidth + col] = static_cast<uint8_t>(128 + (row - chromaHeight / 2) * 64 / chromaHeight);
+      }
+    }
+  }
+
+  return data;
+}
+
+
+// times each pixel kernel on its own over the source frames
+static void benchKernels(const BenchOptions &options, const uint8_t *source, size_t sourceFrames, size_t frameSize) {
+
+  int chromaWidth = (options.width + 1) / 2;
+  int chromaHeight = (options.height + 1) / 2;
+  size_t lumaSize = static_cast<size_t>(options.width) * options.height;
+
+  std::vector<uint8_t> row(static_cast<size_t>(options.width) * 3);
+  std::vector<uint8_t> half(static_cast<size_t>(options.width / 2) * (options.height / 2));
+  uint32_t histogram[256];
+  uint64_t checksum = 0;
+
+  LatencyHistogram convert, downscale, sum, count;
+  int iterations = std::min(options.frames, 100);
+
+  for (int i = 0; i < iterations; i++) {
+    const uint8_t *y = source + frameSize * (i % sourceFrames);
+    const uint8_t *u = y + lumaSize;
+    const uint8_t *v = u + static_cast<size_t>(chromaWidth) * chromaHeight;
+
+    uint64_t start = stageClockNs();
+    for (int r = 0; r < options.height; r++) {
+      interleaveYuv420Row(y + static_cast<size_t>(r) * options.width, u + static_cast<size_t>(r / 2) * chromaWidth,
+                          v + static_cast<size_t>(r / 2) * chromaWidth, row.data(), options.width);
+    }
+    convert.record(stageClockNs() - start);
+    checksum += row[0];
+
+    start = stageClockNs();
+    downscale2x(y, options.width, options.width, options.height, half.data(), options.width / 2);
+    downscale.record(stageClockNs() - start);
+    checksum += half[0];
+
+    start = stageClockNs();
+    checksum += lumaSum(y, options.width, options.height, options.width);
+    sum.record(stageClockNs() - start);
+
+    start = stageClockNs();
+    lumaHistogram(y, options.width, options.height, options.width, histogram);
+    count.record(stageClockNs() - start);
+    checksum += histogram[128];
+  }
+
+  std::cout << "Kernels (" << kernelPathName(kernelPath()) << ", per frame, checksum " << checksum << "):\n"
+            << summaryLine("interleave", convert.summary()) << summaryLine("downscale", downscale.summary())
+            << summaryLine("sum", sum.summary()) << summaryLine("histogram", count.summary()) << std::flush;
+}
+
+
+int main(int argc, char *argv[]) {
+
+  BenchOptions options;
+  if (!parseArgs(argc, argv, options)) {
+    usage();
+    return 1;
+  }
+
+  if (!setKernelPath(options.kernels)) {
+    std::cerr << "NEON kernels are not available in this build" << std::endl;
+    return 1;
+  }
+
+  int chromaWidth = (options.width + 1) / 2;
+  int chromaHeight = (options.height + 1) / 2;
+  size_t lumaSize = static_cast<size_t>(options.width) * options.height;
+  size_t frameSize = lumaSize + 2 * static_cast<size_t>(chromaWidth) * chromaHeight;
+
+  // source frames, either mapped from a recording or generated
+  std::vector<uint8_t> synthetic;
+  const uint8_t *source = nullptr;
+  size_t sourceFrames = 0;
+  void *mapping = MAP_FAILED;
+  size_t mappingSize = 0;
+
+  if (!options.input.empty()) {
+    int fd = open(options.input.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      std::cerr << "Unable to open " << options.input << ": " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+
+    mappingSize = st.st_size;
+    sourceFrames = mappingSize / frameSize;
+    if (sourceFrames == 0) {
+      std::cerr << options.input << " holds less than one " << options.width << "x" << options.height << " I420 frame" << std::endl;
+      close(fd);
+      return 1;
+    }
+
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      std::cerr << "mmap failed: " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+
+    source = static_cast<const uint8_t *>(mapping);
+  } else {
+    sourceFrames = 8;
+    synthetic = syntheticFrames(options.width, options.height, sourceFrames, frameSize);
+    source = synthetic.data();
+  }
+
+  FrameWriter writer;
+  bool writing = !options.out.empty();
+
+  if (writing) {
+    std::filesystem::create_directories(options.out);
+    WriterOptions writerOptions;
+    writerOptions.buffers = options.writerBuffers;
+    writerOptions.syncEvery = options.syncEvery;
+    writerOptions.bufferCapacity = lumaSize / 2;
+    writerOptions.store = options.store;
+
+    if (writer.start(options.out, writerOptions) < 0) {
+      return 1;
+    }
+  }
+
+  std::atomic<uint64_t> encodedBytes{0};
+  std::atomic<int> failures{0};
+
+  auto process = [&](BenchJob &job) {
+    stageHistogram(Stage::Queue).record(stageClockNs() - job.completedNs);
+
+    YuvFrame frame;
+    frame.y = job.frame;
+    frame.u = job.frame + lumaSize;
+    frame.v = frame.u + static_cast<size_t>(chromaWidth) * chromaHeight;
+    frame.width = options.width;
+    frame.height = options.height;
+    frame.yStride = options.width;
+    frame.uvStride = chromaWidth;
+
+    thread_local JpegBuffer localBuffer;
+    JpegBuffer *out = writing ? writer.acquire() : &localBuffer;
+
+    int err;
+    {
+      StageTimer timer(Stage::Encode);
+      err = options.scanlines ? encodeJpegScanlines(frame, *out, options.quality) : encodeJpeg(frame, *out, options.quality);
+    }
+
+    if (err) {
+      failures.fetch_add(1);
+      if (writing) {
+        writer.release(out);
+      }
+      return;
+    }
+
+    encodedBytes.fetch_add(out->size);
+
+    if (writing) {
+      FrameRecord record;
+      record.index = job.index;
+      std::snprintf(record.file, sizeof(record.file), "frame_%06llu.jpg", static_cast<unsigned long long>(job.index));
+      writer.submit(record, out);
+    }
+  };
+
+  WorkerPool<BenchJob> encoders;
+  resetStageStats();
+
+  std::cout << "Benchmarking " << options.frames << " frames of " << options.width << "x" << options.height
+            << " (" << (options.input.empty() ? "synthetic" : options.input) << "), quality " << options.quality
+            << ", " << options.threads << " encoder threads, " << (options.scanlines ? "scanline" : "raw") << " path, "
+            << kernelPathName(kernelPath()) << " kernels, "
+            << (writing ? "writing to " + options.out : "no writes") << std::endl;
+
+  uint64_t startNs = stageClockNs();
+
+  // frames are offered as fast as the pool takes them, so the result is the pipeline's throughput ceiling
+  encoders.start(options.threads, options.queueDepth, QueuePolicy::Block, process, [](BenchJob &) {});
+
+  for (int i = 0; i < options.frames; i++) {
+    const uint8_t *frame = source + frameSize * (i % sourceFrames);
+    encoders.submit(BenchJob{frame, static_cast<uint64_t>(i), stageClockNs()});
+  }
+
+  encoders.stop();
+  writer.stop();
+
+  double seconds = (stageClockNs() - startNs) / 1e9;
+  int encoded = options.frames - failures.load();
+
+  std::printf("%d frames in %.3fs: %.2f frames/sec, %.1f KB/frame\n", encoded, seconds, encoded / seconds,
+              encoded > 0 ? encodedBytes.load() / 1024.0 / encoded : 0.0);
+  std::cout << stageReport() << std::flush;
+
+  benchKernels(options, source, sourceFrames, frameSize);
+
+  if (mapping != MAP_FAILED) {
+    munmap(mapping, mappingSize);
+  }
+
+  return failures.load() ? 1 : 0;
+}
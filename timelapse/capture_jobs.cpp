@@ -0,0 +1,349 @@
+#include "capture_jobs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <iostream>
+
+#include "job_board.h"
+
+// finished jobs kept for lookups, older ones are forgotten
+static constexpr size_t CAPTURE_HISTORY = 16;
+
+
+static int64_t unixTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+static bool jobActive(JobState state) {
+  return state == JobState::Queued || state == JobState::Running;
+}
+
+
+// fills in the progress of a running job from its recording, if it has started capturing
+static void addProgress(CaptureJobStatus &status, const std::vector<RecordingInfo> &active) {
+
+  if (status.state != JobState::Running) {
+    return;
+  }
+
+  for (const RecordingInfo &recording : active) {
+    if (recording.cameraId == status.request.cameraId) {
+      status.slotsDone = recording.slotsDone;
+      status.slotsTotal = recording.slotsTotal;
+      status.intervalMs = recording.intervalMs;
+      status.framesSaved = recording.framesSaved;
+      return;
+    }
+  }
+}
+
+
+void CaptureJobs::start(RecordFunction record) {
+
+  stop();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  this->record = std::move(record);
+  stopping = false;
+}
+
+
+void CaptureJobs::stop() {
+
+  std::map<std::string, std::thread> stopped;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+
+    for (auto &[id, job] : jobs) {
+      if (job.status.state == JobState::Queued) {
+        job.status.state = JobState::Cancelled;
+        job.status.finishedUnixMs = unixTimeMs();
+      }
+      if (job.status.state == JobState::Running) {
+        job.status.request.stopToken->store(true);
+      }
+    }
+
+    stopped.swap(workers);
+  }
+  jobCV.notify_all();
+  notifyJobs();
+
+  // recordings flush their frames before they return
+  stopRecording();
+
+  for (auto &[cameraId, worker] : stopped) {
+    worker.join();
+  }
+}
+
+
+uint64_t CaptureJobs::submit(const RecordOptions &request) {
+
+  uint64_t id = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (stopping) {
+      return 0;
+    }
+
+    for (const auto &[jobId, job] : jobs) {
+      if (jobActive(job.status.state) && job.status.request.cameraId == request.cameraId) {
+        return 0;
+      }
+    }
+
+    id = nextJobId();
+
+    Job &job = jobs[id];
+    job.status.id = id;
+    job.status.request = request;
+    job.status.request.stopToken = std::make_shared<std::atomic<bool>>(false);
+    job.status.queuedUnixMs = unixTimeMs();
+
+    // the camera's worker is started with its first job and then waits for the next one
+    if (workers.find(request.cameraId) == workers.end()) {
+      workers.emplace(request.cameraId, std::thread(&CaptureJobs::run, this, request.cameraId));
+    }
+  }
+
+  jobCV.notify_all();
+  notifyJobs();
+
+  return id;
+}
+
+
+bool CaptureJobs::cancel(uint64_t id) {
+
+  std::string cameraId;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = jobs.find(id);
+    if (it == jobs.end() || !jobActive(it->second.status.state)) {
+      return false;
+    }
+
+    Job &job = it->second;
+    job.cancelRequested = true;
+
+    // a running job is marked once its recording returns, the token stops it even if it has not registered yet
+    if (job.status.state == JobState::Queued) {
+      job.status.state = JobState::Cancelled;
+      job.status.finishedUnixMs = unixTimeMs();
+    } else {
+      job.status.request.stopToken->store(true);
+      cameraId = job.status.request.cameraId;
+    }
+  }
+
+  if (!cameraId.empty()) {
+    stopRecording(cameraId);
+  }
+  notifyJobs();
+
+  return true;
+}
+
+
+bool CaptureJobs::stopCamera(const std::string &cameraId) {
+
+  bool stopped = false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto &[id, job] : jobs) {
+      if (jobActive(job.status.state) && (cameraId.empty() || job.status.request.cameraId == cameraId)) {
+        job.status.request.stopToken->store(true);
+        stopped = true;
+      }
+    }
+  }
+
+  // the token is set first, so a recording registering right now either sees it or is found here
+  stopRecording(cameraId);
+
+  return stopped;
+}
+
+
+bool CaptureJobs::usesDirectory(const std::filesystem::path &dir) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    std::error_code ec;
+    if (jobActive(job.status.state) && std::filesystem::equivalent(job.status.request.framesDir, dir, ec)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool CaptureJobs::find(uint64_t id, CaptureJobStatus &status) {
+
+  // read before taking the mutex, recordings() locks the sessions on its own
+  std::vector<RecordingInfo> active = recordings();
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = jobs.find(id);
+  if (it == jobs.end()) {
+    return false;
+  }
+
+  status = it->second.status;
+  addProgress(status, active);
+
+  return true;
+}
+
+
+std::vector<CaptureJobStatus> CaptureJobs::list() {
+
+  std::vector<RecordingInfo> active = recordings();
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<CaptureJobStatus> statuses;
+  statuses.reserve(jobs.size());
+
+  for (const auto &[id, job] : jobs) {
+    statuses.push_back(job.status);
+    addProgress(statuses.back(), active);
+  }
+
+  return statuses;
+}
+
+
+bool CaptureJobs::busy() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    if (jobActive(job.status.state)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool CaptureJobs::active(const std::string &cameraId) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    if (jobActive(job.status.state) && job.status.request.cameraId == cameraId) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// forgets the oldest finished jobs beyond CAPTURE_HISTORY, called with the mutex held
+void CaptureJobs::trimHistory() {
+
+  size_t finished = 0;
+  for (const auto &[id, job] : jobs) {
+    finished += jobActive(job.status.state) ? 0 : 1;
+  }
+
+  for (auto it = jobs.begin(); it != jobs.end() && finished > CAPTURE_HISTORY;) {
+    if (jobActive(it->second.status.state)) {
+      ++it;
+      continue;
+    }
+
+    it = jobs.erase(it);
+    finished--;
+  }
+}
+
+
+void CaptureJobs::run(std::string cameraId) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+
+    Job *next = nullptr;
+    for (auto &[id, job] : jobs) {
+      if (job.status.state == JobState::Queued && job.status.request.cameraId == cameraId) {
+        next = &job;
+        break;
+      }
+    }
+
+    if (!next) {
+      if (stopping) {
+        break;
+      }
+      jobCV.wait(lock);
+      continue;
+    }
+
+    next->status.state = JobState::Running;
+    next->status.startedUnixMs = unixTimeMs();
+
+    // map nodes stay put, and only worker threads erase finished jobs
+    uint64_t id = next->status.id;
+    RecordOptions request = next->status.request;
+
+    lock.unlock();
+    notifyJobs();
+
+    std::cout << "Capture job " << id << " started on camera " << cameraId << std::endl;
+    int result = record(request);
+
+    lock.lock();
+
+    Job &job = jobs[id];
+    job.status.result = result;
+    job.status.finishedUnixMs = unixTimeMs();
+    job.status.state = job.cancelRequested ? JobState::Cancelled : (result == 0) ? JobState::Finished : JobState::Failed;
+
+    std::cout << "Capture job " << id << " " << jobStateName(job.status.state) << " with code " << result << std::endl;
+
+    trimHistory();
+
+    lock.unlock();
+    notifyJobs();
+    lock.lock();
+  }
+}
+
+
+std::string formatCaptureStatus(const CaptureJobStatus &status) {
+
+  // recordings follow a fixed schedule, so the time left is the slots left
+  int64_t etaMs = -1;
+  if (status.state == JobState::Running && status.slotsTotal > 0) {
+    etaMs = static_cast<int64_t>((status.slotsTotal - std::min(status.slotsDone, status.slotsTotal)) * status.intervalMs);
+  }
+
+  char line[512];
+  std::snprintf(line, sizeof(line), "id=%" PRIu64 " state=%s slots=%" PRIu64 "/%" PRIu64 " frames_saved=%" PRIu64 " interval_ms=%" PRIu64
+                " eta_ms=%" PRId64 " result=%d queued_ms=%" PRId64 " started_ms=%" PRId64 " finished_ms=%" PRId64 " camera=%s dir=%s\n",
+                status.id, jobStateName(status.state), status.slotsDone, status.slotsTotal, status.framesSaved, status.intervalMs, etaMs,
+                status.result, status.queuedUnixMs, status.startedUnixMs, status.finishedUnixMs, status.request.cameraId.c_str(),
+                status.request.framesDir.c_str());
+
+  return line;
+}
@@ -0,0 +1,139 @@
+#ifndef CAPTURE_JOBS_H
+#define CAPTURE_JOBS_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "render_jobs.h"
+#include "timelapse.h"
+
+/**
+ * Snapshot of a capture job.
+ */
+struct CaptureJobStatus {
+  uint64_t id = 0;
+  JobState state = JobState::Queued;
+  RecordOptions request;
+  int result = 0; // return value of the recording once it ended
+  uint64_t slotsDone = 0;
+  uint64_t slotsTotal = 0; // 0 until the camera is configured
+  uint64_t intervalMs = 0;
+  uint64_t framesSaved = 0;
+  int64_t queuedUnixMs = 0;
+  int64_t startedUnixMs = 0;
+  int64_t finishedUnixMs = 0;
+};
+
+// runs one recording, returning 0 on success
+using RecordFunction = std::function<int(const RecordOptions &request)>;
+
+/**
+ * Recordings run as jobs, on one worker thread per camera that lives until stop().
+ * A recording that ends leaves its worker waiting for the camera's next job, so starting a camera again never waits on a join.
+ * Every job carries a stop token (RecordOptions::stopToken), so a stop that lands before the recording has registered its session is not lost.
+ * IDs come from nextJobId() and every state change is announced with notifyJobs() (see job_board.h).
+ * The last few finished jobs are kept so their result can still be looked up.
+ */
+class CaptureJobs {
+public:
+  CaptureJobs() = default;
+  CaptureJobs(const CaptureJobs &) = delete;
+  CaptureJobs &operator=(const CaptureJobs &) = delete;
+
+  ~CaptureJobs() {
+    stop();
+  }
+
+  /**
+   * @param record Runs a job's recording (e.g. through recordTimelapseHandler())
+   */
+  void start(RecordFunction record);
+
+  /**
+   * Stops every recording and waits for the workers to finish. Safe to call more than once.
+   */
+  void stop();
+
+  /**
+   * Queues a recording, it starts right away unless the camera's worker is still winding down the last one.
+   * @param request Recording to run, its cameraId must be set
+   * @return ID of the new job, 0 if the camera already has a queued or running job
+   */
+  uint64_t submit(const RecordOptions &request);
+
+  /**
+   * Cancels a job, a queued job never starts and a running one stops like /stop-cam would, keeping its frames.
+   * @param id Job to cancel
+   * @return true if the job was queued or running
+   */
+  bool cancel(uint64_t id);
+
+  /**
+   * Stops the camera's job like /stop-cam, unlike cancel() the job ends as finished.
+   * @param cameraId libcamera ID of the camera (empty stops every camera)
+   * @return true if a job was queued or running
+   */
+  bool stopCamera(const std::string &cameraId);
+
+  /**
+   * @param dir Frame directory
+   * @return true while a queued or running job records into dir
+   */
+  bool usesDirectory(const std::filesystem::path &dir);
+
+  /**
+   * @param id Job to look up
+   * @param status Filled with the job's status
+   * @return true if the job is known
+   */
+  bool find(uint64_t id, CaptureJobStatus &status);
+
+  /**
+   * @return Status of every known job, oldest first
+   */
+  std::vector<CaptureJobStatus> list();
+
+  /**
+   * @return true while any job is queued or running
+   */
+  bool busy();
+
+  /**
+   * @param cameraId libcamera ID of the camera
+   * @return true while a job of the camera is queued or running
+   */
+  bool active(const std::string &cameraId);
+
+private:
+  struct Job {
+    CaptureJobStatus status;
+    bool cancelRequested = false;
+  };
+
+  void run(std::string cameraId);
+  void trimHistory();
+
+  RecordFunction record;
+  std::mutex mutex;
+  std::condition_variable jobCV;
+  bool stopping = false;
+
+  std::map<std::string, std::thread> workers; // by camera ID
+  std::map<uint64_t, Job> jobs;
+};
+
+/**
+ * Formats a job as one line of key=value pairs.
+ * @param status Job to format
+ * @return The line, ending in a newline
+ */
+std::string formatCaptureStatus(const CaptureJobStatus &status);
+
+#endif
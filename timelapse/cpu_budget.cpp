@@ -0,0 +1,194 @@
+#include "cpu_budget.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// ioprio_set() has no glibc wrapper
+static constexpr int IOPRIO_WHO_PROCESS = 1;
+static constexpr int IOPRIO_CLASS_BE = 2;
+static constexpr int IOPRIO_CLASS_SHIFT = 13;
+static constexpr int IOPRIO_LOWEST_BE = 7;
+
+// each failure is only worth one warning per process
+static std::atomic<bool> affinityWarned{false};
+static std::atomic<bool> realtimeWarned{false};
+
+
+static CpuBudget parseBudget() {
+
+  CpuBudget budget;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  const char *captureCore = std::getenv("CAM_CAPTURE_CORE");
+  if (captureCore && *captureCore) {
+    int core = std::atoi(captureCore);
+    if (core >= 0 && core < cores) {
+      budget.captureCore = core;
+    } else {
+      std::cerr << "CAM_CAPTURE_CORE " << captureCore << " is not an online core, capture is not pinned" << std::endl;
+    }
+  }
+
+  const char *renderCores = std::getenv("CAM_RENDER_CORES");
+  if (renderCores && *renderCores) {
+    budget.renderCores = parseCoreList(renderCores);
+  } else if (budget.captureCore >= 0 && cores > 1) {
+    // keep renders off the reserved core
+    for (int core = 0; core < cores; core++) {
+      if (core != budget.captureCore) {
+        budget.renderCores.push_back(core);
+      }
+    }
+  }
+
+  const char *renderNice = std::getenv("CAM_RENDER_NICE");
+  if (renderNice && *renderNice) {
+    budget.renderNice = std::atoi(renderNice);
+  }
+
+  return budget;
+}
+
+
+std::vector<int> parseCoreList(const std::string &list) {
+
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+  std::vector<int> cores;
+  size_t start = 0;
+
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+
+    int core = std::atoi(list.substr(start, end - start).c_str());
+    if (core >= 0 && core < online) {
+      cores.push_back(core);
+    }
+    start = end + 1;
+  }
+
+  return cores;
+}
+
+
+// pins the calling thread, failures are left to the caller to report
+static int setThreadCores(const std::vector<int> &cores) {
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int core : cores) {
+    CPU_SET(core, &set);
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+const CpuBudget &cpuBudget() {
+  static const CpuBudget budget = parseBudget();
+  return budget;
+}
+
+
+int enterCaptureBudget(const std::vector<int> &cores) {
+
+  const CpuBudget &budget = cpuBudget();
+  int err = 0;
+
+  std::vector<int> captureCores = cores;
+  if (captureCores.empty() && budget.captureCore >= 0) {
+    captureCores.push_back(budget.captureCore);
+  }
+
+  if (!captureCores.empty()) {
+    err = setThreadCores(captureCores);
+    if (err && !affinityWarned.exchange(true)) {
+      std::cerr << "Unable to pin capture to core " << captureCores[0] << ": " << std::strerror(err) << std::endl;
+    }
+  }
+
+  sched_param param = {};
+  param.sched_priority = budget.captureRtPriority;
+
+  int rtErr = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (rtErr && !realtimeWarned.exchange(true)) {
+    std::cerr << "Unable to give capture realtime priority: " << std::strerror(rtErr) << std::endl;
+  }
+
+  return err ? err : rtErr;
+}
+
+
+int pinThread(const std::vector<int> &cores) {
+
+  if (cores.empty()) {
+    return 0;
+  }
+
+  int err = setThreadCores(cores);
+  if (err) {
+    std::cerr << "Unable to pin thread to core " << cores[0] << ": " << std::strerror(err) << std::endl;
+  }
+
+  return err;
+}
+
+
+ThreadBudget currentThreadBudget() {
+
+  ThreadBudget budget;
+  CPU_ZERO(&budget.cores);
+
+  budget.saved = pthread_getschedparam(pthread_self(), &budget.policy, &budget.param) == 0 &&
+                 pthread_getaffinity_np(pthread_self(), sizeof(budget.cores), &budget.cores) == 0;
+
+  return budget;
+}
+
+
+void restoreThreadBudget(const ThreadBudget &budget) {
+
+  if (!budget.saved) {
+    return;
+  }
+
+  // dropping realtime priority needs no privilege, so this only fails if the thread never had the budget applied
+  pthread_setschedparam(pthread_self(), budget.policy, &budget.param);
+  pthread_setaffinity_np(pthread_self(), sizeof(budget.cores), &budget.cores);
+}
+
+
+void enterRenderBudget() {
+
+  const CpuBudget &budget = cpuBudget();
+
+  // a fork from a realtime thread would otherwise keep its policy
+  sched_param param = {};
+  sched_setscheduler(0, SCHED_OTHER, &param);
+
+  if (!budget.renderCores.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int core : budget.renderCores) {
+      CPU_SET(core, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+
+  setpriority(PRIO_PROCESS, 0, budget.renderNice);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_LOWEST_BE);
+}
@@ -0,0 +1,78 @@
+#ifndef CPU_BUDGET_H
+#define CPU_BUDGET_H
+
+#include <string>
+#include <vector>
+
+#include <sched.h>
+
+/**
+ * How the CPU is split between capture and rendering, so a render can run next to a recording without stealing its deadlines.
+ * Read once from the environment:
+ *   CAM_CAPTURE_CORE  core reserved for the capture threads (unset: capture is not pinned)
+ *   CAM_RENDER_CORES  comma separated cores renders may use (unset: every core except the capture core)
+ *   CAM_RENDER_NICE   nice value of render processes (unset: 10)
+ */
+struct CpuBudget {
+  int captureCore = -1; // -1 if capture is not pinned
+  std::vector<int> renderCores; // empty if renders are not pinned
+  int renderNice = 10;
+  int captureRtPriority = 10; // SCHED_FIFO priority of the capture threads
+};
+
+/**
+ * @return Budget parsed from the environment on the first call
+ */
+const CpuBudget &cpuBudget();
+
+/**
+ * Moves the calling thread onto the capture core with realtime priority.
+ * Threads created afterwards inherit both, so call it once the worker threads are running.
+ * Either step failing (no such core, no CAP_SYS_NICE) is logged once per process and capture carries on unbudgeted.
+ * @param cores Cores to run on instead of the capture core, e.g. the cores of one camera's pipeline (empty uses the capture core)
+ * @return 0 if both applied, non-zero otherwise
+ */
+int enterCaptureBudget(const std::vector<int> &cores = {});
+
+/**
+ * Restricts the calling thread to a set of cores without changing its priority. Threads created afterwards inherit it.
+ * @param cores Cores to run on (empty leaves the thread alone)
+ * @return 0 on success, non-zero otherwise
+ */
+int pinThread(const std::vector<int> &cores);
+
+/**
+ * Scheduling policy, priority and cores of a thread, so a thread that runs capture for a while can hand them back afterwards.
+ */
+struct ThreadBudget {
+  int policy = SCHED_OTHER;
+  sched_param param = {};
+  cpu_set_t cores;
+  bool saved = false; // false if the thread's settings could not be read
+};
+
+/**
+ * @return Current policy, priority and cores of the calling thread
+ */
+ThreadBudget currentThreadBudget();
+
+/**
+ * Puts the calling thread back on the policy, priority and cores it had, e.g. after enterCaptureBudget() or pinThread().
+ * @param budget Settings from currentThreadBudget()
+ */
+void restoreThreadBudget(const ThreadBudget &budget);
+
+/**
+ * Parses a comma separated list of cores, dropping entries that are not online cores.
+ * @param list List such as "2,3"
+ * @return Cores in the order given
+ */
+std::vector<int> parseCoreList(const std::string &list);
+
+/**
+ * Confines the calling process to the render cores with raised nice and lowest best-effort IO priority.
+ * Only makes system calls, so it is safe between fork() and exec() once cpuBudget() has been called in the parent.
+ */
+void enterRenderBudget();
+
+#endif
@@ -0,0 +1,163 @@
+#include "exposure.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "kernels.h"
+
+// shortest exposure the stabilizer sets, and the range it keeps colour gains in
+static constexpr double MIN_EXPOSURE_US = 100.0;
+static constexpr float MIN_COLOUR_GAIN = 0.5f;
+static constexpr float MAX_COLOUR_GAIN = 8.0f;
+
+// a frame whose 95th percentile is at least this bright is clipping, it is never brightened further
+static constexpr uint8_t CLIPPED_LUMA = 250;
+
+
+// mean of a histogram holding count samples
+static float histogramMean(const uint32_t histogram[256], size_t count) {
+
+  uint64_t sum = 0;
+  for (int i = 0; i < 256; i++) {
+    sum += static_cast<uint64_t>(histogram[i]) * i;
+  }
+
+  return static_cast<float>(static_cast<double>(sum) / static_cast<double>(count));
+}
+
+
+static uint8_t histogramPercentile(const uint32_t histogram[256], size_t count, int percent) {
+
+  size_t wanted = count * percent / 100;
+  size_t seen = 0;
+
+  for (int i = 0; i < 256; i++) {
+    seen += histogram[i];
+    if (seen > wanted) {
+      return static_cast<uint8_t>(i);
+    }
+  }
+
+  return 255;
+}
+
+
+int measureFrame(const YuvFrame &frame, int step, FrameStats &stats) {
+
+  if (!frame.y || frame.width <= 0 || frame.height <= 0) {
+    return -1;
+  }
+
+  step = std::max(step, 2);
+
+  uint32_t histogram[256];
+  size_t count = gridHistogram(frame.y, frame.width, frame.height, frame.yStride, step, histogram);
+
+  stats.luma = histogramMean(histogram, count);
+  stats.lumaLow = histogramPercentile(histogram, count, 5);
+  stats.lumaMedian = histogramPercentile(histogram, count, 50);
+  stats.lumaHigh = histogramPercentile(histogram, count, 95);
+
+  // interleaved chroma is sampled at even offsets for U and odd ones for V, so the step through the row stays even
+  int chromaWidth = (frame.width + 1) / 2;
+  int chromaHeight = (frame.height + 1) / 2;
+  int chromaStep = step / 2;
+  bool interleaved = frame.chroma == ChromaLayout::Interleaved;
+
+  if (frame.u) {
+    count = interleaved ? gridHistogram(frame.u, chromaWidth * 2, chromaHeight, frame.uvStride, chromaStep * 2, histogram)
+                        : gridHistogram(frame.u, chromaWidth, chromaHeight, frame.uvStride, chromaStep, histogram);
+    stats.u = histogramMean(histogram, count);
+  }
+
+  if (frame.v) {
+    count = interleaved ? gridHistogram(frame.v, chromaWidth * 2 - 1, chromaHeight, frame.uvStride, chromaStep * 2, histogram)
+                        : gridHistogram(frame.v, chromaWidth, chromaHeight, frame.uvStride, chromaStep, histogram);
+    stats.v = histogramMean(histogram, count);
+  }
+
+  return 0;
+}
+
+
+void ExposureStabilizer::reset(const StabilizerOptions &stabilizerOptions) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  options = stabilizerOptions;
+  options.targetLuma = (options.targetLuma > 0) ? options.targetLuma : 100.0f;
+  options.smoothing = (options.smoothing > 0) ? std::min(options.smoothing, 1.0f) : 0.2f;
+  options.maxStep = (options.maxStep > 1) ? options.maxStep : 1.25f;
+  options.maxExposureUs = (options.maxExposureUs > 0) ? options.maxExposureUs : 100000;
+  options.maxGain = (options.maxGain >= 1) ? options.maxGain : 8.0f;
+
+  seeded = false;
+  totalExposure = 0;
+  settings = ExposureSettings();
+}
+
+
+// moves current a share of the way towards target in the log domain, so equal ratios take equal steps
+static double smoothTowards(double current, double target, double smoothing) {
+  return current * std::pow(target / current, smoothing);
+}
+
+
+void ExposureStabilizer::update(const FrameStats &stats, const ExposureSettings &captured) {
+
+  // without the settings the frame was taken with there is nothing to correct from
+  double capturedTotal = static_cast<double>(captured.exposureUs) * captured.analogueGain;
+  if (capturedTotal <= 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // the camera's AE/AWB chose the first frame's settings, the stabilizer carries on from there
+  if (!seeded) {
+    totalExposure = capturedTotal;
+    settings = captured;
+    seeded = true;
+  }
+
+  double luma = std::max(stats.luma, 1.0f);
+  double desired = capturedTotal * options.targetLuma / luma;
+  if (desired > totalExposure && stats.lumaHigh >= CLIPPED_LUMA) {
+    desired = totalExposure;
+  }
+
+  double step = std::clamp(std::pow(desired / totalExposure, options.smoothing), 1.0 / options.maxStep, static_cast<double>(options.maxStep));
+  totalExposure = std::clamp(totalExposure * step, MIN_EXPOSURE_US, static_cast<double>(options.maxExposureUs) * options.maxGain);
+
+  // exposure time first, it adds no noise, gain only once the exposure is as long as allowed
+  double exposureUs = std::clamp(totalExposure, MIN_EXPOSURE_US, static_cast<double>(options.maxExposureUs));
+  settings.exposureUs = static_cast<int32_t>(exposureUs);
+  settings.analogueGain = static_cast<float>(std::clamp(totalExposure / exposureUs, 1.0, static_cast<double>(options.maxGain)));
+
+  if (!options.whiteBalance || captured.redGain <= 0 || captured.blueGain <= 0) {
+    return;
+  }
+
+  // grey world: the BT.601 chroma means give the frame's average red and blue against its luma, a grey frame has both equal to the luma
+  double red = std::max(luma + (stats.v - 128.0) / 0.713, 1.0);
+  double blue = std::max(luma + (stats.u - 128.0) / 0.564, 1.0);
+
+  double redTarget = std::clamp(captured.redGain * luma / red, static_cast<double>(MIN_COLOUR_GAIN), static_cast<double>(MAX_COLOUR_GAIN));
+  double blueTarget = std::clamp(captured.blueGain * luma / blue, static_cast<double>(MIN_COLOUR_GAIN), static_cast<double>(MAX_COLOUR_GAIN));
+
+  settings.redGain = static_cast<float>(smoothTowards(settings.redGain, redTarget, options.smoothing));
+  settings.blueGain = static_cast<float>(smoothTowards(settings.blueGain, blueTarget, options.smoothing));
+}
+
+
+bool ExposureStabilizer::next(ExposureSettings &next) const {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!seeded) {
+    return false;
+  }
+
+  next = settings;
+  return true;
+}
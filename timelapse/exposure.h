@@ -0,0 +1,91 @@
+#ifndef EXPOSURE_H
+#define EXPOSURE_H
+
+#include <cstdint>
+#include <mutex>
+
+#include "jpeg_encoder.h"
+
+/**
+ * Brightness and colour of one frame, measured on a coarse grid of its planes.
+ */
+struct FrameStats {
+  float luma = 0; // mean luma (0-255)
+  uint8_t lumaLow = 0; // 5th percentile of the luma
+  uint8_t lumaMedian = 0;
+  uint8_t lumaHigh = 0; // 95th percentile of the luma
+  float u = 128; // mean of each chroma plane, 128 for grey
+  float v = 128;
+};
+
+/**
+ * Measures a frame from histograms of every step-th sample of every step-th row, the planes are only read.
+ * @param frame Frame to measure
+ * @param step Distance between grid samples in luma pixels (at least 2, so chroma is sampled too)
+ * @param stats Filled with the frame's statistics
+ * @return 0 on success, -1 if the frame is empty
+ */
+int measureFrame(const YuvFrame &frame, int step, FrameStats &stats);
+
+/**
+ * Sensor settings a frame was captured with, or the next frames should be.
+ */
+struct ExposureSettings {
+  int32_t exposureUs = 0; // exposure time in microseconds
+  float analogueGain = 1.0f;
+  float redGain = 1.0f; // colour gains relative to green
+  float blueGain = 1.0f;
+};
+
+/**
+ * Limits and speed of the stabilizer. Zero values evaluate to the defaults noted per field.
+ */
+struct StabilizerOptions {
+  bool whiteBalance = false; // also take over white balance, otherwise only exposure
+  float targetLuma = 0; // mean luma to expose for (0 evaluates to 100)
+  float smoothing = 0; // share of the remaining error corrected per frame, 0-1 (0 evaluates to 0.2)
+  float maxStep = 0; // largest change of total exposure per frame as a factor (0 evaluates to 1.25)
+  int32_t maxExposureUs = 0; // longest exposure time (0 evaluates to 100000), the rest is made up with gain
+  float maxGain = 0; // highest analogue gain (0 evaluates to 8)
+};
+
+/**
+ * Exposure and white balance feedback for timelapses: frame to frame steps of the camera's own AE/AWB show up as flicker
+ * at dawn and dusk, so the stabilizer starts from what they chose for the first frame and from there moves the settings
+ * smoothly towards the target brightness (and, with whiteBalance, towards grey by the grey world assumption).
+ * update() runs once per captured frame on the completion thread, next() may be called from any thread.
+ */
+class ExposureStabilizer {
+public:
+  /**
+   * Forgets every frame seen so far, the next update() seeds the settings again.
+   * @param options Limits and speed
+   */
+  void reset(const StabilizerOptions &options);
+
+  /**
+   * Feeds one frame.
+   * @param stats The frame's statistics
+   * @param captured Settings the frame was captured with, from the request's metadata
+   */
+  void update(const FrameStats &stats, const ExposureSettings &captured);
+
+  /**
+   * @param settings Set to the settings for the next frames
+   * @return true once the first frame was fed, before that the camera's AE/AWB stay in charge
+   */
+  bool next(ExposureSettings &settings) const;
+
+  bool whiteBalance() const {
+    return options.whiteBalance;
+  }
+
+private:
+  mutable std::mutex mutex;
+  StabilizerOptions options;
+  bool seeded = false;
+  double totalExposure = 0; // exposure time in microseconds times analogue gain
+  ExposureSettings settings;
+};
+
+#endif
@@ -0,0 +1,361 @@
+#include "frame_cleaner.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu_budget.h"
+#include "job_board.h"
+#include "manifest.h"
+#include "part_encoder.h"
+#include "session_state.h"
+
+// files unlinked between pauses, and the pause, which leaves the card's queue to a recording's writes for a moment
+static constexpr size_t CLEANUP_BATCH = 256;
+static constexpr auto CLEANUP_PAUSE = std::chrono::milliseconds(20);
+
+// finished jobs kept for lookups, older ones are forgotten
+static constexpr size_t CLEANUP_HISTORY = 16;
+
+// files that only describe the frames, removed before the frames themselves
+static const char *const DESCRIPTION_FILES[] = { MANIFEST_FILE, SESSION_FILE, "frames.ffconcat", "part.ffconcat", "tail.ffconcat", "frames.sendcmd" };
+
+
+static int64_t unixTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+static bool jobActive(JobState state) {
+  return state == JobState::Queued || state == JobState::Running;
+}
+
+
+static bool isFrameFile(const char *name) {
+  size_t length = std::strlen(name);
+  return length > 4 && (std::strcmp(name + length - 4, ".jpg") == 0 || std::strcmp(name + length - 4, ".seg") == 0);
+}
+
+
+void FrameCleaner::start() {
+
+  stop();
+
+  stopping = false;
+  thread = std::thread(&FrameCleaner::run, this);
+}
+
+
+void FrameCleaner::stop() {
+
+  if (!thread.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+
+    for (auto &[id, job] : jobs) {
+      if (job.state == JobState::Queued) {
+        job.state = JobState::Cancelled;
+        job.finishedUnixMs = unixTimeMs();
+      }
+    }
+  }
+  jobCV.notify_all();
+  notifyJobs();
+
+  thread.join();
+}
+
+
+uint64_t FrameCleaner::submit(const std::filesystem::path &framesDir, bool all) {
+
+  uint64_t id = nextJobId();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    CleanupStatus &job = jobs[id];
+    job.id = id;
+    job.framesDir = framesDir;
+    job.all = all;
+    job.queuedUnixMs = unixTimeMs();
+  }
+
+  jobCV.notify_all();
+  notifyJobs();
+
+  return id;
+}
+
+
+bool FrameCleaner::cancel(uint64_t id) {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = jobs.find(id);
+    if (it == jobs.end() || !jobActive(it->second.state)) {
+      return false;
+    }
+
+    // a running job is marked once its current batch is done
+    if (it->second.state == JobState::Queued) {
+      it->second.state = JobState::Cancelled;
+      it->second.finishedUnixMs = unixTimeMs();
+    } else {
+      cancelledId = id;
+    }
+  }
+
+  notifyJobs();
+
+  return true;
+}
+
+
+bool FrameCleaner::find(uint64_t id, CleanupStatus &status) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = jobs.find(id);
+  if (it == jobs.end()) {
+    return false;
+  }
+
+  status = it->second;
+  return true;
+}
+
+
+std::vector<CleanupStatus> FrameCleaner::list() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<CleanupStatus> statuses;
+  statuses.reserve(jobs.size());
+
+  for (const auto &[id, job] : jobs) {
+    statuses.push_back(job);
+  }
+
+  return statuses;
+}
+
+
+bool FrameCleaner::usesDirectory(const std::filesystem::path &dir) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    std::error_code ec;
+    if (jobActive(job.state) && std::filesystem::equivalent(job.framesDir, dir, ec)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void FrameCleaner::progress(uint64_t id, uint64_t removed, uint64_t total, uint64_t freed) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  CleanupStatus &job = jobs[id];
+  job.filesRemoved = removed;
+  job.filesTotal = total;
+  job.bytesFreed = freed;
+}
+
+
+// runs on the worker thread without the mutex held, returns 0 or the first error
+int FrameCleaner::clear(uint64_t id, const std::filesystem::path &framesDir, bool all) {
+
+  int dirFd = open(framesDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirFd < 0) {
+    return -errno;
+  }
+
+  int result = 0;
+
+  for (const char *name : DESCRIPTION_FILES) {
+    if (unlinkat(dirFd, name, 0) < 0 && errno != ENOENT && result == 0) {
+      result = -errno;
+    }
+  }
+
+  // one pass over the directory, the names are unlinked afterwards so removing does not disturb the listing
+  std::vector<std::string> names;
+  std::vector<uint64_t> sizes;
+
+  int listFd = dup(dirFd);
+  DIR *dir = (listFd >= 0) ? fdopendir(listFd) : nullptr;
+  if (!dir) {
+    if (listFd >= 0) {
+      close(listFd);
+    }
+    close(dirFd);
+    return -errno;
+  }
+
+  while (dirent *entry = readdir(dir)) {
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+      continue;
+    }
+    if (!all && !isFrameFile(entry->d_name)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    names.emplace_back(entry->d_name);
+    sizes.push_back(static_cast<uint64_t>(st.st_size));
+  }
+  closedir(dir);
+
+  uint64_t total = names.size();
+  uint64_t removed = 0;
+  uint64_t freed = 0;
+  progress(id, 0, total, 0);
+
+  for (size_t i = 0; i < names.size(); i++) {
+    if (unlinkat(dirFd, names[i].c_str(), 0) == 0) {
+      removed++;
+      freed += sizes[i];
+    } else if (errno != ENOENT && result == 0) {
+      result = -errno;
+    }
+
+    if ((i + 1) % CLEANUP_BATCH == 0) {
+      progress(id, removed, total, freed);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || cancelledId == id) {
+          break;
+        }
+      }
+
+      std::this_thread::sleep_for(CLEANUP_PAUSE);
+    }
+  }
+
+  close(dirFd);
+
+  // encoded parts only cover the frames that were just removed
+  std::error_code ec;
+  std::filesystem::remove_all(framesDir / PARTS_DIR, ec);
+
+  progress(id, removed, total, freed);
+
+  return result;
+}
+
+
+// forgets the oldest finished jobs beyond CLEANUP_HISTORY, called with the mutex held
+void FrameCleaner::trimHistory() {
+
+  size_t finished = 0;
+  for (const auto &[id, job] : jobs) {
+    finished += jobActive(job.state) ? 0 : 1;
+  }
+
+  for (auto it = jobs.begin(); it != jobs.end() && finished > CLEANUP_HISTORY;) {
+    if (jobActive(it->second.state)) {
+      ++it;
+      continue;
+    }
+
+    it = jobs.erase(it);
+    finished--;
+  }
+}
+
+
+void FrameCleaner::run() {
+
+  // nice, IO priority and cores of a render, these apply to the calling thread only
+  enterRenderBudget();
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+
+    CleanupStatus *next = nullptr;
+    for (auto &[id, job] : jobs) {
+      if (job.state == JobState::Queued) {
+        next = &job;
+        break;
+      }
+    }
+
+    if (!next) {
+      if (stopping) {
+        break;
+      }
+      jobCV.wait(lock);
+      continue;
+    }
+
+    next->state = JobState::Running;
+    next->startedUnixMs = unixTimeMs();
+
+    // map nodes stay put, and only this thread erases jobs
+    uint64_t id = next->id;
+    std::filesystem::path framesDir = next->framesDir;
+    bool all = next->all;
+
+    lock.unlock();
+    notifyJobs();
+
+    std::cout << "Cleanup job " << id << " clearing " << framesDir << std::endl;
+    int result = clear(id, framesDir, all);
+
+    lock.lock();
+
+    CleanupStatus &job = jobs[id];
+    job.result = result;
+    job.finishedUnixMs = unixTimeMs();
+    job.state = ((stopping || cancelledId == id) && job.filesRemoved < job.filesTotal) ? JobState::Cancelled
+              : (result == 0) ? JobState::Finished : JobState::Failed;
+    cancelledId = 0;
+
+    std::cout << "Cleanup job " << id << " " << jobStateName(job.state) << ", removed " << job.filesRemoved << " of " << job.filesTotal
+              << " files (" << job.bytesFreed << " bytes)" << std::endl;
+
+    trimHistory();
+
+    lock.unlock();
+    notifyJobs();
+    lock.lock();
+  }
+}
+
+
+std::string formatCleanupStatus(const CleanupStatus &status) {
+
+  int64_t etaMs = (status.state == JobState::Running) ? estimateRemainingMs(status.filesRemoved, status.filesTotal, status.startedUnixMs, unixTimeMs()) : -1;
+
+  char line[512];
+  std::snprintf(line, sizeof(line), "id=%" PRIu64 " state=%s files=%" PRIu64 "/%" PRIu64 " bytes_freed=%" PRIu64 " eta_ms=%" PRId64 " result=%d queued_ms=%" PRId64
+                " started_ms=%" PRId64 " finished_ms=%" PRId64 " all=%s dir=%s\n",
+                status.id, jobStateName(status.state), status.filesRemoved, status.filesTotal, status.bytesFreed, etaMs, status.result,
+                status.queuedUnixMs, status.startedUnixMs, status.finishedUnixMs, status.all ? "true" : "false", status.framesDir.c_str());
+
+  return line;
+}
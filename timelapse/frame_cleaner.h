@@ -0,0 +1,114 @@
+#ifndef FRAME_CLEANER_H
+#define FRAME_CLEANER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "render_jobs.h"
+
+/**
+ * Snapshot of a cleanup job.
+ */
+struct CleanupStatus {
+  uint64_t id = 0;
+  JobState state = JobState::Queued;
+  std::filesystem::path framesDir;
+  bool all = false; // every regular file, not just the frames and what describes them
+  uint64_t filesRemoved = 0;
+  uint64_t filesTotal = 0; // 0 until the directory has been listed
+  uint64_t bytesFreed = 0;
+  int result = 0; // 0, or the negative errno of the first failed removal
+  int64_t queuedUnixMs = 0;
+  int64_t startedUnixMs = 0;
+  int64_t finishedUnixMs = 0;
+};
+
+/**
+ * Clears frame directories on a background thread, one job at a time, so a request never waits for thousands of unlinks.
+ * The manifest, session state and render lists go first, so a half cleared directory never looks like a session.
+ * Files are then unlinked in batches with a pause after each, at the render budget's nice and IO priority,
+ * so a clear running next to a recording does not starve its writes. A segment store clears in a handful of unlinks.
+ */
+class FrameCleaner {
+public:
+  FrameCleaner() = default;
+  FrameCleaner(const FrameCleaner &) = delete;
+  FrameCleaner &operator=(const FrameCleaner &) = delete;
+
+  ~FrameCleaner() {
+    stop();
+  }
+
+  /**
+   * Starts the worker thread.
+   */
+  void start();
+
+  /**
+   * Stops after the current batch, jobs that have not finished are cancelled. Safe to call more than once.
+   */
+  void stop();
+
+  /**
+   * Queues a cleanup.
+   * @param framesDir Directory to clear
+   * @param all Remove every regular file instead of just the frames, the manifest, session state and render lists
+   * @return ID of the new job
+   */
+  uint64_t submit(const std::filesystem::path &framesDir, bool all);
+
+  /**
+   * Cancels a job, a queued job never starts and a running one stops after its current batch.
+   * Files removed by then stay removed, clearing the directory again finishes the job.
+   * @param id Job to cancel
+   * @return true if the job was queued or running
+   */
+  bool cancel(uint64_t id);
+
+  /**
+   * @param id Job to look up
+   * @param status Filled with the job's status
+   * @return true if the job is known
+   */
+  bool find(uint64_t id, CleanupStatus &status);
+
+  /**
+   * @return Status of every known job, oldest first
+   */
+  std::vector<CleanupStatus> list();
+
+  /**
+   * @param dir Frame directory
+   * @return true while a queued or running job clears dir
+   */
+  bool usesDirectory(const std::filesystem::path &dir);
+
+private:
+  void run();
+  int clear(uint64_t id, const std::filesystem::path &framesDir, bool all);
+  void progress(uint64_t id, uint64_t removed, uint64_t total, uint64_t freed);
+  void trimHistory();
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable jobCV;
+  bool stopping = false;
+  uint64_t cancelledId = 0; // running job asked to stop early
+
+  std::map<uint64_t, CleanupStatus> jobs;
+};
+
+/**
+ * Formats a job as one line of key=value pairs.
+ * @param status Job to format
+ * @return The line, ending in a newline
+ */
+std::string formatCleanupStatus(const CleanupStatus &status);
+
+#endif
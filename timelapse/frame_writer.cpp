@@ -0,0 +1,442 @@
+#include "frame_writer.h"
+#include "metrics.h"
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+// pending manifest lines force a sync once they reach this size, so they are written out even when syncs are rare
+static constexpr size_t MANIFEST_FLUSH_BYTES = 16 * 1024;
+
+
+int FrameWriter::start(const std::filesystem::path &directory, const WriterOptions &options) {
+
+  stop();
+
+  dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirFd < 0) {
+    std::cerr << "Unable to open frame directory " << directory << ": " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  // a new session starts a new manifest, frames from an earlier session are overwritten from index 0
+  int truncate = options.appendManifest ? 0 : O_TRUNC;
+  manifestFd = openat(dirFd, MANIFEST_FILE, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | truncate, 0644);
+  if (manifestFd < 0) {
+    std::cerr << "Unable to open frame manifest: " << std::strerror(errno) << std::endl;
+    close(dirFd);
+    dirFd = -1;
+    return -1;
+  }
+
+  pendingManifest.reserve(MANIFEST_FLUSH_BYTES + 256);
+  pendingManifest.clear();
+  if (!options.appendManifest) {
+    pendingManifest = "# index\tsensor_ns\tunix_ms\tfile\toffset\tsize\tluma\n";
+  } else {
+    trimTornManifestLine();
+  }
+
+  size_t buffers = std::max<size_t>(options.buffers, 1);
+
+  pool.clear();
+  pool.resize(buffers);
+  freeBuffers.clear();
+  for (JpegBuffer &buffer : pool) {
+    buffer.data.resize(options.bufferCapacity);
+    freeBuffers.push_back(&buffer);
+  }
+
+  syncInterval = options.syncEvery;
+  store = options.store;
+  segmentCapacity = std::max(options.segmentFrames, 1);
+  segmentCount.store(options.firstSegment);
+  unsyncedFrames = 0;
+  frames.store(0);
+  bytes.store(0);
+  duplicates.store(0);
+  evicted.store(0);
+  haveLastRecord = false;
+
+  quotaBytes = options.quotaBytes;
+  minFreePercent = options.minFreePercent;
+  storedFiles.clear();
+  evictedFiles.clear();
+  storedBytes = 0;
+
+  // a resumed session's earlier frames count against the quota too
+  if (quotaBytes > 0 && options.appendManifest) {
+    std::vector<FrameRecord> records;
+    readManifest(directory / MANIFEST_FILE, records);
+
+    const FrameRecord *previous = nullptr;
+    for (const FrameRecord &record : records) {
+      // duplicates repeat the frame before them, they take no space
+      if (!previous || std::strcmp(previous->file, record.file) != 0 || previous->offset != record.offset) {
+        trackStored(record);
+      }
+      previous = &record;
+    }
+  }
+
+  // taken after the resumed frames, they are already on disk
+  readFreeSpace();
+
+  // a queued buffer is never dropped, the pool size already bounds the queue
+  writer.start(1, buffers, QueuePolicy::Block,
+               [this](WriteJob &job) { writeJob(job); },
+               [this](WriteJob &job) { if (job.buffer) release(job.buffer); });
+
+  return 0;
+}
+
+
+JpegBuffer *FrameWriter::acquire() {
+  std::unique_lock<std::mutex> lock(poolMutex);
+  poolCV.wait(lock, [this] { return !freeBuffers.empty(); });
+
+  JpegBuffer *buffer = freeBuffers.back();
+  freeBuffers.pop_back();
+
+  return buffer;
+}
+
+
+void FrameWriter::release(JpegBuffer *buffer) {
+  {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    freeBuffers.push_back(buffer);
+  }
+  poolCV.notify_one();
+}
+
+
+void FrameWriter::submit(const FrameRecord &record, JpegBuffer *buffer) {
+  WriteJob job;
+  job.buffer = buffer;
+  job.record = record;
+
+  writer.submit(job);
+}
+
+
+void FrameWriter::submitDuplicate(const FrameRecord &record) {
+  WriteJob job;
+  job.record = record;
+
+  writer.submit(job);
+}
+
+
+// a crash can leave a torn last line, cut it off so the first appended record is not glued onto it
+void FrameWriter::trimTornManifestLine() {
+
+  off_t end = lseek(manifestFd, 0, SEEK_END);
+  if (end <= 0) {
+    return;
+  }
+
+  // records are well under 256 bytes, so the last newline is in the tail unless the file has no complete line at all
+  char tail[256];
+  off_t start = std::max<off_t>(end - static_cast<off_t>(sizeof(tail)), 0);
+  ssize_t length = pread(manifestFd, tail, end - start, start);
+  if (length <= 0 || tail[length - 1] == '\n') {
+    return;
+  }
+
+  off_t keep = -1;
+  for (ssize_t i = length - 1; i >= 0; i--) {
+    if (tail[i] == '\n') {
+      keep = start + i + 1;
+      break;
+    }
+  }
+
+  if (keep < 0) {
+    if (start > 0) {
+      return;
+    }
+    keep = 0;
+  }
+
+  if (ftruncate(manifestFd, keep) < 0) {
+    std::cerr << "Unable to trim frame manifest: " << std::strerror(errno) << std::endl;
+  }
+}
+
+
+void FrameWriter::appendManifest(const FrameRecord &record) {
+
+  char line[160];
+  size_t length = formatManifestRecord(record, line, sizeof(line));
+  pendingManifest.append(line, length);
+
+  // the lines may only go out after a sync, so a full buffer brings the next sync forward
+  if (pendingManifest.size() >= MANIFEST_FLUSH_BYTES) {
+    syncDirectory();
+  }
+}
+
+
+void FrameWriter::flushManifest() {
+
+  const char *data = pendingManifest.data();
+  size_t left = pendingManifest.size();
+
+  while (left > 0) {
+    ssize_t written = write(manifestFd, data, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error writing frame manifest: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    data += written;
+    left -= written;
+  }
+
+  pendingManifest.clear();
+}
+
+
+// the only place manifest lines are written: the frames are synced first, so the manifest never lists a frame that is not
+// on disk yet, and evicted files are only removed once the lines marking them evicted are on disk too
+void FrameWriter::syncDirectory() {
+
+  if (syncfs(dirFd) < 0) {
+    std::cerr << "Syncing frame directory failed: " << std::strerror(errno) << std::endl;
+  }
+  unsyncedFrames = 0;
+
+  flushManifest();
+  if (fdatasync(manifestFd) < 0) {
+    std::cerr << "Syncing frame manifest failed: " << std::strerror(errno) << std::endl;
+  }
+
+  for (const StoredFile &stored : evictedFiles) {
+    if (unlinkat(dirFd, stored.file, 0) < 0 && errno != ENOENT) {
+      std::cerr << "Unable to evict " << stored.file << ": " << std::strerror(errno) << std::endl;
+    }
+  }
+  evictedFiles.clear();
+
+  readFreeSpace();
+}
+
+
+// one statvfs call, the estimate is counted down by each write until the next one
+void FrameWriter::readFreeSpace() {
+
+  struct statvfs fs;
+  if (fstatvfs(dirFd, &fs) < 0) {
+    return;
+  }
+
+  totalSpace = static_cast<uint64_t>(fs.f_blocks) * fs.f_frsize;
+  freeSpace.store(static_cast<uint64_t>(fs.f_bavail) * fs.f_frsize);
+  lowStorage.store(minFreePercent > 0 && freeSpace.load() * 100 < totalSpace * minFreePercent);
+}
+
+
+// counts a stored frame against the quota and the free space estimate
+void FrameWriter::trackStored(const FrameRecord &record) {
+
+  if (!storedFiles.empty() && std::strcmp(storedFiles.back().file, record.file) == 0) {
+    storedFiles.back().lastIndex = record.index;
+    storedFiles.back().frames++;
+    storedFiles.back().bytes += record.size;
+  } else {
+    StoredFile stored;
+    std::memcpy(stored.file, record.file, sizeof(stored.file));
+    stored.lastIndex = record.index;
+    stored.frames = 1;
+    stored.bytes = record.size;
+    storedFiles.push_back(stored);
+  }
+
+  storedBytes += record.size;
+
+  uint64_t free = freeSpace.load();
+  freeSpace.store((free > record.size) ? free - record.size : 0);
+  lowStorage.store(minFreePercent > 0 && freeSpace.load() * 100 < totalSpace * minFreePercent);
+}
+
+
+// evicts the oldest files until the session fits its quota again, the file being written to is always kept
+// the manifest marks the frames as evicted before they are removed, so readers never look for a frame that is gone
+void FrameWriter::enforceQuota() {
+
+  if (quotaBytes == 0 || storedBytes <= quotaBytes || storedFiles.size() < 2) {
+    return;
+  }
+
+  size_t evict = 0;
+  uint64_t evictBytes = 0;
+  while (evict + 1 < storedFiles.size() && storedBytes - evictBytes > quotaBytes) {
+    evictBytes += storedFiles[evict].bytes;
+    evict++;
+  }
+
+  char line[64];
+  size_t length = formatManifestEviction(storedFiles[evict - 1].lastIndex + 1, line, sizeof(line));
+  pendingManifest.append(line, length);
+
+  // the files count as gone right away, they are removed by the next sync once the eviction line is on disk
+  uint64_t framesGone = 0;
+  for (size_t i = 0; i < evict; i++) {
+    framesGone += storedFiles.front().frames;
+    evictedFiles.push_back(storedFiles.front());
+    storedFiles.pop_front();
+  }
+
+  storedBytes -= evictBytes;
+
+  evicted.fetch_add(framesGone);
+  countMetric(Metric::FramesEvicted, framesGone);
+}
+
+
+// appends the frame to the current segment, starting a new one every segmentFrames frames
+int FrameWriter::writeSegmentFrame(WriteJob &job) {
+
+  if (!segment.isOpen() || segment.frames() >= segmentCapacity) {
+    segment.close();
+
+    std::snprintf(segmentName, sizeof(segmentName), "segment_%06d.seg", segmentCount.fetch_add(1));
+    if (segment.open(dirFd, segmentName, segmentCapacity) < 0) {
+      return -1;
+    }
+  }
+
+  uint64_t offset = 0;
+  int err = segment.append(job.buffer->data.data(), job.buffer->size, job.record.index, job.record.sensorNs, offset);
+  if (err) {
+    return err;
+  }
+
+  std::memcpy(job.record.file, segmentName, sizeof(job.record.file));
+  job.record.offset = offset;
+
+  return 0;
+}
+
+
+// runs on the writer thread
+void FrameWriter::writeJob(WriteJob &job) {
+
+  StageTimer timer(Stage::Write);
+
+  // a duplicate points at the data of the last frame written, nothing new is stored
+  if (!job.buffer) {
+    if (haveLastRecord) {
+      job.record.offset = lastRecord.offset;
+      job.record.size = lastRecord.size;
+      job.record.luma = lastRecord.luma;
+      std::memcpy(job.record.file, lastRecord.file, sizeof(job.record.file));
+      appendManifest(job.record);
+      duplicates.fetch_add(1);
+    }
+    return;
+  }
+
+  if (store == FrameStore::Segments) {
+    if (writeSegmentFrame(job) == 0) {
+      frames.fetch_add(1);
+      bytes.fetch_add(job.buffer->size);
+      countMetric(Metric::FramesWritten);
+      countMetric(Metric::BytesWritten, job.buffer->size);
+
+      job.record.size = job.buffer->size;
+      appendManifest(job.record);
+      lastRecord = job.record;
+      haveLastRecord = true;
+      trackStored(job.record);
+      enforceQuota();
+    } else {
+      countMetric(Metric::WriteErrors);
+    }
+
+    release(job.buffer);
+
+    if (syncInterval > 0 && ++unsyncedFrames >= syncInterval) {
+      syncDirectory();
+    }
+    return;
+  }
+
+  int fd = openat(dirFd, job.record.file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Error opening JPEG file: " << std::strerror(errno) << std::endl;
+    countMetric(Metric::WriteErrors);
+    release(job.buffer);
+    return;
+  }
+
+  const uint8_t *data = job.buffer->data.data();
+  size_t left = job.buffer->size;
+
+  while (left > 0) {
+    ssize_t written = write(fd, data, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error writing JPEG file: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    data += written;
+    left -= written;
+  }
+
+  close(fd);
+
+  if (left == 0) {
+    frames.fetch_add(1);
+    bytes.fetch_add(job.buffer->size);
+    countMetric(Metric::FramesWritten);
+    countMetric(Metric::BytesWritten, job.buffer->size);
+
+    job.record.offset = 0;
+    job.record.size = job.buffer->size;
+    appendManifest(job.record);
+    lastRecord = job.record;
+    haveLastRecord = true;
+    trackStored(job.record);
+    enforceQuota();
+  } else {
+    countMetric(Metric::WriteErrors);
+  }
+
+  release(job.buffer);
+
+  if (syncInterval > 0 && ++unsyncedFrames >= syncInterval) {
+    syncDirectory();
+  }
+}
+
+
+void FrameWriter::stop() {
+
+  writer.stop();
+
+  // the footer goes in before the final sync
+  segment.close();
+
+  if (dirFd >= 0) {
+    syncDirectory();
+    close(manifestFd);
+    close(dirFd);
+    manifestFd = -1;
+    dirFd = -1;
+  }
+}
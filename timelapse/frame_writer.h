@@ -0,0 +1,192 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+#include <string>
+
+#include "jpeg_encoder.h"
+#include "manifest.h"
+#include "segment_store.h"
+#include "worker_pool.h"
+
+/**
+ * Options for FrameWriter::start().
+ */
+struct WriterOptions {
+  size_t buffers = 8; // pooled buffers, i.e. how many compressed frames may wait for storage
+  int syncEvery = 100; // frames between filesystem syncs (0 or less only syncs when stopping and every 16 KiB of manifest lines)
+  size_t bufferCapacity = 0; // bytes preallocated per buffer, buffers still grow if a frame does not fit
+  FrameStore store = FrameStore::Files; // layout of the frames in the directory
+  int segmentFrames = 1000; // frames per segment file with FrameStore::Segments
+  bool appendManifest = false; // add to the existing manifest instead of starting a new one (resumed sessions)
+  int firstSegment = 0; // number of the first segment file written
+  uint64_t quotaBytes = 0; // once the session's stored frames take more than this, the oldest are evicted (whole segments with FrameStore::Segments) and removed by the next sync, 0 for no limit
+  int minFreePercent = 0; // storage counts as low once less than this share of the filesystem is free, 0 to never
+};
+
+/**
+ * Writer stage between the encoders and storage.
+ * Encoders compress into buffers taken from a fixed pool and hand them to a dedicated writer thread,
+ * so SD card stalls only hold up the writer (and, once every buffer is queued, the encoders) instead of capture.
+ * Filesystem syncs are batched every few frames instead of being paid per file.
+ * Frames go to one file each or are appended to segment files (see FrameStore).
+ * Every written frame is listed in the directory's manifest (see MANIFEST_FILE), which is flushed with each sync.
+ * Free space is read from the filesystem at start and on each sync, and counted down by every write in between.
+ */
+class FrameWriter {
+public:
+  FrameWriter() = default;
+  FrameWriter(const FrameWriter &) = delete;
+  FrameWriter &operator=(const FrameWriter &) = delete;
+
+  ~FrameWriter() {
+    stop();
+  }
+
+  /**
+   * Allocates the buffer pool, opens the manifest and starts the writer thread.
+   * @param directory Directory frames are written to
+   * @param options Writer options (see WriterOptions)
+   * @return 0 on success, non-zero on error
+   */
+  int start(const std::filesystem::path &directory, const WriterOptions &options);
+
+  /**
+   * Takes a free buffer from the pool, blocking while every buffer is waiting on storage.
+   * @return Buffer to compress into, owned by the writer
+   */
+  JpegBuffer *acquire();
+
+  /**
+   * Returns a buffer to the pool without writing it (e.g. if encoding failed).
+   */
+  void release(JpegBuffer *buffer);
+
+  /**
+   * Queues a compressed frame for writing. The buffer goes back to the pool once it is on disk.
+   * @param record Manifest record of the frame, file is the name inside the writer's directory (offset and size are filled in by the writer)
+   * @param buffer Buffer from acquire() holding the compressed frame
+   */
+  void submit(const FrameRecord &record, JpegBuffer *buffer);
+
+  /**
+   * Lists a frame in the manifest as a repeat of the last frame written, without storing anything.
+   * Dropped if no frame has been written since start().
+   * @param record Manifest record of the frame (file, offset, size and luma are taken from the last frame written)
+   */
+  void submitDuplicate(const FrameRecord &record);
+
+  /**
+   * Writes every queued frame, syncs the filesystem and joins the writer thread. Safe to call more than once.
+   */
+  void stop();
+
+  uint64_t framesWritten() const {
+    return frames.load();
+  }
+
+  uint64_t bytesWritten() const {
+    return bytes.load();
+  }
+
+  // frames waiting for the writer thread
+  size_t pending() const {
+    return writer.pending();
+  }
+
+  uint64_t duplicatesWritten() const {
+    return duplicates.load();
+  }
+
+  // number the next segment file will get
+  int nextSegment() const {
+    return segmentCount.load();
+  }
+
+  uint64_t framesEvicted() const {
+    return evicted.load();
+  }
+
+  // bytes free on the frame directory's filesystem, as of the last write
+  uint64_t freeBytes() const {
+    return freeSpace.load();
+  }
+
+  // true once less than WriterOptions::minFreePercent of the filesystem is free
+  bool storageLow() const {
+    return lowStorage.load();
+  }
+
+private:
+  struct WriteJob {
+    JpegBuffer *buffer = nullptr; // nullptr for a duplicate
+    FrameRecord record;
+  };
+
+  void writeJob(WriteJob &job);
+  int writeSegmentFrame(WriteJob &job);
+  void trimTornManifestLine();
+  void appendManifest(const FrameRecord &record);
+  void flushManifest();
+  void syncDirectory();
+  void readFreeSpace();
+  void trackStored(const FrameRecord &record);
+  void enforceQuota();
+
+  WorkerPool<WriteJob> writer;
+
+  std::vector<JpegBuffer> pool;
+  std::vector<JpegBuffer *> freeBuffers;
+  std::mutex poolMutex;
+  std::condition_variable poolCV;
+
+  int dirFd = -1;
+  int manifestFd = -1;
+  std::string pendingManifest; // lines not written to the manifest yet, only touched on the writer thread
+
+  // segment store state, only touched on the writer thread
+  FrameStore store = FrameStore::Files;
+  SegmentWriter segment;
+  size_t segmentCapacity = 1;
+  std::atomic<int> segmentCount{0};
+  char segmentName[64] = {};
+  int syncInterval = 0;
+  int unsyncedFrames = 0;
+
+  // last frame that was stored, repeated by duplicates, only touched on the writer thread
+  FrameRecord lastRecord;
+  bool haveLastRecord = false;
+
+  // files holding the session's frames oldest first, with the bytes and last index each holds, only touched on the writer thread
+  struct StoredFile {
+    char file[64] = {};
+    uint64_t lastIndex = 0;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+  };
+  std::deque<StoredFile> storedFiles;
+  std::vector<StoredFile> evictedFiles; // evicted from the quota, removed by the next sync
+  uint64_t storedBytes = 0;
+  uint64_t quotaBytes = 0;
+
+  // free space estimate, recalibrated from the filesystem on each sync
+  int minFreePercent = 0;
+  uint64_t totalSpace = 0;
+  std::atomic<uint64_t> freeSpace{0};
+  std::atomic<bool> lowStorage{false};
+
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> duplicates{0};
+  std::atomic<uint64_t> evicted{0};
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "job_board.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+static std::atomic<uint64_t> jobIds{0};
+
+static std::mutex boardMutex;
+static std::condition_variable boardCV;
+static uint64_t boardSequence = 0;
+static bool boardClosed = false;
+
+
+uint64_t nextJobId() {
+  return jobIds.fetch_add(1) + 1;
+}
+
+
+void notifyJobs() {
+  {
+    std::lock_guard<std::mutex> lock(boardMutex);
+    boardSequence++;
+  }
+  boardCV.notify_all();
+}
+
+
+uint64_t jobsSequence() {
+  std::lock_guard<std::mutex> lock(boardMutex);
+  return boardSequence;
+}
+
+
+bool waitJobs(uint64_t &sequence, std::chrono::milliseconds timeout) {
+
+  std::unique_lock<std::mutex> lock(boardMutex);
+
+  bool changed = boardCV.wait_for(lock, timeout, [&] {
+    return boardClosed || boardSequence != sequence;
+  });
+
+  bool moved = changed && boardSequence != sequence;
+  sequence = boardSequence;
+
+  return moved && !boardClosed;
+}
+
+
+void closeJobs() {
+  {
+    std::lock_guard<std::mutex> lock(boardMutex);
+    boardClosed = true;
+  }
+  boardCV.notify_all();
+}
+
+
+int64_t estimateRemainingMs(uint64_t done, uint64_t total, int64_t startedUnixMs, int64_t nowUnixMs) {
+
+  if (done == 0 || total <= done || startedUnixMs <= 0 || nowUnixMs <= startedUnixMs) {
+    return (total > 0 && done >= total) ? 0 : -1;
+  }
+
+  double msPerUnit = static_cast<double>(nowUnixMs - startedUnixMs) / static_cast<double>(done);
+  return static_cast<int64_t>(msPerUnit * static_cast<double>(total - done));
+}
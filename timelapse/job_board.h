@@ -0,0 +1,51 @@
+#ifndef JOB_BOARD_H
+#define JOB_BOARD_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * IDs and change notifications shared by every kind of background job (captures, renders, cleanups).
+ * IDs come from one counter, so an ID alone names a job whatever its kind.
+ * Every state change bumps a sequence number, watchers wait for it to move past the one they saw last instead of polling.
+ */
+
+/**
+ * @return ID for a new job, never 0
+ */
+uint64_t nextJobId();
+
+/**
+ * Bumps the sequence number and wakes every watcher. Called whenever a job is queued, starts or ends.
+ */
+void notifyJobs();
+
+/**
+ * @return Current sequence number
+ */
+uint64_t jobsSequence();
+
+/**
+ * Waits for a change after the one a watcher saw last.
+ * @param sequence Sequence number the watcher saw last, updated to the current one
+ * @param timeout How long to wait
+ * @return true if a job changed, false on timeout or once the board is closed
+ */
+bool waitJobs(uint64_t &sequence, std::chrono::milliseconds timeout);
+
+/**
+ * Wakes every watcher for good, e.g. when the server shuts down.
+ */
+void closeJobs();
+
+/**
+ * Estimates the time left from the progress so far.
+ * @param done Work done since startedUnixMs
+ * @param total Work in total (0 if unknown)
+ * @param startedUnixMs When the work started
+ * @param nowUnixMs Current time
+ * @return Milliseconds left, -1 if there is nothing to go by yet
+ */
+int64_t estimateRemainingMs(uint64_t done, uint64_t total, int64_t startedUnixMs, int64_t nowUnixMs);
+
+#endif
@@ -0,0 +1,630 @@
+#include "jpeg_encoder.h"
+#include "kernels.h"
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+
+// rounds up to a whole number of 8x8 DCT blocks
+static int blockAligned(int samples) {
+  return (samples + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+}
+
+
+bool canEncodeRaw(const YuvFrame &frame) {
+  if (frame.width <= 0 || frame.height <= 0) {
+    return false;
+  }
+
+  int chromaWidth = (frame.width + 1) / 2;
+
+  // interleaved chroma is split into block aligned scratch rows, so only luma is read in place
+  if (frame.chroma == ChromaLayout::Interleaved) {
+    return frame.yStride >= blockAligned(frame.width);
+  }
+
+  return frame.yStride >= blockAligned(frame.width) && frame.uvStride >= blockAligned(chromaWidth);
+}
+
+
+// libjpeg destination writing into a JpegBuffer
+struct BufferDestination {
+  struct jpeg_destination_mgr pub;
+  JpegBuffer *out;
+};
+
+// first write into an empty buffer reserves room for a typical frame
+static constexpr size_t INITIAL_BUFFER_SIZE = 256 << 10;
+
+
+static void initDestination(j_compress_ptr cinfo) {
+  BufferDestination *dest = reinterpret_cast<BufferDestination *>(cinfo->dest);
+
+  if (dest->out->data.size() < INITIAL_BUFFER_SIZE) {
+    dest->out->data.resize(INITIAL_BUFFER_SIZE);
+  }
+
+  dest->pub.next_output_byte = dest->out->data.data();
+  dest->pub.free_in_buffer = dest->out->data.size();
+}
+
+
+// buffer is full, double it and carry on where libjpeg left off
+static boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+  BufferDestination *dest = reinterpret_cast<BufferDestination *>(cinfo->dest);
+
+  size_t used = dest->out->data.size();
+  dest->out->data.resize(used * 2);
+
+  dest->pub.next_output_byte = dest->out->data.data() + used;
+  dest->pub.free_in_buffer = dest->out->data.size() - used;
+
+  return TRUE;
+}
+
+
+static void termDestination(j_compress_ptr cinfo) {
+  BufferDestination *dest = reinterpret_cast<BufferDestination *>(cinfo->dest);
+  dest->out->size = dest->out->data.size() - dest->pub.free_in_buffer;
+}
+
+
+static void setBufferDestination(jpeg_compress_struct &cinfo, BufferDestination &dest, JpegBuffer &out) {
+  dest.pub.init_destination = initDestination;
+  dest.pub.empty_output_buffer = emptyOutputBuffer;
+  dest.pub.term_destination = termDestination;
+  dest.out = &out;
+
+  out.size = 0;
+  cinfo.dest = &dest.pub;
+}
+
+
+// arena allocations are aligned for libjpeg-turbo's SIMD routines, which may also read a little past the end of sample rows
+static constexpr size_t ARENA_ALIGN = 64;
+static constexpr size_t ARENA_CHUNK_SIZE = 1 << 20;
+
+
+static size_t alignUp(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+
+/**
+ * Bump allocator backing one libjpeg pool. Memory is only given back on reset(), and chunks are kept across resets,
+ * so once the first frame has sized the arena every later frame with the same settings is served without touching the heap.
+ */
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() {
+    release();
+  }
+
+  void *allocate(size_t size) {
+    size = alignUp(std::max<size_t>(size, 1), ARENA_ALIGN);
+
+    while (current < chunks.size()) {
+      if (offset + size <= chunks[current].second) {
+        void *ptr = chunks[current].first + offset;
+        offset += size;
+        return ptr;
+      }
+      current++;
+      offset = 0;
+    }
+
+    size_t chunkSize = std::max(size, ARENA_CHUNK_SIZE);
+    uint8_t *chunk = static_cast<uint8_t *>(std::aligned_alloc(ARENA_ALIGN, alignUp(chunkSize, ARENA_ALIGN)));
+    if (!chunk) {
+      return nullptr;
+    }
+
+    chunks.emplace_back(chunk, chunkSize);
+    current = chunks.size() - 1;
+    offset = size;
+
+    return chunk;
+  }
+
+  // frees everything allocated since the last reset, merging chunks so the next cycle fits in one
+  void reset() {
+    if (chunks.size() > 1) {
+      size_t total = 0;
+      for (auto &chunk : chunks) {
+        total += chunk.second;
+      }
+      release();
+
+      uint8_t *chunk = static_cast<uint8_t *>(std::aligned_alloc(ARENA_ALIGN, alignUp(total, ARENA_ALIGN)));
+      if (chunk) {
+        chunks.emplace_back(chunk, total);
+      }
+    }
+
+    current = 0;
+    offset = 0;
+  }
+
+  void release() {
+    for (auto &chunk : chunks) {
+      std::free(chunk.first);
+    }
+    chunks.clear();
+    current = 0;
+    offset = 0;
+  }
+
+private:
+  std::vector<std::pair<uint8_t *, size_t>> chunks;
+  size_t current = 0;
+  size_t offset = 0;
+};
+
+
+// whole-image virtual arrays, kept entirely in memory (libjpeg uses these for the coefficient buffer when optimize_coding is set)
+struct jvirt_sarray_control {
+  JSAMPARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION samplesperrow;
+  boolean pre_zero;
+  jvirt_sarray_ptr next;
+};
+
+struct jvirt_barray_control {
+  JBLOCKARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION blocksperrow;
+  boolean pre_zero;
+  jvirt_barray_ptr next;
+};
+
+
+// error manager that jumps back into encode() instead of exiting the process
+struct JpegError {
+  struct jpeg_error_mgr pub;
+  std::jmp_buf jump;
+};
+
+
+struct JpegEncoder::State {
+  struct jpeg_compress_struct cinfo;
+  JpegError jerr;
+  BufferDestination dest;
+
+  // replaces the default manager for the lifetime of cinfo, the original is kept for what it allocated in jpeg_create_compress
+  struct jpeg_memory_mgr arenaMgr;
+  struct jpeg_memory_mgr *defaultMgr = nullptr;
+  Arena pools[JPOOL_NUMPOOLS];
+  jvirt_sarray_ptr virtSarrays = nullptr;
+  jvirt_barray_ptr virtBarrays = nullptr;
+
+  // YUV444 row for the scanline path
+  uint8_t *scratch = nullptr;
+  size_t scratchSize = 0;
+
+  // U and V rows split from interleaved chroma, one MCU row of each on the raw path
+  std::vector<uint8_t> chromaRows;
+};
+
+
+// splits interleaved chroma rows into rows of U followed by rows of V, rowStride apart, only grows the buffer when the frame gets wider
+static void splitChromaRows(const YuvFrame &frame, int firstRow, int rows, int rowStride, std::vector<uint8_t> &buffer) {
+
+  int chromaWidth = (frame.width + 1) / 2;
+  int chromaHeight = (frame.height + 1) / 2;
+
+  size_t needed = static_cast<size_t>(rowStride) * rows * 2;
+  if (buffer.size() < needed) {
+    buffer.resize(needed);
+  }
+
+  for (int i = 0; i < rows; i++) {
+    int y = std::min(firstRow + i, chromaHeight - 1);
+    uint8_t *u = buffer.data() + static_cast<size_t>(i) * rowStride;
+    uint8_t *v = u + static_cast<size_t>(rows) * rowStride;
+
+    deinterleaveUvRow(frame.u + static_cast<size_t>(y) * frame.uvStride, u, v, chromaWidth);
+  }
+}
+
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  std::longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+}
+
+
+static JpegEncoder::State *encoderState(j_common_ptr cinfo) {
+  return static_cast<JpegEncoder::State *>(cinfo->client_data);
+}
+
+
+static void *arenaAlloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  void *ptr = encoderState(cinfo)->pools[pool_id].allocate(sizeofobject);
+  if (!ptr) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+
+  return ptr;
+}
+
+
+static JSAMPARRAY arenaAllocSarray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows) {
+  size_t rowSize = alignUp(samplesperrow * sizeof(JSAMPLE), ARENA_ALIGN);
+
+  JSAMPARRAY rows = static_cast<JSAMPARRAY>(arenaAlloc(cinfo, pool_id, numrows * sizeof(JSAMPROW)));
+  JSAMPLE *samples = static_cast<JSAMPLE *>(arenaAlloc(cinfo, pool_id, numrows * rowSize));
+
+  for (JDIMENSION i = 0; i < numrows; i++) {
+    rows[i] = reinterpret_cast<JSAMPROW>(reinterpret_cast<uint8_t *>(samples) + i * rowSize);
+  }
+
+  return rows;
+}
+
+
+static JBLOCKARRAY arenaAllocBarray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows) {
+  size_t rowSize = blocksperrow * sizeof(JBLOCK);
+
+  JBLOCKARRAY rows = static_cast<JBLOCKARRAY>(arenaAlloc(cinfo, pool_id, numrows * sizeof(JBLOCKROW)));
+  JBLOCK *blocks = static_cast<JBLOCK *>(arenaAlloc(cinfo, pool_id, numrows * rowSize));
+
+  for (JDIMENSION i = 0; i < numrows; i++) {
+    rows[i] = blocks + static_cast<size_t>(i) * blocksperrow;
+  }
+
+  return rows;
+}
+
+
+static jvirt_sarray_ptr arenaRequestVirtSarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                               JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION) {
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  JpegEncoder::State *state = encoderState(cinfo);
+  jvirt_sarray_ptr array = static_cast<jvirt_sarray_ptr>(arenaAlloc(cinfo, pool_id, sizeof(jvirt_sarray_control)));
+
+  array->mem_buffer = nullptr;
+  array->rows_in_array = numrows;
+  array->samplesperrow = samplesperrow;
+  array->pre_zero = pre_zero;
+  array->next = state->virtSarrays;
+  state->virtSarrays = array;
+
+  return array;
+}
+
+
+static jvirt_barray_ptr arenaRequestVirtBarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                               JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION) {
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  JpegEncoder::State *state = encoderState(cinfo);
+  jvirt_barray_ptr array = static_cast<jvirt_barray_ptr>(arenaAlloc(cinfo, pool_id, sizeof(jvirt_barray_control)));
+
+  array->mem_buffer = nullptr;
+  array->rows_in_array = numrows;
+  array->blocksperrow = blocksperrow;
+  array->pre_zero = pre_zero;
+  array->next = state->virtBarrays;
+  state->virtBarrays = array;
+
+  return array;
+}
+
+
+static void arenaRealizeVirtArrays(j_common_ptr cinfo) {
+  JpegEncoder::State *state = encoderState(cinfo);
+
+  for (jvirt_sarray_ptr array = state->virtSarrays; array; array = array->next) {
+    if (!array->mem_buffer) {
+      array->mem_buffer = arenaAllocSarray(cinfo, JPOOL_IMAGE, array->samplesperrow, array->rows_in_array);
+      if (array->pre_zero) {
+        for (JDIMENSION i = 0; i < array->rows_in_array; i++) {
+          std::memset(array->mem_buffer[i], 0, array->samplesperrow * sizeof(JSAMPLE));
+        }
+      }
+    }
+  }
+
+  for (jvirt_barray_ptr array = state->virtBarrays; array; array = array->next) {
+    if (!array->mem_buffer) {
+      array->mem_buffer = arenaAllocBarray(cinfo, JPOOL_IMAGE, array->blocksperrow, array->rows_in_array);
+      if (array->pre_zero) {
+        for (JDIMENSION i = 0; i < array->rows_in_array; i++) {
+          std::memset(array->mem_buffer[i], 0, array->blocksperrow * sizeof(JBLOCK));
+        }
+      }
+    }
+  }
+}
+
+
+static JSAMPARRAY arenaAccessVirtSarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr, JDIMENSION start_row,
+                                        JDIMENSION num_rows, boolean) {
+  if (!ptr->mem_buffer || start_row + num_rows > ptr->rows_in_array) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
+
+  return ptr->mem_buffer + start_row;
+}
+
+
+static JBLOCKARRAY arenaAccessVirtBarray(j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION start_row,
+                                         JDIMENSION num_rows, boolean) {
+  if (!ptr->mem_buffer || start_row + num_rows > ptr->rows_in_array) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
+
+  return ptr->mem_buffer + start_row;
+}
+
+
+static void arenaFreePool(j_common_ptr cinfo, int pool_id) {
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  JpegEncoder::State *state = encoderState(cinfo);
+
+  // virtual arrays only ever live in the image pool
+  if (pool_id == JPOOL_IMAGE) {
+    state->virtSarrays = nullptr;
+    state->virtBarrays = nullptr;
+  }
+
+  state->pools[pool_id].reset();
+}
+
+
+static void arenaSelfDestruct(j_common_ptr cinfo) {
+  for (int pool = JPOOL_NUMPOOLS - 1; pool >= JPOOL_PERMANENT; pool--) {
+    arenaFreePool(cinfo, pool);
+  }
+}
+
+
+// sets compression parameters shared by both encode paths
+static void setCompressParams(jpeg_compress_struct &cinfo, const YuvFrame &frame, int quality) {
+  cinfo.image_width = frame.width;
+  cinfo.image_height = frame.height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  cinfo.optimize_coding = TRUE;
+}
+
+
+JpegEncoder::JpegEncoder() : state(std::make_unique<State>()) {
+
+  jpeg_compress_struct &cinfo = state->cinfo;
+
+  // errors only jump back once an encode has set the jump buffer, jpeg_create_compress() itself can only fail on a version mismatch
+  cinfo.err = jpeg_std_error(&state->jerr.pub);
+  state->jerr.pub.error_exit = jpegErrorExit;
+  jpeg_create_compress(&cinfo);
+
+  cinfo.client_data = state.get();
+
+  // everything libjpeg allocates from here on comes out of the arenas
+  state->defaultMgr = cinfo.mem;
+
+  jpeg_memory_mgr &mgr = state->arenaMgr;
+  mgr.alloc_small = arenaAlloc;
+  mgr.alloc_large = arenaAlloc;
+  mgr.alloc_sarray = arenaAllocSarray;
+  mgr.alloc_barray = arenaAllocBarray;
+  mgr.request_virt_sarray = arenaRequestVirtSarray;
+  mgr.request_virt_barray = arenaRequestVirtBarray;
+  mgr.realize_virt_arrays = arenaRealizeVirtArrays;
+  mgr.access_virt_sarray = arenaAccessVirtSarray;
+  mgr.access_virt_barray = arenaAccessVirtBarray;
+  mgr.free_pool = arenaFreePool;
+  mgr.self_destruct = arenaSelfDestruct;
+  mgr.max_memory_to_use = state->defaultMgr->max_memory_to_use;
+  mgr.max_alloc_chunk = state->defaultMgr->max_alloc_chunk;
+
+  cinfo.mem = &mgr;
+}
+
+
+JpegEncoder::~JpegEncoder() {
+
+  jpeg_compress_struct &cinfo = state->cinfo;
+
+  // settings tables live in the arenas, drop the pointers before the arenas go away
+  jpeg_abort_compress(&cinfo);
+  arenaSelfDestruct(reinterpret_cast<j_common_ptr>(&cinfo));
+  for (Arena &pool : state->pools) {
+    pool.release();
+  }
+
+  // hand the object back to the default manager so it frees what it allocated in jpeg_create_compress
+  cinfo.mem = state->defaultMgr;
+  jpeg_destroy_compress(&cinfo);
+
+  std::free(state->scratch);
+}
+
+
+int JpegEncoder::encode(const YuvFrame &frame, JpegBuffer &out, int quality) {
+
+  if (!canEncodeRaw(frame)) {
+    return encodeScanlines(frame, out, quality);
+  }
+
+  jpeg_compress_struct &cinfo = state->cinfo;
+
+  // an arena that can't grow or a bad virtual array access ends up here instead of exiting the process, aborting frees the
+  // image pool and resets the compress object, so the next frame starts clean (the permanent pool keeps the settings tables)
+  if (setjmp(state->jerr.jump)) {
+    jpeg_abort_compress(&cinfo);
+    return -EIO;
+  }
+
+  setBufferDestination(cinfo, state->dest, out);
+
+  setCompressParams(cinfo, frame, quality);
+
+  // data is already subsampled 4:2:0, so let libjpeg take the planes as they are
+  cinfo.raw_data_in = TRUE;
+  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 2;
+  cinfo.comp_info[1].h_samp_factor = 1;
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;
+  cinfo.comp_info[2].v_samp_factor = 1;
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  // one MCU row is 16 luma rows and 8 chroma rows
+  const int mcuRows = 2 * DCTSIZE;
+  const int chromaWidth = (frame.width + 1) / 2;
+  const int chromaHeight = (frame.height + 1) / 2;
+
+  JSAMPROW yRows[2 * DCTSIZE];
+  JSAMPROW uRows[DCTSIZE];
+  JSAMPROW vRows[DCTSIZE];
+  JSAMPARRAY planes[3] = { yRows, uRows, vRows };
+
+  for (int row = 0; row < frame.height; row += mcuRows) {
+
+    // rows past the bottom of the frame repeat the last row, libjpeg only encodes up to image_height
+    for (int i = 0; i < mcuRows; i++) {
+      int y = std::min(row + i, frame.height - 1);
+      yRows[i] = const_cast<JSAMPROW>(frame.y + static_cast<size_t>(y) * frame.yStride);
+    }
+
+    if (frame.chroma == ChromaLayout::Interleaved) {
+      int rowStride = blockAligned(chromaWidth);
+      splitChromaRows(frame, row / 2, DCTSIZE, rowStride, state->chromaRows);
+
+      for (int i = 0; i < DCTSIZE; i++) {
+        uRows[i] = state->chromaRows.data() + static_cast<size_t>(i) * rowStride;
+        vRows[i] = state->chromaRows.data() + static_cast<size_t>(DCTSIZE + i) * rowStride;
+      }
+    } else {
+      for (int i = 0; i < DCTSIZE; i++) {
+        int y = std::min(row / 2 + i, chromaHeight - 1);
+        uRows[i] = const_cast<JSAMPROW>(frame.u + static_cast<size_t>(y) * frame.uvStride);
+        vRows[i] = const_cast<JSAMPROW>(frame.v + static_cast<size_t>(y) * frame.uvStride);
+      }
+    }
+
+    jpeg_write_raw_data(&cinfo, planes, mcuRows);
+  }
+
+  // the compress object is kept for the next frame, finishing only frees the image pool
+  jpeg_finish_compress(&cinfo);
+
+  return 0;
+}
+
+
+int JpegEncoder::encodeScanlines(const YuvFrame &frame, JpegBuffer &out, int quality) {
+
+  jpeg_compress_struct &cinfo = state->cinfo;
+
+  // YUV444 row, only reallocated when the frame gets wider
+  size_t rowSize = alignUp(static_cast<size_t>(frame.width) * 3, ARENA_ALIGN);
+  if (state->scratchSize < rowSize) {
+    std::free(state->scratch);
+    state->scratch = static_cast<uint8_t *>(std::aligned_alloc(ARENA_ALIGN, rowSize));
+    state->scratchSize = state->scratch ? rowSize : 0;
+
+    if (!state->scratch) {
+      return -ENOMEM;
+    }
+  }
+
+  if (setjmp(state->jerr.jump)) {
+    jpeg_abort_compress(&cinfo);
+    return -EIO;
+  }
+
+  setBufferDestination(cinfo, state->dest, out);
+
+  setCompressParams(cinfo, frame, quality);
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  // convert YUV420 planar to YUV444 for JPEG
+  uint8_t *row_buffer = state->scratch;
+
+  // conversion is interleaved with compression, so only the conversion part of each row is added up
+  uint64_t convertNs = 0;
+
+  int chromaWidth = (frame.width + 1) / 2;
+
+  for (int y = 0; y < frame.height; y++) {
+    const uint8_t *yRow = frame.y + static_cast<size_t>(y) * frame.yStride;
+    const uint8_t *uRow = frame.u + static_cast<size_t>(y / 2) * frame.uvStride;
+    const uint8_t *vRow = frame.v + static_cast<size_t>(y / 2) * frame.uvStride;
+
+    uint64_t rowStart = stageClockNs();
+
+    // each chroma row serves two luma rows, it is only split on the first
+    if (frame.chroma == ChromaLayout::Interleaved) {
+      if (y % 2 == 0) {
+        splitChromaRows(frame, y / 2, 1, chromaWidth, state->chromaRows);
+      }
+      uRow = state->chromaRows.data();
+      vRow = uRow + chromaWidth;
+    }
+
+    interleaveYuv420Row(yRow, uRow, vRow, row_buffer, frame.width);
+
+    convertNs += stageClockNs() - rowStart;
+
+    jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+
+  stageHistogram(Stage::Convert).record(convertNs);
+
+  return 0;
+}
+
+
+// each encoder thread gets its own persistent encoder on first use, torn down when the thread exits
+static JpegEncoder &threadEncoder() {
+  thread_local JpegEncoder encoder;
+  return encoder;
+}
+
+
+int encodeJpeg(const YuvFrame &frame, JpegBuffer &out, int quality) {
+  return threadEncoder().encode(frame, out, quality);
+}
+
+
+int encodeJpegScanlines(const YuvFrame &frame, JpegBuffer &out, int quality) {
+  return threadEncoder().encodeScanlines(frame, out, quality);
+}
@@ -0,0 +1,96 @@
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// how the subsampled chroma of a frame is stored
+enum class ChromaLayout : int {
+  Planar = 0, // separate U and V planes (YUV420)
+  Interleaved = 1 // one plane of UV pairs (NV12), u points at the first U sample and v at the first V sample
+};
+
+/**
+ * Borrowed view of a YUV420 frame (full resolution Y plane, U/V subsampled 2x2), with planar or interleaved chroma.
+ */
+struct YuvFrame {
+  const uint8_t *y = nullptr;
+  const uint8_t *u = nullptr;
+  const uint8_t *v = nullptr;
+  int width = 0;
+  int height = 0;
+  int yStride = 0; // bytes between rows of the Y plane
+  int uvStride = 0; // bytes between rows of the U and V planes (of the UV plane when interleaved)
+  ChromaLayout chroma = ChromaLayout::Planar;
+};
+
+/**
+ * In-memory destination for compressed frames. The vector only ever grows, so after the first few frames encoding into a reused buffer does not allocate.
+ */
+struct JpegBuffer {
+  std::vector<uint8_t> data;
+  size_t size = 0; // bytes of data holding the compressed frame
+};
+
+/**
+ * Checks whether a frame can be handed to libjpeg as raw 4:2:0 data.
+ * libjpeg reads whole 8x8 blocks, so every row must be readable up to the next block boundary.
+ * @param frame Frame to check
+ * @return true if the raw data path can be used, false if the frame has to go through the scanline path
+ */
+bool canEncodeRaw(const YuvFrame &frame);
+
+/**
+ * Persistent libjpeg state for one encoder thread.
+ * The compress object, an arena-backed libjpeg memory manager and the scratch row are created once and reused for every frame,
+ * so once the arena has grown to fit the first frame, encoding does no heap allocations.
+ */
+class JpegEncoder {
+public:
+  struct State;
+
+  JpegEncoder();
+  ~JpegEncoder();
+
+  JpegEncoder(const JpegEncoder &) = delete;
+  JpegEncoder &operator=(const JpegEncoder &) = delete;
+
+  /**
+   * Raw data encode, see encodeJpeg().
+   */
+  int encode(const YuvFrame &frame, JpegBuffer &out, int quality);
+
+  /**
+   * Scanline encode, see encodeJpegScanlines().
+   */
+  int encodeScanlines(const YuvFrame &frame, JpegBuffer &out, int quality);
+
+private:
+  std::unique_ptr<State> state;
+};
+
+/**
+ * Compresses a YUV420 frame to JPEG using jpeg_write_raw_data with 2x2 chroma subsampling.
+ * Runs on a JpegEncoder owned by the calling thread.
+ * Plane rows are passed to libjpeg directly in 16 row MCU batches, no conversion or copy is done (interleaved chroma is split into 8 scratch rows per batch).
+ * Falls back to the scanline path if canEncodeRaw() is false for the frame.
+ * @param frame Frame to compress
+ * @param out Buffer the JPEG is written to, grown if it is too small
+ * @param quality JPEG quality (0-100)
+ * @return 0 on success, non-zero on error
+ */
+int encodeJpeg(const YuvFrame &frame, JpegBuffer &out, int quality);
+
+/**
+ * Compresses a YUV420 frame to JPEG by upsampling chroma into YUV444 rows and writing one scanline at a time.
+ * Runs on a JpegEncoder owned by the calling thread.
+ * @param frame Frame to compress
+ * @param out Buffer the JPEG is written to, grown if it is too small
+ * @param quality JPEG quality (0-100)
+ * @return 0 on success, non-zero on error
+ */
+int encodeJpegScanlines(const YuvFrame &frame, JpegBuffer &out, int quality);
+
+#endif
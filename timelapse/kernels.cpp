@@ -0,0 +1,346 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+#if defined(__aarch64__)
+static KernelPath activePath = KernelPath::Neon;
+#else
+static KernelPath activePath = KernelPath::Scalar;
+#endif
+
+
+bool neonAvailable() {
+#if defined(__aarch64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+bool setKernelPath(KernelPath path) {
+  if (path == KernelPath::Neon && !neonAvailable()) {
+    return false;
+  }
+
+  activePath = path;
+  return true;
+}
+
+
+KernelPath kernelPath() {
+  return activePath;
+}
+
+
+const char *kernelPathName(KernelPath path) {
+  return (path == KernelPath::Neon) ? "neon" : "scalar";
+}
+
+
+// scalar kernels, also used for the tails the NEON kernels leave over
+
+// walks pixel pairs so the chroma index is a plain increment instead of a division per pixel
+static void interleaveRowScalar(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *out, int start, int width) {
+
+  int x = start;
+
+  for (; x + 1 < width; x += 2) {
+    uint8_t cu = u[x / 2];
+    uint8_t cv = v[x / 2];
+
+    out[x * 3 + 0] = y[x];
+    out[x * 3 + 1] = cu;
+    out[x * 3 + 2] = cv;
+    out[x * 3 + 3] = y[x + 1];
+    out[x * 3 + 4] = cu;
+    out[x * 3 + 5] = cv;
+  }
+
+  if (x < width) {
+    out[x * 3 + 0] = y[x];
+    out[x * 3 + 1] = u[x / 2];
+    out[x * 3 + 2] = v[x / 2];
+  }
+}
+
+
+static void deinterleaveRowScalar(const uint8_t *uv, uint8_t *u, uint8_t *v, int start, int count) {
+  for (int x = start; x < count; x++) {
+    u[x] = uv[2 * x];
+    v[x] = uv[2 * x + 1];
+  }
+}
+
+
+static void downscaleRowScalar(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int start, int dstWidth) {
+  for (int x = start; x < dstWidth; x++) {
+    dst[x] = static_cast<uint8_t>((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+  }
+}
+
+
+static uint64_t sumRowScalar(const uint8_t *row, int start, int width) {
+  uint64_t sum = 0;
+  for (int x = start; x < width; x++) {
+    sum += row[x];
+  }
+  return sum;
+}
+
+
+static size_t countChangedScalar(const uint8_t *a, const uint8_t *b, size_t start, size_t count, uint8_t delta) {
+  size_t changed = 0;
+  for (size_t i = start; i < count; i++) {
+    int diff = a[i] - b[i];
+    changed += (diff > delta || -diff > delta) ? 1 : 0;
+  }
+  return changed;
+}
+
+
+#if defined(__aarch64__)
+
+static void interleaveRowNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *out, int width) {
+
+  int x = 0;
+
+  // 16 pixels per iteration, each chroma sample is duplicated for its two pixels
+  for (; x + 16 <= width; x += 16) {
+    uint8x8_t u8 = vld1_u8(u + x / 2);
+    uint8x8_t v8 = vld1_u8(v + x / 2);
+
+    uint8x8x2_t uPairs = vzip_u8(u8, u8);
+    uint8x8x2_t vPairs = vzip_u8(v8, v8);
+
+    uint8x16x3_t pixels;
+    pixels.val[0] = vld1q_u8(y + x);
+    pixels.val[1] = vcombine_u8(uPairs.val[0], uPairs.val[1]);
+    pixels.val[2] = vcombine_u8(vPairs.val[0], vPairs.val[1]);
+
+    vst3q_u8(out + x * 3, pixels);
+  }
+
+  interleaveRowScalar(y, u, v, out, x, width);
+}
+
+
+static void deinterleaveRowNeon(const uint8_t *uv, uint8_t *u, uint8_t *v, int count) {
+
+  int x = 0;
+
+  // the structured load splits 16 pairs into their U and V halves
+  for (; x + 16 <= count; x += 16) {
+    uint8x16x2_t pairs = vld2q_u8(uv + 2 * x);
+    vst1q_u8(u + x, pairs.val[0]);
+    vst1q_u8(v + x, pairs.val[1]);
+  }
+
+  deinterleaveRowScalar(uv, u, v, x, count);
+}
+
+
+static void downscaleRowNeon(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int dstWidth) {
+
+  int x = 0;
+
+  // 16 source columns of both rows make 8 output samples
+  for (; x + 8 <= dstWidth; x += 8) {
+    uint16x8_t sum = vpaddlq_u8(vld1q_u8(top + 2 * x));
+    sum = vpadalq_u8(sum, vld1q_u8(bottom + 2 * x));
+    vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+  }
+
+  downscaleRowScalar(top, bottom, dst, x, dstWidth);
+}
+
+
+static uint64_t sumRowNeon(const uint8_t *row, int width) {
+
+  int x = 0;
+  uint32x4_t acc = vdupq_n_u32(0);
+
+  // a lane gains at most 4 * 255 per iteration, so 32 bit lanes cannot overflow within a row
+  for (; x + 16 <= width; x += 16) {
+    acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(row + x)));
+  }
+
+  return vaddlvq_u32(acc) + sumRowScalar(row, x, width);
+}
+
+
+static size_t countChangedNeon(const uint8_t *a, const uint8_t *b, size_t count, uint8_t delta) {
+
+  size_t i = 0;
+  uint32x4_t acc = vdupq_n_u32(0);
+  const uint8x16_t limit = vdupq_n_u8(delta);
+
+  // changed lanes are all ones, shifting down to 1 before widening keeps the count exact
+  for (; i + 16 <= count; i += 16) {
+    uint8x16_t changed = vcgtq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), limit);
+    acc = vpadalq_u16(acc, vpaddlq_u8(vshrq_n_u8(changed, 7)));
+  }
+
+  return vaddlvq_u32(acc) + countChangedScalar(a, b, i, count, delta);
+}
+
+#endif
+
+
+void interleaveYuv420Row(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *out, int width) {
+#if defined(__aarch64__)
+  if (activePath == KernelPath::Neon) {
+    interleaveRowNeon(y, u, v, out, width);
+    return;
+  }
+#endif
+
+  interleaveRowScalar(y, u, v, out, 0, width);
+}
+
+
+void deinterleaveUvRow(const uint8_t *uv, uint8_t *u, uint8_t *v, int count) {
+#if defined(__aarch64__)
+  if (activePath == KernelPath::Neon) {
+    deinterleaveRowNeon(uv, u, v, count);
+    return;
+  }
+#endif
+
+  deinterleaveRowScalar(uv, u, v, 0, count);
+}
+
+
+void downscale2x(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride) {
+
+  int dstWidth = width / 2;
+  int dstHeight = height / 2;
+
+  for (int row = 0; row < dstHeight; row++) {
+    const uint8_t *top = src + static_cast<size_t>(2 * row) * srcStride;
+    const uint8_t *bottom = top + srcStride;
+    uint8_t *out = dst + static_cast<size_t>(row) * dstStride;
+
+#if defined(__aarch64__)
+    if (activePath == KernelPath::Neon) {
+      downscaleRowNeon(top, bottom, out, dstWidth);
+      continue;
+    }
+#endif
+
+    downscaleRowScalar(top, bottom, out, 0, dstWidth);
+  }
+}
+
+
+uint64_t lumaSum(const uint8_t *plane, int width, int height, int stride) {
+
+  uint64_t sum = 0;
+
+  for (int row = 0; row < height; row++) {
+    const uint8_t *samples = plane + static_cast<size_t>(row) * stride;
+
+#if defined(__aarch64__)
+    if (activePath == KernelPath::Neon) {
+      sum += sumRowNeon(samples, width);
+      continue;
+    }
+#endif
+
+    sum += sumRowScalar(samples, 0, width);
+  }
+
+  return sum;
+}
+
+
+// there is no useful vector scatter for histograms, both paths count into 4 interleaved tables
+// so runs of equal samples (flat sky, black frames) do not serialize on the same counter
+void lumaHistogram(const uint8_t *plane, int width, int height, int stride, uint32_t histogram[256]) {
+
+  uint32_t tables[4][256];
+  std::memset(tables, 0, sizeof(tables));
+
+  for (int row = 0; row < height; row++) {
+    const uint8_t *samples = plane + static_cast<size_t>(row) * stride;
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+      tables[0][samples[x + 0]]++;
+      tables[1][samples[x + 1]]++;
+      tables[2][samples[x + 2]]++;
+      tables[3][samples[x + 3]]++;
+    }
+
+    for (; x < width; x++) {
+      tables[0][samples[x]]++;
+    }
+  }
+
+  for (int i = 0; i < 256; i++) {
+    histogram[i] = tables[0][i] + tables[1][i] + tables[2][i] + tables[3][i];
+  }
+}
+
+
+size_t gridSamples(int width, int height, int step) {
+
+  step = std::max(step, 1);
+
+  return static_cast<size_t>((width + step - 1) / step) * ((height + step - 1) / step);
+}
+
+
+// strided loads do not vectorize, the grid is small enough that this stays in the microseconds
+size_t sampleGrid(const uint8_t *plane, int width, int height, int stride, int step, uint8_t *grid) {
+
+  step = std::max(step, 1);
+  size_t samples = 0;
+
+  for (int row = 0; row < height; row += step) {
+    const uint8_t *line = plane + static_cast<size_t>(row) * stride;
+
+    for (int x = 0; x < width; x += step) {
+      grid[samples++] = line[x];
+    }
+  }
+
+  return samples;
+}
+
+
+size_t gridHistogram(const uint8_t *plane, int width, int height, int stride, int step, uint32_t histogram[256]) {
+
+  step = std::max(step, 1);
+  std::memset(histogram, 0, 256 * sizeof(uint32_t));
+  size_t samples = 0;
+
+  for (int row = 0; row < height; row += step) {
+    const uint8_t *line = plane + static_cast<size_t>(row) * stride;
+
+    for (int x = 0; x < width; x += step) {
+      histogram[line[x]]++;
+      samples++;
+    }
+  }
+
+  return samples;
+}
+
+
+size_t countChanged(const uint8_t *a, const uint8_t *b, size_t count, uint8_t delta) {
+#if defined(__aarch64__)
+  if (activePath == KernelPath::Neon) {
+    return countChangedNeon(a, b, count, delta);
+  }
+#endif
+
+  return countChangedScalar(a, b, 0, count, delta);
+}
@@ -0,0 +1,119 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// implementation used by the pixel kernels below
+enum class KernelPath : int {
+  Scalar = 0, // portable C++
+  Neon = 1 // aarch64 NEON, only available when built for aarch64
+};
+
+/**
+ * Selects the implementation used by every kernel. Defaults to NEON when it is available.
+ * @param path Path to use
+ * @return true if the path was selected, false if it is not available in this build
+ */
+bool setKernelPath(KernelPath path);
+
+KernelPath kernelPath();
+
+bool neonAvailable();
+
+/**
+ * Short lowercase name of a kernel path, used in logs.
+ */
+const char *kernelPathName(KernelPath path);
+
+/**
+ * Upsamples one row of YUV420 chroma and interleaves it with luma into packed YUV444 (Y, U, V per pixel).
+ * @param y Luma row, width samples
+ * @param u U row, (width + 1) / 2 samples
+ * @param v V row, (width + 1) / 2 samples
+ * @param out Packed row, width * 3 bytes
+ * @param width Pixels in the row
+ */
+void interleaveYuv420Row(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *out, int width);
+
+/**
+ * Splits one row of interleaved chroma (NV12 UV pairs) into separate U and V rows.
+ * @param uv Interleaved row, count pairs
+ * @param u U row, count samples
+ * @param v V row, count samples
+ * @param count Chroma samples per plane
+ */
+void deinterleaveUvRow(const uint8_t *uv, uint8_t *u, uint8_t *v, int count);
+
+/**
+ * Halves a plane in both directions, each output sample is the rounded mean of a 2x2 block.
+ * An odd last row or column of the source is dropped.
+ * @param src Source plane
+ * @param srcStride Bytes between source rows
+ * @param width Source width in samples
+ * @param height Source height in rows
+ * @param dst Destination plane, at least width / 2 by height / 2
+ * @param dstStride Bytes between destination rows
+ */
+void downscale2x(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride);
+
+/**
+ * Sums every sample of a plane, e.g. for mean brightness.
+ * @param plane Plane to sum
+ * @param width Samples per row
+ * @param height Rows
+ * @param stride Bytes between rows
+ * @return Sum of all samples
+ */
+uint64_t lumaSum(const uint8_t *plane, int width, int height, int stride);
+
+/**
+ * Counts how often each value occurs in a plane.
+ * @param plane Plane to count
+ * @param width Samples per row
+ * @param height Rows
+ * @param stride Bytes between rows
+ * @param histogram 256 bins, overwritten
+ */
+void lumaHistogram(const uint8_t *plane, int width, int height, int stride, uint32_t histogram[256]);
+
+/**
+ * Copies every step-th sample of every step-th row of a plane into a packed grid, a cheap thumbnail for change detection.
+ * @param plane Plane to sample
+ * @param width Samples per row
+ * @param height Rows
+ * @param stride Bytes between rows
+ * @param step Distance between grid samples in both directions (at least 1)
+ * @param grid Destination, at least gridSamples(width, height, step) bytes
+ * @return Number of samples written
+ */
+size_t sampleGrid(const uint8_t *plane, int width, int height, int stride, int step, uint8_t *grid);
+
+/**
+ * Counts how often each value occurs on a coarse grid of a plane, the samples sampleGrid() would take.
+ * @param plane Plane to count
+ * @param width Samples per row
+ * @param height Rows
+ * @param stride Bytes between rows
+ * @param step Distance between grid samples in both directions (at least 1)
+ * @param histogram 256 bins, overwritten
+ * @return Number of samples counted
+ */
+size_t gridHistogram(const uint8_t *plane, int width, int height, int stride, int step, uint32_t histogram[256]);
+
+/**
+ * @return Number of samples sampleGrid() writes for a plane
+ */
+size_t gridSamples(int width, int height, int step);
+
+/**
+ * Counts the samples that differ by more than delta between two grids.
+ * @param a First grid
+ * @param b Second grid
+ * @param count Samples per grid
+ * @param delta Largest difference that still counts as unchanged
+ * @return Number of changed samples
+ */
+size_t countChanged(const uint8_t *a, const uint8_t *b, size_t count, uint8_t delta);
+
+#endif
@@ -0,0 +1,216 @@
+#include "live_encoder.h"
+#include "cpu_budget.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+int LiveEncoder::start(int width, int height, int fps, const std::vector<std::string> &codecArgs, const std::string &outputPath, uint64_t firstIndex,
+                       ChromaLayout chroma) {
+
+  finish();
+
+  std::string sizeStr = std::to_string(width) + "x" + std::to_string(height);
+  std::string fpsStr = std::to_string(fps);
+
+  std::vector<std::string> args = {
+    "ffmpeg",
+    "-f", "rawvideo",
+    "-pix_fmt", (chroma == ChromaLayout::Interleaved) ? "nv12" : "yuv420p",
+    "-video_size", sizeStr,
+    "-framerate", fpsStr,
+    "-i", "pipe:0"
+  };
+  args.insert(args.end(), codecArgs.begin(), codecArgs.end());
+  args.insert(args.end(), { "-pix_fmt", "yuv420p", outputPath });
+
+  std::vector<char *> argv;
+  for (std::string &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    std::cerr << "Unable to create live encoder pipe: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  // parsed before forking, the child may only make system calls
+  cpuBudget();
+
+  pid = fork();
+
+  if (pid < 0) {
+    std::cerr << "Unable to fork process" << std::endl;
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  // child process executes ffmpeg reading frames from stdin, off the capture core and behind capture for CPU and IO
+  if (pid == 0) {
+    enterRenderBudget();
+    dup2(fds[0], STDIN_FILENO);
+    execv("/usr/bin/ffmpeg", argv.data());
+
+    std::cerr << "Exec'ing ffmpeg command failed: " << std::strerror(errno) << std::endl;
+    _exit(1);
+  }
+
+  close(fds[0]);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  pipeFd = fds[1];
+  nextIndex = firstIndex;
+  skipped.clear();
+  broken = false;
+  inputChroma = chroma;
+
+  std::cout << "Live encoding " << sizeStr << " at " << fps << " fps to " << outputPath << std::endl;
+
+  return 0;
+}
+
+
+void LiveEncoder::waitTurn(std::unique_lock<std::mutex> &lock, uint64_t index) {
+  turnCV.wait(lock, [this, index] { return nextIndex >= index; });
+}
+
+
+void LiveEncoder::advance(std::unique_lock<std::mutex> &lock) {
+  nextIndex++;
+
+  // skipped frames never take their turn, step over them so the frame after them can write
+  while (!skipped.empty() && *skipped.begin() <= nextIndex) {
+    if (*skipped.begin() == nextIndex) {
+      nextIndex++;
+    }
+    skipped.erase(skipped.begin());
+  }
+
+  lock.unlock();
+  turnCV.notify_all();
+}
+
+
+int LiveEncoder::writePlane(const uint8_t *plane, int rowBytes, int rows, int stride) {
+
+  // contiguous planes go out in one write, padded ones row by row
+  size_t chunk = (stride == rowBytes) ? static_cast<size_t>(rowBytes) * rows : rowBytes;
+  int chunks = (stride == rowBytes) ? 1 : rows;
+
+  for (int i = 0; i < chunks; i++) {
+    const uint8_t *data = plane + static_cast<size_t>(i) * stride;
+    size_t left = chunk;
+
+    while (left > 0) {
+      ssize_t written = write(pipeFd, data, left);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Live encoder write failed: " << std::strerror(errno) << std::endl;
+        return -1;
+      }
+
+      data += written;
+      left -= written;
+    }
+  }
+
+  return 0;
+}
+
+
+int LiveEncoder::writeFrame(uint64_t index, const YuvFrame &frame) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+  waitTurn(lock, index);
+
+  int err = 0;
+
+  if (pipeFd < 0 || broken) {
+    err = -1;
+  } else {
+    int chromaWidth = (frame.width + 1) / 2;
+    int chromaHeight = (frame.height + 1) / 2;
+
+    if (writePlane(frame.y, frame.width, frame.height, frame.yStride) < 0) {
+      broken = true;
+      err = -1;
+    } else if (inputChroma == ChromaLayout::Interleaved) {
+      // ffmpeg was told nv12, the UV pairs go out as one plane
+      if (writePlane(frame.u, chromaWidth * 2, chromaHeight, frame.uvStride) < 0) {
+        broken = true;
+        err = -1;
+      }
+    } else if (writePlane(frame.u, chromaWidth, chromaHeight, frame.uvStride) < 0 ||
+               writePlane(frame.v, chromaWidth, chromaHeight, frame.uvStride) < 0) {
+      broken = true;
+      err = -1;
+    }
+  }
+
+  advance(lock);
+
+  return err;
+}
+
+
+void LiveEncoder::skipFrame(uint64_t index) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (index == nextIndex) {
+    advance(lock);
+  } else if (index > nextIndex) {
+    skipped.insert(index);
+  }
+}
+
+
+int LiveEncoder::finish() {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pipeFd < 0) {
+      return 0;
+    }
+
+    // end of input lets ffmpeg flush and finalize the file
+    close(pipeFd);
+    pipeFd = -1;
+  }
+
+  std::cout << "Waiting for live encoder to finish..." << std::endl;
+
+  int childStatus;
+  pid_t result;
+  do {
+    result = waitpid(pid, &childStatus, 0);
+  } while (result < 0 && errno == EINTR);
+
+  pid = -1;
+
+  if (result < 0) {
+    std::cerr << "waitpid failed: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  if (WIFEXITED(childStatus)) {
+    int err = WEXITSTATUS(childStatus);
+    if (err) {
+      std::cerr << "ffmpeg exited with code " << err << std::endl;
+    }
+    return err;
+  }
+
+  std::cout << "ffmpeg killed by signal " << WTERMSIG(childStatus) << std::endl;
+  return -1;
+}
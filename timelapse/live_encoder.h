@@ -0,0 +1,85 @@
+#ifndef LIVE_ENCODER_H
+#define LIVE_ENCODER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "jpeg_encoder.h"
+
+/**
+ * Streams raw YUV420 (or NV12) frames into an ffmpeg process over a pipe while recording, so the video is finished shortly after capture stops.
+ * Frames may be written from several encoder threads, they are put back in index order before reaching the pipe.
+ * The process is expected to ignore SIGPIPE, so an ffmpeg that exits early shows up as a write error.
+ */
+class LiveEncoder {
+public:
+  LiveEncoder() = default;
+  LiveEncoder(const LiveEncoder &) = delete;
+  LiveEncoder &operator=(const LiveEncoder &) = delete;
+
+  ~LiveEncoder() {
+    finish();
+  }
+
+  /**
+   * Spawns ffmpeg reading rawvideo from its stdin.
+   * @param width Frame width in pixels
+   * @param height Frame height in pixels
+   * @param fps Framerate of the output video
+   * @param codecArgs ffmpeg arguments selecting the codec and its settings (e.g. -c:v libx264 -preset faster -crf 23)
+   * @param outputPath Path the video is written to
+   * @param firstIndex Index of the first frame that will be written
+   * @param chroma Chroma layout of the frames that will be written, they are piped as they are
+   * @return 0 on success, non-zero on error
+   */
+  int start(int width, int height, int fps, const std::vector<std::string> &codecArgs, const std::string &outputPath, uint64_t firstIndex = 0,
+            ChromaLayout chroma = ChromaLayout::Planar);
+
+  /**
+   * Writes one frame to the encoder. Blocks until every frame with a lower index has been written or skipped.
+   * @param index Frame index, frames must be numbered contiguously from firstIndex
+   * @param frame Frame to write, only the visible width/height is sent
+   * @return 0 on success, non-zero if the encoder is not running or the pipe broke
+   */
+  int writeFrame(uint64_t index, const YuvFrame &frame);
+
+  /**
+   * Gives up the slot of a frame that will never be written (e.g. dropped by the encoder queue).
+   * Never blocks, so it is safe on the camera's completion thread: a frame whose turn has not come yet is stepped over when it does.
+   * @param index Frame index
+   */
+  void skipFrame(uint64_t index);
+
+  /**
+   * Closes the pipe and waits for ffmpeg to finish writing the video. Safe to call more than once.
+   * @return ffmpeg exit status, 0 on success
+   */
+  int finish();
+
+  bool isRunning() const {
+    return pipeFd >= 0;
+  }
+
+private:
+  void waitTurn(std::unique_lock<std::mutex> &lock, uint64_t index);
+  void advance(std::unique_lock<std::mutex> &lock);
+  int writePlane(const uint8_t *plane, int rowBytes, int rows, int stride);
+
+  std::mutex mutex;
+  std::condition_variable turnCV;
+  uint64_t nextIndex = 0;
+  std::set<uint64_t> skipped; // frames above nextIndex given up before their turn
+
+  pid_t pid = -1;
+  int pipeFd = -1;
+  bool broken = false;
+  ChromaLayout inputChroma = ChromaLayout::Planar;
+};
+
+#endif
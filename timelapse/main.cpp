@@ -1,4 +1,5 @@
 #include "timelapse.h"
+#include <csignal>
 #include <iostream>
 #include <string>
 #include <cctype>
@@ -16,6 +17,9 @@ bool validInput(std::string length) {
 
 int main(int argc, char* argv[]) {
 
+  // ffmpeg exiting early should show up as a write error on its pipe, not kill the recorder
+  std::signal(SIGPIPE, SIG_IGN);
+
   int err = 0;
   int timelapseLength = 0;
   int capInterval = 0;
@@ -59,6 +63,7 @@ int main(int argc, char* argv[]) {
   }
 
   err = recordTimelapseHandler(timelapseLength, capInterval);
+  releaseWarmCameras();
 
   return err;
 }
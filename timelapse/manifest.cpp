@@ -0,0 +1,152 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+
+size_t formatManifestRecord(const FrameRecord &record, char *line, size_t size) {
+
+  int length = std::snprintf(line, size, "%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%s\t%" PRIu64 "\t%" PRIu64 "\t%.2f\n",
+                             record.index, record.sensorNs, record.unixMs, record.file, record.offset, record.size, record.luma);
+
+  if (length < 0) {
+    return 0;
+  }
+
+  return std::min(static_cast<size_t>(length), size - 1);
+}
+
+
+// eviction lines are comments to readers that do not know them
+static constexpr const char *EVICTION_PREFIX = "#evicted\t";
+
+
+size_t formatManifestEviction(uint64_t firstKept, char *line, size_t size) {
+
+  int length = std::snprintf(line, size, "%s%" PRIu64 "\n", EVICTION_PREFIX, firstKept);
+
+  if (length < 0) {
+    return 0;
+  }
+
+  return std::min(static_cast<size_t>(length), size - 1);
+}
+
+
+int readManifest(const std::filesystem::path &path, std::vector<FrameRecord> &records) {
+
+  records.clear();
+  uint64_t firstKept = 0;
+
+  FILE *file = std::fopen(path.c_str(), "r");
+  if (!file) {
+    return -1;
+  }
+
+  char line[256];
+  while (std::fgets(line, sizeof(line), file)) {
+
+    // only complete lines count, a frame is listed once it was fully written
+    if (line[0] == '#' || !std::strchr(line, '\n')) {
+      if (std::strncmp(line, EVICTION_PREFIX, std::strlen(EVICTION_PREFIX)) == 0) {
+        firstKept = std::max<uint64_t>(firstKept, std::strtoull(line + std::strlen(EVICTION_PREFIX), nullptr, 10));
+      }
+      continue;
+    }
+
+    // manifests written before the luma column have six columns
+    FrameRecord record;
+    if (std::sscanf(line, "%" SCNu64 "\t%" SCNu64 "\t%" SCNd64 "\t%63[^\t]\t%" SCNu64 "\t%" SCNu64 "\t%f",
+                    &record.index, &record.sensorNs, &record.unixMs, record.file, &record.offset, &record.size, &record.luma) < 6) {
+      continue;
+    }
+
+    records.push_back(record);
+  }
+
+  std::fclose(file);
+
+  // the writer lists frames in the order they reach storage, which can differ slightly from capture order
+  std::stable_sort(records.begin(), records.end(), [](const FrameRecord &a, const FrameRecord &b) {
+    return a.index < b.index;
+  });
+
+  // keep the last line written for each index
+  std::vector<FrameRecord> unique;
+  unique.reserve(records.size());
+  for (const FrameRecord &record : records) {
+    if (record.index < firstKept) {
+      continue;
+    }
+    if (!unique.empty() && unique.back().index == record.index) {
+      unique.back() = record;
+    } else {
+      unique.push_back(record);
+    }
+  }
+  records.swap(unique);
+
+  return 0;
+}
+
+
+// whether a wall clock time falls in the daily window, in local time so "06:00" means what the clock on the wall said
+static bool inDailyWindow(int64_t unixMs, int startMinute, int endMinute) {
+
+  time_t seconds = unixMs / 1000;
+  struct tm local;
+  localtime_r(&seconds, &local);
+
+  int minute = local.tm_hour * 60 + local.tm_min;
+
+  if (startMinute <= endMinute) {
+    return minute >= startMinute && minute < endMinute;
+  }
+
+  // e.g. 22:00 to 04:00
+  return minute >= startMinute || minute < endMinute;
+}
+
+
+void selectFrames(std::vector<FrameRecord> &records, const FrameSelection &selection) {
+
+  bool daily = selection.dayStartMinute >= 0 && selection.dayEndMinute >= 0;
+  size_t stride = (selection.stride > 1) ? selection.stride : 1;
+
+  size_t kept = 0;
+  size_t inRange = 0;
+
+  for (size_t i = 0; i < records.size(); i++) {
+    const FrameRecord &record = records[i];
+
+    if (selection.startUnixMs > 0 && record.unixMs < selection.startUnixMs) {
+      continue;
+    }
+    if (selection.endUnixMs > 0 && record.unixMs >= selection.endUnixMs) {
+      continue;
+    }
+    if (daily && !inDailyWindow(record.unixMs, selection.dayStartMinute, selection.dayEndMinute)) {
+      continue;
+    }
+
+    // the stride counts frames in range, so it does not depend on where the range starts
+    if (inRange++ % stride == 0) {
+      records[kept++] = record;
+    }
+  }
+
+  records.resize(kept);
+
+  // spread the frames that fit over the whole selection instead of cutting it short
+  if (selection.maxFrames > 0 && records.size() > selection.maxFrames) {
+    size_t total = records.size();
+    for (size_t i = 0; i < selection.maxFrames; i++) {
+      records[i] = records[i * total / selection.maxFrames];
+    }
+    records.resize(selection.maxFrames);
+  }
+}
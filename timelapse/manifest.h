@@ -0,0 +1,71 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// name of the manifest inside the frame directory
+inline constexpr const char *MANIFEST_FILE = "manifest.tsv";
+
+/**
+ * One saved frame as listed in the manifest.
+ * Fixed size so records can be passed between threads without allocating.
+ */
+struct FrameRecord {
+  uint64_t index = 0; // position among the session's saved frames, contiguous from 0
+  uint64_t sensorNs = 0; // sensor timestamp from FrameMetadata
+  int64_t unixMs = 0; // wall clock time the frame completed
+  char file[64] = {}; // file holding the frame, relative to the frame directory
+  uint64_t offset = 0; // byte offset of the frame inside file
+  uint64_t size = 0; // bytes of the frame
+  float luma = 0; // mean luma of the frame (0-255) measured on a coarse grid during capture, 0 if not measured
+};
+
+/**
+ * Which recorded frames a render uses, picked from the manifest so unused frames are never read. Zero values select everything.
+ */
+struct FrameSelection {
+  int64_t startUnixMs = 0; // frames completed at or after this time (0 for no lower bound)
+  int64_t endUnixMs = 0; // frames completed before this time (0 for no upper bound)
+  int dayStartMinute = -1; // daily window in local time, in minutes after midnight, wrapping past midnight if it ends before it starts (-1 for none)
+  int dayEndMinute = -1;
+  int stride = 1; // every Nth frame of those in range
+  size_t maxFrames = 0; // frames left after the above are thinned evenly down to this many (0 for no limit)
+};
+
+/**
+ * Formats a record as one tab separated manifest line. Readers that predate a trailing column ignore it.
+ * @param record Record to format
+ * @param line Destination, truncated if too small
+ * @param size Size of line
+ * @return Length of the line including the trailing newline
+ */
+size_t formatManifestRecord(const FrameRecord &record, char *line, size_t size);
+
+/**
+ * Formats the line marking every frame before firstKept as evicted (see WriterOptions::quotaBytes).
+ * @param firstKept Index of the oldest frame still stored
+ * @param line Destination, truncated if too small
+ * @param size Size of line
+ * @return Length of the line including the trailing newline
+ */
+size_t formatManifestEviction(uint64_t firstKept, char *line, size_t size);
+
+/**
+ * Reads a manifest written by the frame writer. Malformed lines (e.g. a torn last line after a power cut) are skipped.
+ * @param path Manifest to read
+ * @param records Records sorted by index, a later line for an index replaces an earlier one, frames evicted since they were listed are left out
+ * @return 0 on success, non-zero if the manifest could not be opened
+ */
+int readManifest(const std::filesystem::path &path, std::vector<FrameRecord> &records);
+
+/**
+ * Keeps the records a selection picks, in order.
+ * @param records Records sorted by index, reduced to the selected ones
+ * @param selection Frames to keep
+ */
+void selectFrames(std::vector<FrameRecord> &records, const FrameSelection &selection);
+
+#endif
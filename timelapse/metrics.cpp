@@ -0,0 +1,167 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include "stage_stats.h"
+
+static constexpr int METRIC_COUNT = static_cast<int>(Metric::Count);
+
+// one thread's counters, only ever written by that thread
+struct ThreadCounters {
+  std::atomic<uint64_t> values[METRIC_COUNT] = {};
+};
+
+// counters of the live threads, and the totals of threads that have exited
+struct CounterRegistry {
+  std::mutex mutex;
+  std::vector<ThreadCounters *> threads;
+  uint64_t retired[METRIC_COUNT] = {};
+};
+
+
+// created before the first thread registers, so it outlives every thread's counters
+static CounterRegistry &registry() {
+  static CounterRegistry counters;
+  return counters;
+}
+
+
+// registers the calling thread's counters on first use and folds them into the retired totals when the thread exits
+struct ThreadSlot {
+  ThreadCounters counters;
+
+  ThreadSlot() {
+    CounterRegistry &counterRegistry = registry();
+    std::lock_guard<std::mutex> lock(counterRegistry.mutex);
+    counterRegistry.threads.push_back(&counters);
+  }
+
+  ~ThreadSlot() {
+    CounterRegistry &counterRegistry = registry();
+    std::lock_guard<std::mutex> lock(counterRegistry.mutex);
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      counterRegistry.retired[i] += counters.values[i].load(std::memory_order_relaxed);
+    }
+
+    auto &threads = counterRegistry.threads;
+    threads.erase(std::remove(threads.begin(), threads.end(), &counters), threads.end());
+  }
+};
+
+
+void countMetric(Metric metric, uint64_t amount) {
+
+  thread_local ThreadSlot slot;
+
+  // this thread is the only writer, so no read-modify-write is needed
+  std::atomic<uint64_t> &value = slot.counters.values[static_cast<int>(metric)];
+  value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+
+uint64_t metricTotal(Metric metric) {
+
+  int index = static_cast<int>(metric);
+
+  CounterRegistry &counterRegistry = registry();
+  std::lock_guard<std::mutex> lock(counterRegistry.mutex);
+
+  uint64_t total = counterRegistry.retired[index];
+  for (ThreadCounters *counters : counterRegistry.threads) {
+    total += counters->values[index].load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+
+const char *metricName(Metric metric) {
+  switch (metric) {
+    case Metric::FramesCaptured: return "timelapse_frames_captured_total";
+    case Metric::FramesDropped: return "timelapse_frames_dropped_total";
+    case Metric::FramesLate: return "timelapse_frames_late_total";
+    case Metric::SlotsMissed: return "timelapse_slots_missed_total";
+    case Metric::FramesUnchanged: return "timelapse_frames_unchanged_total";
+    case Metric::FramesWritten: return "timelapse_frames_written_total";
+    case Metric::BytesWritten: return "timelapse_bytes_written_total";
+    case Metric::WriteErrors: return "timelapse_write_errors_total";
+    case Metric::PreviewFrames: return "timelapse_preview_frames_total";
+    case Metric::RendersFinished: return "timelapse_renders_finished_total";
+    case Metric::RendersFailed: return "timelapse_renders_failed_total";
+    case Metric::Downloads: return "timelapse_downloads_total";
+    case Metric::DownloadBytes: return "timelapse_download_bytes_total";
+    case Metric::FramesEvicted: return "timelapse_frames_evicted_total";
+    case Metric::EncodeErrors: return "timelapse_encode_errors_total";
+    case Metric::Count: break;
+  }
+
+  return "timelapse_unknown_total";
+}
+
+
+static const char *metricHelp(Metric metric) {
+  switch (metric) {
+    case Metric::FramesCaptured: return "Frames handed to the encoders.";
+    case Metric::FramesDropped: return "Frames discarded because the encoders fell behind.";
+    case Metric::FramesLate: return "Frames exposed late after their capture slot.";
+    case Metric::SlotsMissed: return "Capture slots that passed without a frame.";
+    case Metric::FramesUnchanged: return "Frames adaptive capture did not save.";
+    case Metric::FramesWritten: return "Frames stored by the frame writer.";
+    case Metric::BytesWritten: return "Bytes of the stored frames.";
+    case Metric::WriteErrors: return "Frames the frame writer failed to store.";
+    case Metric::PreviewFrames: return "Frames encoded for the live preview.";
+    case Metric::RendersFinished: return "Render jobs that ran to an end.";
+    case Metric::RendersFailed: return "Render jobs that failed.";
+    case Metric::Downloads: return "Timelapse downloads sent in full.";
+    case Metric::DownloadBytes: return "Bytes sent to timelapse download clients.";
+    case Metric::FramesEvicted: return "Stored frames removed to keep sessions within their storage quota.";
+    case Metric::EncodeErrors: return "Frames no encoder managed to compress.";
+    case Metric::Count: break;
+  }
+
+  return "";
+}
+
+
+void appendMetric(std::string &out, const char *name, const char *type, const char *help, double value) {
+
+  char line[256];
+  std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+  out += line;
+}
+
+
+std::string formatMetrics() {
+
+  std::string out;
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    Metric metric = static_cast<Metric>(i);
+    appendMetric(out, metricName(metric), "counter", metricHelp(metric), static_cast<double>(metricTotal(metric)));
+  }
+
+  out += "# HELP timelapse_stage_seconds Latency of each pipeline stage in the current recording session.\n";
+  out += "# TYPE timelapse_stage_seconds summary\n";
+
+  for (int i = 0; i < static_cast<int>(Stage::Count); i++) {
+    const char *stage = stageName(static_cast<Stage>(i));
+    StageSummary summary = stageHistogram(static_cast<Stage>(i)).summary();
+
+    char lines[512];
+    std::snprintf(lines, sizeof(lines),
+                  "timelapse_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+                  "timelapse_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+                  "timelapse_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                  "timelapse_stage_seconds_count{stage=\"%s\"} %llu\n",
+                  stage, summary.p50Ns / 1e9, stage, summary.p99Ns / 1e9, stage, summary.meanNs * static_cast<double>(summary.count) / 1e9,
+                  stage, static_cast<unsigned long long>(summary.count));
+    out += lines;
+  }
+
+  return out;
+}
@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstdint>
+#include <string>
+
+// process wide counters, they only ever grow for the lifetime of the process
+enum class Metric : int {
+  FramesCaptured = 0, // frames handed to the encoders
+  FramesDropped = 1, // frames discarded because the encoders fell behind
+  FramesLate = 2, // frames exposed later than LATE_TOLERANCE_MS after their capture slot
+  SlotsMissed = 3, // capture slots that passed without a frame
+  FramesUnchanged = 4, // frames adaptive capture did not save
+  FramesWritten = 5, // frames stored by the frame writer
+  BytesWritten = 6, // bytes of the stored frames
+  WriteErrors = 7, // frames the frame writer failed to store
+  PreviewFrames = 8, // frames encoded for the live preview
+  RendersFinished = 9, // render jobs that finished, failed or were cancelled while running
+  RendersFailed = 10,
+  Downloads = 11, // /download-timelapse responses sent in full
+  DownloadBytes = 12, // bytes sent to download clients, including downloads cut short
+  FramesEvicted = 13, // stored frames removed to keep a session within its storage quota
+  EncodeErrors = 14, // frames no encoder managed to compress
+  Count = 15
+};
+
+/**
+ * Adds to a counter. Every thread counts into its own slots, which are only summed up when the metrics are read,
+ * so counting is a relaxed load and store with no contention between threads.
+ * @param metric Counter to add to
+ * @param amount Amount to add
+ */
+void countMetric(Metric metric, uint64_t amount = 1);
+
+/**
+ * Sums a counter over every thread, including threads that have exited.
+ * @param metric Counter to read
+ * @return Total so far
+ */
+uint64_t metricTotal(Metric metric);
+
+/**
+ * @return Prometheus name of a counter (e.g. timelapse_frames_captured_total)
+ */
+const char *metricName(Metric metric);
+
+/**
+ * Appends one metric in the Prometheus text format.
+ * @param out Text to append to
+ * @param name Metric name
+ * @param type Prometheus type (counter or gauge)
+ * @param help One line description
+ * @param value Current value
+ */
+void appendMetric(std::string &out, const char *name, const char *type, const char *help, double value);
+
+/**
+ * Formats every counter and the per stage latencies (see stage_stats.h) in the Prometheus text format.
+ * @return Metrics text, one sample per line
+ */
+std::string formatMetrics();
+
+#endif
@@ -0,0 +1,272 @@
+#include "part_encoder.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+// how often the manifest is checked for new frames
+static constexpr auto PART_POLL_INTERVAL = 10s;
+
+// frames at the end of the manifest left for the next check, the writer may still be flushing the lines after them
+static constexpr size_t PART_SLACK = 64;
+
+// a finished part as listed in the index
+struct PartEntry {
+  std::string file;
+  uint64_t firstIndex;
+  uint64_t lastIndex;
+  size_t frames;
+  std::string settings;
+};
+
+
+// key identifying the settings a part was encoded with, only parts with the render's key are reused
+static std::string settingsKey(int fps, const std::vector<std::string> &codecArgs) {
+
+  std::string key = "fps=" + std::to_string(fps);
+  for (const std::string &arg : codecArgs) {
+    key += ' ';
+    key += arg;
+  }
+
+  return key;
+}
+
+
+// reads the index in order, stopping at the first incomplete line
+static std::vector<PartEntry> readPartsIndex(const std::filesystem::path &path) {
+
+  std::vector<PartEntry> entries;
+
+  FILE *file = std::fopen(path.c_str(), "r");
+  if (!file) {
+    return entries;
+  }
+
+  char line[512];
+  while (std::fgets(line, sizeof(line), file)) {
+
+    size_t length = std::strlen(line);
+    if (length == 0 || line[length - 1] != '\n') {
+      break;
+    }
+    line[length - 1] = '\0';
+
+    char name[64];
+    PartEntry entry;
+    int consumed = 0;
+
+    if (std::sscanf(line, "%63[^\t]\t%" SCNu64 "\t%" SCNu64 "\t%zu\t%n", name, &entry.firstIndex, &entry.lastIndex, &entry.frames, &consumed) != 4 || consumed == 0) {
+      break;
+    }
+
+    entry.file = name;
+    entry.settings = line + consumed;
+    entries.push_back(entry);
+  }
+
+  std::fclose(file);
+
+  return entries;
+}
+
+
+// entries of the index that hold the leading records in order, and how many records they hold
+static size_t matchingParts(const std::vector<PartEntry> &entries, const std::vector<FrameRecord> &records, const std::string &settings,
+                            std::vector<const PartEntry *> &matched) {
+
+  size_t covered = 0;
+
+  for (const PartEntry &entry : entries) {
+    if (entry.settings != settings || entry.frames == 0 || covered + entry.frames > records.size()) {
+      break;
+    }
+    if (records[covered].index != entry.firstIndex || records[covered + entry.frames - 1].index != entry.lastIndex) {
+      break;
+    }
+
+    matched.push_back(&entry);
+    covered += entry.frames;
+  }
+
+  return covered;
+}
+
+
+int PartEncoder::start(const std::filesystem::path &framesDir, int fps, const std::vector<std::string> &codecArgs, int partFrames, bool keepParts) {
+
+  stop();
+
+  this->dir = framesDir;
+  this->partsDir = framesDir / PARTS_DIR;
+  this->fps = fps;
+  this->codecArgs = codecArgs;
+  this->settings = settingsKey(fps, codecArgs);
+  this->partFrames = (partFrames > 0) ? partFrames : 1;
+
+  covered = 0;
+  parts.store(0);
+
+  std::error_code ec;
+
+  if (keepParts) {
+    // carry on after the parts that still match the manifest, anything past them is dropped from the index
+    std::vector<FrameRecord> records;
+    readManifest(dir / MANIFEST_FILE, records);
+
+    std::vector<PartEntry> entries = readPartsIndex(partsDir / PARTS_INDEX_FILE);
+    std::vector<const PartEntry *> matched;
+    covered = matchingParts(entries, records, settings, matched);
+    parts.store(matched.size());
+
+    if (matched.size() != entries.size()) {
+      FILE *index = std::fopen((partsDir / PARTS_INDEX_FILE).c_str(), "w");
+      if (index) {
+        for (const PartEntry *entry : matched) {
+          std::fprintf(index, "%s\t%" PRIu64 "\t%" PRIu64 "\t%zu\t%s\n", entry->file.c_str(), entry->firstIndex, entry->lastIndex,
+                       entry->frames, entry->settings.c_str());
+        }
+        std::fclose(index);
+      }
+    }
+
+    if (!matched.empty()) {
+      std::cout << "Keeping " << matched.size() << " encoded parts (" << covered << " frames)" << std::endl;
+    }
+  } else {
+    std::filesystem::remove_all(partsDir, ec);
+  }
+
+  std::filesystem::create_directories(partsDir, ec);
+  if (ec) {
+    std::cerr << "Unable to create " << partsDir << ": " << ec.message() << std::endl;
+    return -1;
+  }
+
+  stopping.store(false);
+  control.reset();
+  thread = std::thread(&PartEncoder::run, this);
+
+  return 0;
+}
+
+
+void PartEncoder::stop() {
+
+  if (!thread.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping.store(true);
+  }
+  stopCV.notify_all();
+  control.cancel();
+
+  thread.join();
+}
+
+
+int PartEncoder::encodePart(const std::vector<FrameRecord> &records) {
+
+  char name[64];
+  std::snprintf(name, sizeof(name), "part_%06zu.mp4", parts.load());
+
+  int err = renderRecords(dir, records, fps, codecArgs, (partsDir / name).string(), dir / "part.ffconcat", control);
+  if (err) {
+    return err;
+  }
+
+  // the part only counts once it is listed, so a crash before this leaves it to be encoded again
+  int fd = open((partsDir / PARTS_INDEX_FILE).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Unable to open parts index: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  char line[512];
+  int length = std::snprintf(line, sizeof(line), "%s\t%" PRIu64 "\t%" PRIu64 "\t%zu\t%s\n", name, records.front().index,
+                             records.back().index, records.size(), settings.c_str());
+
+  ssize_t written = write(fd, line, length);
+  close(fd);
+
+  if (written != length) {
+    std::cerr << "Unable to write parts index" << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void PartEncoder::run() {
+
+  std::vector<FrameRecord> records;
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (!stopping.load()) {
+
+    stopCV.wait_for(lock, PART_POLL_INTERVAL, [this]{ return stopping.load(); });
+    if (stopping.load()) {
+      break;
+    }
+
+    lock.unlock();
+
+    readManifest(dir / MANIFEST_FILE, records);
+
+    bool failed = false;
+
+    while (!stopping.load() && records.size() >= covered + partFrames + PART_SLACK) {
+
+      std::vector<FrameRecord> part(records.begin() + covered, records.begin() + covered + partFrames);
+
+      if (encodePart(part) != 0) {
+        failed = true;
+        break;
+      }
+
+      covered += partFrames;
+      parts.fetch_add(1);
+      std::cout << "Encoded part " << parts.load() << " (frames " << part.front().index << "-" << part.back().index << ")" << std::endl;
+    }
+
+    lock.lock();
+
+    // ffmpeg missing or the disk full will not get better by retrying every few seconds, renders fall back to a full encode
+    if (failed && !stopping.load()) {
+      std::cerr << "Part encoding failed, no more parts this session" << std::endl;
+      break;
+    }
+  }
+}
+
+
+size_t reusableParts(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records, int fps,
+                     const std::vector<std::string> &codecArgs, std::vector<std::filesystem::path> &videos) {
+
+  std::filesystem::path partsDir = framesDir / PARTS_DIR;
+
+  std::vector<PartEntry> entries = readPartsIndex(partsDir / PARTS_INDEX_FILE);
+  std::vector<const PartEntry *> matched;
+  size_t covered = matchingParts(entries, records, settingsKey(fps, codecArgs), matched);
+
+  videos.clear();
+  for (const PartEntry *entry : matched) {
+    videos.push_back(partsDir / entry->file);
+  }
+
+  return covered;
+}
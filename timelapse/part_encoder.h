@@ -0,0 +1,91 @@
+#ifndef PART_ENCODER_H
+#define PART_ENCODER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "manifest.h"
+#include "render.h"
+
+// directory inside the frame directory holding the encoded parts
+inline constexpr const char *PARTS_DIR = "parts";
+
+// index of the finished parts inside PARTS_DIR
+inline constexpr const char *PARTS_INDEX_FILE = "parts.tsv";
+
+/**
+ * Encodes the frames of a recording into closed-GOP video parts in the background while capture is running,
+ * so a render later on only has to encode the frames after the last part and stream copy the rest.
+ * A part is listed in PARTS_INDEX_FILE once ffmpeg finished it, an interrupted part is simply encoded again.
+ */
+class PartEncoder {
+public:
+  PartEncoder() = default;
+  PartEncoder(const PartEncoder &) = delete;
+  PartEncoder &operator=(const PartEncoder &) = delete;
+
+  ~PartEncoder() {
+    stop();
+  }
+
+  /**
+   * Starts the background thread, which checks the manifest for a part's worth of new frames every few seconds.
+   * @param framesDir Frame directory of the recording
+   * @param fps Framerate of the parts
+   * @param codecArgs ffmpeg arguments selecting the codec, renders only reuse parts encoded with the same fps and arguments
+   * @param partFrames Frames per part
+   * @param keepParts Continue after the parts already listed in the index (resumed sessions) instead of starting over
+   * @return 0 on success, non-zero on error
+   */
+  int start(const std::filesystem::path &framesDir, int fps, const std::vector<std::string> &codecArgs, int partFrames, bool keepParts);
+
+  /**
+   * Stops the background thread, a part still being encoded is abandoned. Safe to call more than once.
+   */
+  void stop();
+
+  size_t partsEncoded() const {
+    return parts.load();
+  }
+
+private:
+  void run();
+  int encodePart(const std::vector<FrameRecord> &records);
+
+  std::filesystem::path dir;
+  std::filesystem::path partsDir;
+  int fps = 0;
+  std::vector<std::string> codecArgs;
+  std::string settings;
+  size_t partFrames = 0;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable stopCV;
+  std::atomic<bool> stopping{false};
+  RenderControl control; // cancels the part being encoded
+
+  size_t covered = 0; // manifest records already in parts
+  std::atomic<size_t> parts{0};
+};
+
+/**
+ * Collects the encoded parts that a render of the records can reuse: parts encoded with the same settings that hold exactly the
+ * first records, in order. The render then only has to encode the records after them.
+ * @param framesDir Frame directory the parts were encoded from
+ * @param records Frames to render, in output order
+ * @param fps Framerate of the render
+ * @param codecArgs ffmpeg arguments selecting the codec of the render
+ * @param videos Filled with the usable parts in order
+ * @return Number of leading records held by the usable parts
+ */
+size_t reusableParts(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records, int fps,
+                     const std::vector<std::string> &codecArgs, std::vector<std::filesystem::path> &videos);
+
+#endif
@@ -0,0 +1,246 @@
+#include "preview.h"
+
+#include <algorithm>
+#include <map>
+
+#include "kernels.h"
+
+// scratch plane rows are padded to whole JPEG blocks so the raw encode path can read them
+static constexpr int PLANE_ALIGN = 16;
+
+
+static int alignedStride(int samples) {
+  return (samples + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+}
+
+
+bool PreviewHub::claim(uint64_t nowNs) {
+
+  if (viewerCount.load(std::memory_order_relaxed) <= 0) {
+    return false;
+  }
+
+  uint64_t due = nextDueNs.load(std::memory_order_relaxed);
+  if (nowNs < due) {
+    return false;
+  }
+
+  // whoever moves the deadline first gets the frame
+  return nextDueNs.compare_exchange_strong(due, nowNs + intervalNs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+
+void PreviewHub::publish(PreviewFrame frame) {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    latest = std::move(frame);
+    latestSequence++;
+  }
+  frameCV.notify_all();
+}
+
+
+bool PreviewHub::waitFrame(uint64_t &sequence, PreviewFrame &frame, std::chrono::milliseconds timeout) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  bool newer = frameCV.wait_for(lock, timeout, [&] { return isClosed.load() || (latest && latestSequence != sequence); });
+  if (!newer || isClosed.load()) {
+    return false;
+  }
+
+  frame = latest;
+  sequence = latestSequence;
+
+  return true;
+}
+
+
+void PreviewHub::close() {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    isClosed.store(true);
+  }
+  frameCV.notify_all();
+}
+
+
+bool PreviewHub::addViewer(int maxViewers) {
+
+  int current = viewerCount.load();
+  do {
+    if (current >= maxViewers) {
+      return false;
+    }
+  } while (!viewerCount.compare_exchange_weak(current, current + 1));
+
+  return true;
+}
+
+
+void PreviewHub::removeViewer() {
+  viewerCount.fetch_sub(1);
+}
+
+
+void PreviewHub::setFps(int fps) {
+  intervalNs.store(1000000000ull / std::max(fps, 1));
+}
+
+
+// hubs by camera ID, never erased so viewers can hold on to a hub between recordings
+static std::mutex hubsMutex;
+static std::map<std::string, std::unique_ptr<PreviewHub>> hubs;
+static bool hubsClosed = false;
+
+
+PreviewHub &previewHub(const std::string &cameraId) {
+
+  std::lock_guard<std::mutex> lock(hubsMutex);
+
+  std::unique_ptr<PreviewHub> &hub = hubs[cameraId];
+  if (!hub) {
+    hub = std::make_unique<PreviewHub>();
+    if (hubsClosed) {
+      hub->close();
+    }
+  }
+
+  return *hub;
+}
+
+
+int previewViewers() {
+
+  std::lock_guard<std::mutex> lock(hubsMutex);
+
+  int viewers = 0;
+  for (const auto &[id, hub] : hubs) {
+    viewers += hub->viewers();
+  }
+
+  return viewers;
+}
+
+
+void closePreviews() {
+
+  std::lock_guard<std::mutex> lock(hubsMutex);
+
+  hubsClosed = true;
+  for (const auto &[id, hub] : hubs) {
+    hub->close();
+  }
+}
+
+
+// one downscaled copy of a frame
+struct PreviewPlanes {
+  std::vector<uint8_t> y;
+  std::vector<uint8_t> u;
+  std::vector<uint8_t> v;
+
+  // full resolution chroma split from an interleaved source, halving pairs would mix U and V
+  std::vector<uint8_t> splitU;
+  std::vector<uint8_t> splitV;
+};
+
+
+// halves a chroma plane to dstWidth x dstHeight, the chroma size of the halved frame, which is one more column (or row)
+// than downscale2x() writes when the source count is odd: the edge averages the last source column (or row) with itself
+static void halveChroma(const uint8_t *src, int srcStride, int width, int height, uint8_t *dst, int dstStride, int dstWidth, int dstHeight) {
+
+  downscale2x(src, srcStride, width, height, dst, dstStride);
+
+  auto sample = [&](int x, int y) {
+    return src[static_cast<size_t>(std::min(y, height - 1)) * srcStride + std::min(x, width - 1)];
+  };
+  auto average = [&](int x, int y) {
+    return static_cast<uint8_t>((sample(2 * x, 2 * y) + sample(2 * x + 1, 2 * y) + sample(2 * x, 2 * y + 1) + sample(2 * x + 1, 2 * y + 1) + 2) >> 2);
+  };
+
+  for (int x = width / 2; x < dstWidth; x++) {
+    for (int y = 0; y < dstHeight; y++) {
+      dst[static_cast<size_t>(y) * dstStride + x] = average(x, y);
+    }
+  }
+
+  for (int y = height / 2; y < dstHeight; y++) {
+    for (int x = 0; x < width / 2; x++) {
+      dst[static_cast<size_t>(y) * dstStride + x] = average(x, y);
+    }
+  }
+}
+
+
+// halves src into planes, returning a view of the result
+static YuvFrame halveFrame(const YuvFrame &src, PreviewPlanes &planes) {
+
+  YuvFrame dst;
+  dst.width = src.width / 2;
+  dst.height = src.height / 2;
+  dst.yStride = alignedStride(dst.width);
+  dst.uvStride = alignedStride((dst.width + 1) / 2);
+
+  int chromaWidth = (src.width + 1) / 2;
+  int chromaHeight = (src.height + 1) / 2;
+  int dstChromaWidth = (dst.width + 1) / 2;
+  int dstChromaHeight = (dst.height + 1) / 2;
+
+  // grows on the first frame only, later frames reuse the planes
+  planes.y.resize(std::max(planes.y.size(), static_cast<size_t>(dst.yStride) * dst.height));
+  planes.u.resize(std::max(planes.u.size(), static_cast<size_t>(dst.uvStride) * dstChromaHeight));
+  planes.v.resize(std::max(planes.v.size(), planes.u.size()));
+
+  const uint8_t *u = src.u;
+  const uint8_t *v = src.v;
+  int uvStride = src.uvStride;
+
+  if (src.chroma == ChromaLayout::Interleaved) {
+    planes.splitU.resize(std::max(planes.splitU.size(), static_cast<size_t>(chromaWidth) * chromaHeight));
+    planes.splitV.resize(planes.splitU.size());
+
+    for (int row = 0; row < chromaHeight; row++) {
+      size_t offset = static_cast<size_t>(row) * chromaWidth;
+      deinterleaveUvRow(src.u + static_cast<size_t>(row) * src.uvStride, planes.splitU.data() + offset, planes.splitV.data() + offset, chromaWidth);
+    }
+
+    u = planes.splitU.data();
+    v = planes.splitV.data();
+    uvStride = chromaWidth;
+  }
+
+  downscale2x(src.y, src.yStride, src.width, src.height, planes.y.data(), dst.yStride);
+  halveChroma(u, uvStride, chromaWidth, chromaHeight, planes.u.data(), dst.uvStride, dstChromaWidth, dstChromaHeight);
+  halveChroma(v, uvStride, chromaWidth, chromaHeight, planes.v.data(), dst.uvStride, dstChromaWidth, dstChromaHeight);
+
+  dst.y = planes.y.data();
+  dst.u = planes.u.data();
+  dst.v = planes.v.data();
+
+  return dst;
+}
+
+
+int encodePreview(const YuvFrame &frame, int maxWidth, int quality, PreviewFrame &out) {
+
+  // ping-pong between two scratch frames while halving
+  thread_local PreviewPlanes scratch[2];
+  thread_local JpegBuffer compressed;
+
+  YuvFrame small = frame;
+  for (int level = 0; small.width > maxWidth && small.width >= 4 && small.height >= 4; level++) {
+    small = halveFrame(small, scratch[level % 2]);
+  }
+
+  int err = encodeJpeg(small, compressed, quality);
+  if (err) {
+    return err;
+  }
+
+  out = std::make_shared<const std::vector<uint8_t>>(compressed.data.begin(), compressed.data.begin() + compressed.size);
+
+  return 0;
+}
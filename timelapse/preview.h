@@ -0,0 +1,118 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "jpeg_encoder.h"
+
+// compressed preview frame, shared read only by every viewer
+using PreviewFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
+/**
+ * Latest low resolution preview frame, fanned out to every viewer of the live preview.
+ * Capture side threads claim() a frame at most once per interval and only while someone is watching, encode it once
+ * and publish() it. Viewers wait for a newer frame than the one they sent last, so a slow viewer skips frames instead of queueing them.
+ */
+class PreviewHub {
+public:
+  PreviewHub() = default;
+  PreviewHub(const PreviewHub &) = delete;
+  PreviewHub &operator=(const PreviewHub &) = delete;
+
+  /**
+   * Claims the next preview frame. Lock free, so it can be called for every frame on the capture path.
+   * @param nowNs Monotonic time in nanoseconds
+   * @return true if someone is watching and the interval since the last claimed frame has passed, for exactly one caller
+   */
+  bool claim(uint64_t nowNs);
+
+  /**
+   * Replaces the latest frame and wakes every viewer.
+   * @param frame Compressed frame
+   */
+  void publish(PreviewFrame frame);
+
+  /**
+   * Waits for a frame newer than the one a viewer sent last.
+   * @param sequence Sequence number of the last frame sent (0 for none), updated to the returned frame's
+   * @param frame Set to the newer frame
+   * @param timeout How long to wait
+   * @return true if a newer frame was returned, false on timeout or once the hub is closed
+   */
+  bool waitFrame(uint64_t &sequence, PreviewFrame &frame, std::chrono::milliseconds timeout);
+
+  /**
+   * Wakes every viewer for good, e.g. when the server shuts down.
+   */
+  void close();
+
+  bool closed() const {
+    return isClosed.load();
+  }
+
+  /**
+   * Registers a viewer, claim() only succeeds while at least one is registered.
+   * @param maxViewers Viewer limit
+   * @return true if the viewer was registered, false if the limit is reached
+   */
+  bool addViewer(int maxViewers);
+
+  void removeViewer();
+
+  int viewers() const {
+    return viewerCount.load();
+  }
+
+  /**
+   * @param fps Preview frames per second at most (at least 1)
+   */
+  void setFps(int fps);
+
+private:
+  std::atomic<int> viewerCount{0};
+  std::atomic<uint64_t> intervalNs{200000000};
+  std::atomic<uint64_t> nextDueNs{0};
+  std::atomic<bool> isClosed{false};
+
+  std::mutex mutex;
+  std::condition_variable frameCV;
+  PreviewFrame latest;
+  uint64_t latestSequence = 0;
+};
+
+/**
+ * Looks up the hub of a camera, fed by its capture pipeline and read by the /preview endpoint. Hubs live as long as the process.
+ * @param cameraId libcamera ID of the camera
+ * @return The camera's hub, created on first use
+ */
+PreviewHub &previewHub(const std::string &cameraId);
+
+/**
+ * @return Viewers of every camera's preview
+ */
+int previewViewers();
+
+/**
+ * Closes every hub, including hubs created afterwards, e.g. when the server shuts down.
+ */
+void closePreviews();
+
+/**
+ * Halves a frame until it is no wider than maxWidth and compresses it for the preview.
+ * Scratch planes and the compressed buffer are kept per thread, only the published copy is allocated.
+ * @param frame Full resolution frame
+ * @param maxWidth Widest preview frame
+ * @param quality JPEG quality (0-100)
+ * @param out Set to the compressed frame
+ * @return 0 on success, non-zero on error
+ */
+int encodePreview(const YuvFrame &frame, int maxWidth, int quality, PreviewFrame &out);
+
+#endif
@@ -0,0 +1,566 @@
+#include "render.h"
+#include "segment_store.h"
+#include "cpu_budget.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string_view>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// how long a cancelled ffmpeg gets to exit before it is killed
+static constexpr int FFMPEG_TERM_TIMEOUT_MS = 2000;
+
+// fd ffmpeg writes its -progress key=value lines to
+static constexpr int PROGRESS_FD = 3;
+
+// ffmpeg processes started by runFfmpeg() that have not been reaped yet
+static std::atomic<int> runningRenders{0};
+
+
+RenderControl::RenderControl() {
+  cancelFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+
+RenderControl::~RenderControl() {
+  if (cancelFd >= 0) {
+    close(cancelFd);
+  }
+}
+
+
+void RenderControl::cancel() {
+
+  cancelFlag.store(true);
+
+  uint64_t one = 1;
+  if (cancelFd >= 0 && write(cancelFd, &one, sizeof(one)) < 0) {
+    // the counter only overflows after 2^64 cancels
+  }
+}
+
+
+void RenderControl::reset() {
+
+  uint64_t count;
+  if (cancelFd >= 0 && read(cancelFd, &count, sizeof(count)) < 0) {
+    // nothing was signalled
+  }
+
+  cancelFlag.store(false);
+  framesBase.store(0);
+  framesDone.store(0);
+  totalFrames.store(0);
+  encodeFps.store(0.0);
+}
+
+
+int rendersRunning() {
+  return runningRenders.load();
+}
+
+
+// streams records into ffmpeg's non-blocking stdin, reading them straight out of mapped segments (or frame files)
+class FrameFeeder {
+public:
+  FrameFeeder(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records)
+    : dir(framesDir), records(records) {}
+
+  /**
+   * Writes until the pipe is full or every frame is sent.
+   * @return 1 once every frame is sent, 0 if the pipe is full, -1 on error
+   */
+  int feed(int pipeFd) {
+
+    while (true) {
+
+      if (left == 0 && !nextFrame()) {
+        return 1;
+      }
+
+      ssize_t written = write(pipeFd, data, left);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          return 0;
+        }
+        std::cerr << "Writing frames to ffmpeg failed: " << std::strerror(errno) << std::endl;
+        return -1;
+      }
+
+      data += written;
+      left -= written;
+    }
+  }
+
+private:
+  // moves on to the next readable record, false once there are none left
+  bool nextFrame() {
+
+    while (next < records.size()) {
+      const FrameRecord &record = records[next++];
+
+      // records are sorted by index, so each segment is mapped once
+      if (mappedName != record.file) {
+        int err = file.open(dir / record.file);
+        if (err) {
+          std::cerr << "Unable to map " << record.file << ": " << std::strerror(-err) << ", skipping frame " << record.index << std::endl;
+          mappedName.clear();
+          continue;
+        }
+        mappedName = record.file;
+      }
+
+      if (record.offset + record.size > file.size()) {
+        std::cerr << "Frame " << record.index << " is past the end of " << record.file << ", skipping" << std::endl;
+        continue;
+      }
+
+      data = file.data() + record.offset;
+      left = record.size;
+      return true;
+    }
+
+    return false;
+  }
+
+  const std::filesystem::path &dir;
+  const std::vector<FrameRecord> &records;
+  size_t next = 0;
+
+  MappedFile file;
+  std::string mappedName;
+  const uint8_t *data = nullptr;
+  size_t left = 0;
+};
+
+
+// applies complete lines of ffmpeg's -progress output, a partial line stays in the buffer for the next read
+static void parseProgress(std::string &buffer, RenderControl &control) {
+
+  size_t start = 0;
+  size_t end;
+
+  while ((end = buffer.find('\n', start)) != std::string::npos) {
+    std::string_view line(buffer.data() + start, end - start);
+
+    if (line.starts_with("frame=")) {
+      control.framesDone.store(control.framesBase.load() + std::strtoull(line.data() + 6, nullptr, 10));
+    } else if (line.starts_with("fps=")) {
+      control.encodeFps.store(std::strtod(line.data() + 4, nullptr));
+    }
+
+    start = end + 1;
+  }
+
+  buffer.erase(0, start);
+}
+
+
+// waits up to timeoutMs for ffmpeg to exit, true once it was reaped
+static bool reapWithin(pid_t pid, int pidFd, int timeoutMs, int &childStatus) {
+
+  if (pidFd >= 0) {
+    pollfd exitFd = { pidFd, POLLIN, 0 };
+    if (poll(&exitFd, 1, timeoutMs) <= 0) {
+      return false;
+    }
+    return waitpid(pid, &childStatus, 0) == pid;
+  }
+
+  // no pidfd (kernels before 5.3), check in short steps
+  for (int waited = 0; waited <= timeoutMs; waited += 50) {
+    if (waitpid(pid, &childStatus, WNOHANG) == pid) {
+      return true;
+    }
+    poll(nullptr, 0, 50);
+  }
+
+  return false;
+}
+
+
+// handles ffmpeg's progress, stdin and exit plus the cancel eventfd until ffmpeg exits or the render is cancelled
+static int waitFfmpeg(pid_t pid, int progressFd, int inFd, FrameFeeder *feeder, RenderControl &control) {
+
+  int pidFd = syscall(SYS_pidfd_open, pid, 0);
+
+  std::string progress;
+  int childStatus = 0;
+  bool cancelled = false;
+
+  while (true) {
+
+    pollfd fds[4];
+    nfds_t count = 0;
+    int pidIndex = -1, progressIndex = -1, cancelIndex = -1, inIndex = -1;
+
+    if (pidFd >= 0) {
+      pidIndex = count;
+      fds[count++] = { pidFd, POLLIN, 0 };
+    }
+    if (progressFd >= 0) {
+      progressIndex = count;
+      fds[count++] = { progressFd, POLLIN, 0 };
+    }
+    if (control.eventFd() >= 0) {
+      cancelIndex = count;
+      fds[count++] = { control.eventFd(), POLLIN, 0 };
+    }
+    if (inFd >= 0) {
+      inIndex = count;
+      fds[count++] = { inFd, POLLOUT, 0 };
+    }
+
+    // without a pidfd the exit is only noticed by checking, progress lines still wake the loop twice a second
+    int ready = poll(fds, count, (pidFd >= 0) ? -1 : 100);
+    if (ready < 0 && errno != EINTR) {
+      std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    if (progressIndex >= 0 && fds[progressIndex].revents) {
+      char buffer[1024];
+      ssize_t length = read(progressFd, buffer, sizeof(buffer));
+      if (length > 0) {
+        progress.append(buffer, length);
+        parseProgress(progress, control);
+      } else if (length == 0 || errno != EINTR) {
+        close(progressFd);
+        progressFd = -1;
+      }
+    }
+
+    // end of input lets ffmpeg finish the file
+    if (inIndex >= 0 && fds[inIndex].revents && feeder->feed(inFd) != 0) {
+      close(inFd);
+      inFd = -1;
+    }
+
+    if (control.cancelled() || (cancelIndex >= 0 && fds[cancelIndex].revents)) {
+      cancelled = true;
+      break;
+    }
+
+    bool exited = (pidIndex >= 0) ? fds[pidIndex].revents != 0 : true;
+    if (exited && waitpid(pid, &childStatus, (pidFd >= 0) ? 0 : WNOHANG) == pid) {
+      break;
+    }
+  }
+
+  if (inFd >= 0) {
+    close(inFd);
+  }
+  if (progressFd >= 0) {
+    close(progressFd);
+  }
+
+  if (cancelled) {
+    kill(pid, SIGTERM);
+
+    if (!reapWithin(pid, pidFd, FFMPEG_TERM_TIMEOUT_MS, childStatus)) {
+      std::cout << "Force killing ffmpeg" << std::endl;
+      kill(pid, SIGKILL);
+      waitpid(pid, &childStatus, 0);
+    }
+  }
+
+  if (pidFd >= 0) {
+    close(pidFd);
+  }
+
+  if (cancelled) {
+    return -1;
+  }
+
+  if (WIFEXITED(childStatus)) {
+    int err = WEXITSTATUS(childStatus);
+    if (err) {
+      std::cerr << "ffmpeg exited with code " << err << std::endl;
+    }
+    return err;
+  }
+
+  if (WIFSIGNALED(childStatus)) {
+    std::cout << "ffmpeg killed by signal " << WTERMSIG(childStatus) << std::endl;
+  }
+
+  return -1;
+}
+
+
+int runFfmpeg(std::vector<std::string> args, const std::filesystem::path &framesDir,
+              const std::vector<FrameRecord> *pipeRecords, RenderControl &control) {
+
+  if (control.cancelled()) {
+    return -1;
+  }
+
+  // key=value progress lines on their own fd instead of the stats line on stderr
+  args.insert(args.begin() + 1, { "-nostats", "-progress", "pipe:" + std::to_string(PROGRESS_FD) });
+
+  std::vector<char *> argv;
+  for (std::string &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  int progressFds[2] = { -1, -1 };
+  if (pipe2(progressFds, O_CLOEXEC) < 0) {
+    std::cerr << "Unable to create ffmpeg progress pipe: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  int inFds[2] = { -1, -1 };
+  if (pipeRecords) {
+    if (pipe2(inFds, O_CLOEXEC) < 0) {
+      std::cerr << "Unable to create ffmpeg pipe: " << std::strerror(errno) << std::endl;
+      close(progressFds[0]);
+      close(progressFds[1]);
+      return -1;
+    }
+  }
+
+  // parsed before forking, the child may only make system calls
+  cpuBudget();
+
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    std::cerr << "Unable to fork process" << std::endl;
+    for (int fd : { progressFds[0], progressFds[1], inFds[0], inFds[1] }) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return -1;
+  }
+
+  // child process executes ffmpeg command, off the capture core and behind capture for CPU and IO
+  if (pid == 0) {
+    enterRenderBudget();
+    if (pipeRecords) {
+      dup2(inFds[0], STDIN_FILENO);
+    }
+
+    // dup2() onto itself would keep close-on-exec
+    if (progressFds[1] == PROGRESS_FD) {
+      fcntl(PROGRESS_FD, F_SETFD, 0);
+    } else {
+      dup2(progressFds[1], PROGRESS_FD);
+    }
+
+    execv("/usr/bin/ffmpeg", argv.data());
+
+    std::cerr << "Exec'ing ffmpeg command failed: " << std::strerror(errno) << std::endl;
+    _exit(1);
+  }
+
+  close(progressFds[1]);
+
+  std::unique_ptr<FrameFeeder> feeder;
+  if (pipeRecords) {
+    close(inFds[0]);
+    fcntl(inFds[1], F_SETFL, O_NONBLOCK);
+    feeder = std::make_unique<FrameFeeder>(framesDir, *pipeRecords);
+  }
+
+  runningRenders.fetch_add(1);
+  int err = waitFfmpeg(pid, progressFds[0], inFds[1], feeder.get(), control);
+  runningRenders.fetch_sub(1);
+
+  return err;
+}
+
+
+// writes an ffconcat list of the records' files next to them, each frame lasting one output frame
+static int writeConcatList(const std::vector<FrameRecord> &records, int fps, const std::filesystem::path &listPath) {
+
+  FILE *list = std::fopen(listPath.c_str(), "w");
+  if (!list) {
+    std::cerr << "Unable to create frame list: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  std::fprintf(list, "ffconcat version 1.0\n");
+
+  for (const FrameRecord &record : records) {
+    std::fprintf(list, "file '%s'\nduration %.6f\n", record.file, 1.0 / fps);
+  }
+
+  // the concat demuxer drops the duration of the last entry, so the last frame is listed again
+  std::fprintf(list, "file '%s'\n", records.back().file);
+
+  if (std::fclose(list) != 0) {
+    std::cerr << "Unable to write frame list: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// deflicker gains never brighten or darken a frame by more than this factor
+static constexpr float MAX_DEFLICKER_GAIN = 2.0f;
+
+
+std::vector<float> deflickerGains(const std::vector<FrameRecord> &records, int radius) {
+
+  size_t count = records.size();
+  std::vector<float> gains(count, 1.0f);
+
+  // running sums of log luma over the measured frames, so each window costs two lookups
+  std::vector<double> logSums(count + 1, 0.0);
+  std::vector<size_t> measured(count + 1, 0);
+
+  for (size_t i = 0; i < count; i++) {
+    bool hasLuma = records[i].luma > 0;
+    logSums[i + 1] = logSums[i] + (hasLuma ? std::log(static_cast<double>(records[i].luma)) : 0.0);
+    measured[i + 1] = measured[i] + (hasLuma ? 1 : 0);
+  }
+
+  size_t reach = static_cast<size_t>(std::max(radius, 0));
+
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].luma <= 0) {
+      continue;
+    }
+
+    size_t first = (i > reach) ? i - reach : 0;
+    size_t last = std::min(i + reach + 1, count);
+
+    double mean = (logSums[last] - logSums[first]) / static_cast<double>(measured[last] - measured[first]);
+    double gain = std::exp(mean - std::log(static_cast<double>(records[i].luma)));
+
+    gains[i] = std::clamp(static_cast<float>(gain), 1.0f / MAX_DEFLICKER_GAIN, MAX_DEFLICKER_GAIN);
+  }
+
+  return gains;
+}
+
+
+// writes the sendcmd script retuning the eq filter for each frame, a gain g is contrast g around mid grey plus brightness (g - 1) / 2
+// commands go half a frame before their frame, so rounding of the frame times never applies a gain one frame late
+static int writeGainScript(const std::vector<float> &gains, int fps, const std::filesystem::path &scriptPath) {
+
+  FILE *script = std::fopen(scriptPath.c_str(), "w");
+  if (!script) {
+    std::cerr << "Unable to create deflicker script: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  float applied = 0;
+
+  for (size_t i = 0; i < gains.size(); i++) {
+    if (i > 0 && std::fabs(gains[i] - applied) < 0.001f) {
+      continue;
+    }
+
+    double time = (i > 0) ? (static_cast<double>(i) - 0.5) / fps : 0.0;
+    std::fprintf(script, "%.6f eq@deflicker contrast %.4f, eq@deflicker brightness %.4f;\n", time, gains[i], (gains[i] - 1.0f) / 2.0f);
+    applied = gains[i];
+  }
+
+  if (std::fclose(script) != 0) {
+    std::cerr << "Unable to write deflicker script: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int renderRecords(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records, int fps,
+                  const std::vector<std::string> &codecArgs, const std::string &outputPath,
+                  const std::filesystem::path &listPath, RenderControl &control, const std::vector<float> *gains) {
+
+  if (records.empty()) {
+    return -1;
+  }
+
+  std::string fpsStr = std::to_string(fps);
+
+  bool pipeFrames = false;
+  for (const FrameRecord &record : records) {
+    if (std::string_view(record.file).ends_with(".seg")) {
+      pipeFrames = true;
+      break;
+    }
+  }
+
+  std::vector<std::string> args = { "ffmpeg", "-y" };
+
+  if (pipeFrames) {
+    args.insert(args.end(), { "-f", "image2pipe", "-framerate", fpsStr, "-c:v", "mjpeg", "-i", "pipe:0" });
+  } else {
+    if (writeConcatList(records, fps, listPath) < 0) {
+      return -1;
+    }
+    args.insert(args.end(), { "-f", "concat", "-i", listPath.string(), "-r", fpsStr });
+  }
+
+  std::vector<std::string> outputArgs = codecArgs;
+
+  // the gain filter goes in front of the profile's own filters (e.g. its scale), there is only one -vf
+  if (gains && gains->size() == records.size()) {
+    std::filesystem::path scriptPath = std::filesystem::path(listPath).replace_extension(".sendcmd");
+    if (writeGainScript(*gains, fps, scriptPath) < 0) {
+      return -1;
+    }
+
+    std::string filter = "sendcmd=f='" + scriptPath.string() + "',eq@deflicker";
+    auto vf = std::find(outputArgs.begin(), outputArgs.end(), "-vf");
+
+    if (vf != outputArgs.end() && vf + 1 != outputArgs.end()) {
+      *(vf + 1) = filter + "," + *(vf + 1);
+    } else {
+      outputArgs.insert(outputArgs.end(), { "-vf", filter });
+    }
+  }
+
+  args.insert(args.end(), outputArgs.begin(), outputArgs.end());
+  args.insert(args.end(), { "-pix_fmt", "yuv420p", outputPath });
+
+  return runFfmpeg(args, framesDir, pipeFrames ? &records : nullptr, control);
+}
+
+
+int concatVideos(const std::vector<std::filesystem::path> &videos, const std::string &outputPath,
+                 const std::filesystem::path &listPath, RenderControl &control) {
+
+  FILE *list = std::fopen(listPath.c_str(), "w");
+  if (!list) {
+    std::cerr << "Unable to create video list: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  std::fprintf(list, "ffconcat version 1.0\n");
+  for (const std::filesystem::path &video : videos) {
+    std::fprintf(list, "file '%s'\n", video.filename().c_str());
+  }
+
+  if (std::fclose(list) != 0) {
+    std::cerr << "Unable to write video list: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  std::vector<std::string> args = { "ffmpeg", "-y", "-f", "concat", "-i", listPath.string(), "-c", "copy", outputPath };
+
+  return runFfmpeg(args, listPath.parent_path(), nullptr, control);
+}
@@ -0,0 +1,122 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "manifest.h"
+#include "render_profile.h"
+
+/**
+ * What a timelapse render produces, see createTimelapseHandler().
+ */
+struct RenderOptions {
+  int fps = 0; // framerate of the video (0 evaluates to 60)
+  RenderProfile profile; // how the video is encoded
+  std::string filename; // output file in TIMELAPSE_PATH (empty evaluates to the time the render started)
+  std::filesystem::path framesDir; // frame directory to render (empty evaluates to FRAME_PATH)
+  FrameSelection selection; // frames of the manifest to render, the profile's stride multiplies selection.stride
+  int maxSeconds = 0; // longest video wanted, frames are thinned evenly to fit (0 for no limit)
+  int deflicker = 0; // frames on each side a frame's brightness is evened out against, from the luma in the manifest (0 for none)
+};
+
+/**
+ * Cancellation and progress of one render, shared between the thread running ffmpeg and whoever watches or stops it.
+ * Cancelling signals an eventfd, so a waiting render reacts immediately instead of on its next poll.
+ */
+class RenderControl {
+public:
+  RenderControl();
+  RenderControl(const RenderControl &) = delete;
+  RenderControl &operator=(const RenderControl &) = delete;
+  ~RenderControl();
+
+  /**
+   * Stops the render, safe to call from any thread and more than once.
+   */
+  void cancel();
+
+  /**
+   * Clears a cancel and the progress so the control can run another render.
+   */
+  void reset();
+
+  bool cancelled() const {
+    return cancelFlag.load();
+  }
+
+  // readable once cancel() was called
+  int eventFd() const {
+    return cancelFd;
+  }
+
+  std::atomic<uint64_t> framesBase{0}; // frames finished by earlier ffmpeg runs of the same render, added to framesDone
+  std::atomic<uint64_t> framesDone{0}; // frames written to the output so far
+  std::atomic<uint64_t> totalFrames{0}; // frames the render will write (0 if unknown)
+  std::atomic<double> encodeFps{0.0}; // encoding speed reported by ffmpeg
+
+private:
+  std::atomic<bool> cancelFlag{false};
+  int cancelFd = -1;
+};
+
+/**
+ * @return Number of ffmpeg processes started by runFfmpeg() that are still running, for attributing capture deadline misses
+ */
+int rendersRunning();
+
+/**
+ * Runs ffmpeg and waits for it on a pidfd, together with ffmpeg's -progress output, the frames piped to it and the cancel eventfd.
+ * A cancelled ffmpeg gets SIGTERM and, if it has not exited 2 seconds later, SIGKILL.
+ * ffmpeg runs under the render budget (see enterRenderBudget()).
+ * @param args ffmpeg arguments, args[0] is "ffmpeg"
+ * @param framesDir Directory the records' files are relative to (only used with pipeRecords)
+ * @param pipeRecords Frames streamed into ffmpeg's stdin (nullptr if ffmpeg reads its input itself), the process must ignore SIGPIPE
+ * @param control Cancels the run and receives its progress
+ * @return 0 on success, ffmpeg's exit code if it failed, -1 on any other error or when cancelled
+ */
+int runFfmpeg(std::vector<std::string> args, const std::filesystem::path &framesDir,
+              const std::vector<FrameRecord> *pipeRecords, RenderControl &control);
+
+/**
+ * Luma gains that even out brightness steps between frames, from the luma measured during capture (see FrameRecord::luma).
+ * Each frame is scaled to the mean luma, in the log domain, of the frames within radius of it, so slow changes like a sunset stay.
+ * @param records Frames in render order
+ * @param radius Frames on each side to average over
+ * @return One gain per record, 1 for frames without a measured luma
+ */
+std::vector<float> deflickerGains(const std::vector<FrameRecord> &records, int radius);
+
+/**
+ * Renders manifest records into a video, one record per output frame.
+ * Frames in segment files are piped in with image2pipe, frame files are read by ffmpeg from an ffconcat list.
+ * Gains are applied by an eq filter that a sendcmd script retunes per frame, in the same decode as the encode.
+ * @param framesDir Directory the records' files are relative to
+ * @param records Frames to render, in output order
+ * @param fps Output framerate
+ * @param codecArgs ffmpeg arguments selecting the video codec
+ * @param outputPath Video to write
+ * @param listPath Where the ffconcat list is written if one is needed, in framesDir since the list names files relative to itself
+ * @param control Cancels the render and receives its progress
+ * @param gains Luma gain per record (see deflickerGains()), nullptr for none, the script goes next to listPath
+ * @return 0 on success, non-zero on error (see runFfmpeg())
+ */
+int renderRecords(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records, int fps,
+                  const std::vector<std::string> &codecArgs, const std::string &outputPath,
+                  const std::filesystem::path &listPath, RenderControl &control, const std::vector<float> *gains = nullptr);
+
+/**
+ * Joins videos encoded with identical settings by stream copy, nothing is re-encoded.
+ * @param videos Videos to join in order, all in the directory of listPath
+ * @param outputPath Video to write
+ * @param listPath Where the ffconcat list is written
+ * @param control Cancels the copy and receives its progress
+ * @return 0 on success, non-zero on error (see runFfmpeg())
+ */
+int concatVideos(const std::vector<std::filesystem::path> &videos, const std::string &outputPath,
+                 const std::filesystem::path &listPath, RenderControl &control);
+
+#endif
@@ -0,0 +1,308 @@
+#include "render_jobs.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <iostream>
+
+#include "job_board.h"
+#include "metrics.h"
+
+// finished jobs kept for lookups, older ones are forgotten
+static constexpr size_t JOB_HISTORY = 32;
+
+
+static int64_t unixTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+static bool jobActive(JobState state) {
+  return state == JobState::Queued || state == JobState::Running;
+}
+
+
+void RenderJobs::start(RenderFunction render) {
+
+  stop();
+
+  this->render = std::move(render);
+  stopping = false;
+  thread = std::thread(&RenderJobs::run, this);
+}
+
+
+void RenderJobs::stop() {
+
+  if (!thread.joinable()) {
+    return;
+  }
+
+  cancelAll();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  jobCV.notify_all();
+
+  thread.join();
+}
+
+
+uint64_t RenderJobs::submit(const RenderOptions &request) {
+
+  uint64_t id = nextJobId();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Job &job = jobs[id];
+    job.status.id = id;
+    job.status.request = request;
+    job.status.queuedUnixMs = unixTimeMs();
+    job.control = std::make_unique<RenderControl>();
+  }
+
+  jobCV.notify_all();
+  notifyJobs();
+
+  return id;
+}
+
+
+bool RenderJobs::cancel(uint64_t id) {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = jobs.find(id);
+    if (it == jobs.end() || !jobActive(it->second.status.state)) {
+      return false;
+    }
+
+    Job &job = it->second;
+
+    // a running job is marked once its render returns
+    if (job.status.state == JobState::Queued) {
+      job.status.state = JobState::Cancelled;
+      job.status.finishedUnixMs = unixTimeMs();
+    }
+    job.control->cancel();
+  }
+
+  notifyJobs();
+
+  return true;
+}
+
+
+size_t RenderJobs::cancelAll() {
+
+  size_t cancelled = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto &[id, job] : jobs) {
+      if (!jobActive(job.status.state)) {
+        continue;
+      }
+
+      if (job.status.state == JobState::Queued) {
+        job.status.state = JobState::Cancelled;
+        job.status.finishedUnixMs = unixTimeMs();
+      }
+      job.control->cancel();
+      cancelled++;
+    }
+  }
+
+  if (cancelled > 0) {
+    notifyJobs();
+  }
+
+  return cancelled;
+}
+
+
+RenderJobStatus RenderJobs::snapshot(const Job &job) const {
+
+  RenderJobStatus status = job.status;
+  status.framesDone = job.control->framesDone.load();
+  status.totalFrames = job.control->totalFrames.load();
+  status.encodeFps = job.control->encodeFps.load();
+
+  return status;
+}
+
+
+bool RenderJobs::find(uint64_t id, RenderJobStatus &status) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = jobs.find(id);
+  if (it == jobs.end()) {
+    return false;
+  }
+
+  status = snapshot(it->second);
+  return true;
+}
+
+
+std::vector<RenderJobStatus> RenderJobs::list() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<RenderJobStatus> statuses;
+  statuses.reserve(jobs.size());
+
+  for (const auto &[id, job] : jobs) {
+    statuses.push_back(snapshot(job));
+  }
+
+  return statuses;
+}
+
+
+bool RenderJobs::busy() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    if (jobActive(job.status.state)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool RenderJobs::usesDirectory(const std::filesystem::path &dir) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto &[id, job] : jobs) {
+    std::error_code ec;
+    if (jobActive(job.status.state) && std::filesystem::equivalent(job.status.request.framesDir, dir, ec)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// forgets the oldest finished jobs beyond JOB_HISTORY, called with the mutex held
+void RenderJobs::trimHistory() {
+
+  size_t finished = 0;
+  for (const auto &[id, job] : jobs) {
+    finished += jobActive(job.status.state) ? 0 : 1;
+  }
+
+  for (auto it = jobs.begin(); it != jobs.end() && finished > JOB_HISTORY;) {
+    if (jobActive(it->second.status.state)) {
+      ++it;
+      continue;
+    }
+
+    it = jobs.erase(it);
+    finished--;
+  }
+}
+
+
+void RenderJobs::run() {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+
+    // jobs run in submission order
+    Job *next = nullptr;
+    for (auto &[id, job] : jobs) {
+      if (job.status.state == JobState::Queued) {
+        next = &job;
+        break;
+      }
+    }
+
+    if (!next) {
+      if (stopping) {
+        break;
+      }
+      jobCV.wait(lock);
+      continue;
+    }
+
+    next->status.state = JobState::Running;
+    next->status.startedUnixMs = unixTimeMs();
+
+    // map nodes stay put, and only this thread erases jobs
+    uint64_t id = next->status.id;
+    RenderOptions request = next->status.request;
+    RenderControl &control = *next->control;
+
+    lock.unlock();
+    notifyJobs();
+
+    std::cout << "Render job " << id << " started" << std::endl;
+    int result = render(request, control);
+
+    lock.lock();
+
+    Job &job = jobs[id];
+    job.status.result = result;
+    job.status.finishedUnixMs = unixTimeMs();
+    job.status.state = control.cancelled() ? JobState::Cancelled : (result == 0) ? JobState::Finished : JobState::Failed;
+
+    std::cout << "Render job " << id << " " << jobStateName(job.status.state) << " with code " << result << std::endl;
+
+    countMetric(Metric::RendersFinished);
+    if (job.status.state == JobState::Failed) {
+      countMetric(Metric::RendersFailed);
+    }
+
+    trimHistory();
+
+    lock.unlock();
+    notifyJobs();
+    lock.lock();
+  }
+}
+
+
+const char *jobStateName(JobState state) {
+  switch (state) {
+    case JobState::Queued: return "queued";
+    case JobState::Running: return "running";
+    case JobState::Finished: return "finished";
+    case JobState::Failed: return "failed";
+    case JobState::Cancelled: return "cancelled";
+  }
+
+  return "unknown";
+}
+
+
+std::string formatJobStatus(const RenderJobStatus &status) {
+
+  // the encoder's own speed is steadier than the average since start, which includes ffmpeg starting up
+  int64_t etaMs = -1;
+  if (status.state == JobState::Running) {
+    etaMs = (status.encodeFps > 0.0 && status.totalFrames > status.framesDone)
+          ? static_cast<int64_t>(static_cast<double>(status.totalFrames - status.framesDone) * 1000.0 / status.encodeFps)
+          : estimateRemainingMs(status.framesDone, status.totalFrames, status.startedUnixMs, unixTimeMs());
+  }
+
+  char line[512];
+  std::snprintf(line, sizeof(line), "id=%" PRIu64 " state=%s frames=%" PRIu64 "/%" PRIu64 " fps=%.1f eta_ms=%" PRId64 " result=%d queued_ms=%" PRId64
+                " started_ms=%" PRId64 " finished_ms=%" PRId64 " profile=%s dir=%s\n",
+                status.id, jobStateName(status.state), status.framesDone, status.totalFrames, status.encodeFps, etaMs, status.result,
+                status.queuedUnixMs, status.startedUnixMs, status.finishedUnixMs, status.request.profile.name.c_str(), status.request.framesDir.c_str());
+
+  return line;
+}
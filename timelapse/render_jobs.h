@@ -0,0 +1,144 @@
+#ifndef RENDER_JOBS_H
+#define RENDER_JOBS_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "render.h"
+
+enum class JobState : int {
+  Queued = 0,
+  Running = 1,
+  Finished = 2, // render returned 0
+  Failed = 3,
+  Cancelled = 4
+};
+
+/**
+ * Snapshot of a render job.
+ */
+struct RenderJobStatus {
+  uint64_t id = 0;
+  JobState state = JobState::Queued;
+  RenderOptions request;
+  int result = 0; // return value of the render once it ended
+  uint64_t framesDone = 0;
+  uint64_t totalFrames = 0; // 0 if unknown
+  double encodeFps = 0.0;
+  int64_t queuedUnixMs = 0;
+  int64_t startedUnixMs = 0;
+  int64_t finishedUnixMs = 0;
+};
+
+// runs one render, returning 0 on success
+using RenderFunction = std::function<int(const RenderOptions &request, RenderControl &control)>;
+
+/**
+ * Queue of render jobs run one at a time on a worker thread, each with an ID to check on or cancel it by.
+ * IDs come from nextJobId() and every state change is announced with notifyJobs() (see job_board.h).
+ * The last few finished jobs are kept so their result can still be looked up.
+ */
+class RenderJobs {
+public:
+  RenderJobs() = default;
+  RenderJobs(const RenderJobs &) = delete;
+  RenderJobs &operator=(const RenderJobs &) = delete;
+
+  ~RenderJobs() {
+    stop();
+  }
+
+  /**
+   * Starts the worker thread.
+   * @param render Runs a job's render (e.g. through createTimelapseHandler())
+   */
+  void start(RenderFunction render);
+
+  /**
+   * Cancels every job and waits for the running one to stop. Safe to call more than once.
+   */
+  void stop();
+
+  /**
+   * Queues a render.
+   * @param request Render to run
+   * @return ID of the new job
+   */
+  uint64_t submit(const RenderOptions &request);
+
+  /**
+   * Cancels a job, a queued job never starts and a running one has its ffmpeg stopped.
+   * @param id Job to cancel
+   * @return true if the job was queued or running
+   */
+  bool cancel(uint64_t id);
+
+  /**
+   * Cancels every queued and running job.
+   * @return Number of jobs cancelled
+   */
+  size_t cancelAll();
+
+  /**
+   * @param id Job to look up
+   * @param status Filled with the job's status
+   * @return true if the job is known
+   */
+  bool find(uint64_t id, RenderJobStatus &status);
+
+  /**
+   * @return Status of every known job, oldest first
+   */
+  std::vector<RenderJobStatus> list();
+
+  /**
+   * @return true while any job is queued or running
+   */
+  bool busy();
+
+  /**
+   * @param dir Frame directory
+   * @return true while a queued or running job reads from dir
+   */
+  bool usesDirectory(const std::filesystem::path &dir);
+
+private:
+  struct Job {
+    RenderJobStatus status;
+    std::unique_ptr<RenderControl> control;
+  };
+
+  void run();
+  RenderJobStatus snapshot(const Job &job) const;
+  void trimHistory();
+
+  RenderFunction render;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable jobCV;
+  bool stopping = false;
+
+  std::map<uint64_t, Job> jobs;
+};
+
+/**
+ * @return Lowercase name of the state
+ */
+const char *jobStateName(JobState state);
+
+/**
+ * Formats a job as one line of key=value pairs.
+ * @param status Job to format
+ * @return The line, ending in a newline
+ */
+std::string formatJobStatus(const RenderJobStatus &status);
+
+#endif
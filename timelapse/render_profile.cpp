@@ -0,0 +1,109 @@
+#include "render_profile.h"
+
+#include <cstdio>
+
+
+static std::vector<RenderProfile> builtinProfiles() {
+
+  std::vector<RenderProfile> profiles;
+
+  RenderProfile profile;
+  profiles.push_back(profile);
+
+  profile = RenderProfile();
+  profile.name = "quality";
+  profile.preset = "medium";
+  profile.crf = 20;
+  profile.tune = "stillimage";
+  profiles.push_back(profile);
+
+  profile = RenderProfile();
+  profile.name = "fast";
+  profile.preset = "veryfast";
+  profiles.push_back(profile);
+
+  profile = RenderProfile();
+  profile.name = "x265";
+  profile.codec = VideoCodec::X265;
+  profile.preset = "medium";
+  profile.crf = 26;
+  profiles.push_back(profile);
+
+  profile = RenderProfile();
+  profile.name = "hw";
+  profile.codec = VideoCodec::V4l2H264;
+  profiles.push_back(profile);
+
+  // small enough to render a day of frames in well under a minute on a Pi
+  profile = RenderProfile();
+  profile.name = "draft";
+  profile.preset = "ultrafast";
+  profile.crf = 30;
+  profile.width = 640;
+  profile.frameStride = 10;
+  profiles.push_back(profile);
+
+  return profiles;
+}
+
+
+bool findRenderProfile(const std::string &name, RenderProfile &profile) {
+
+  for (const RenderProfile &builtin : builtinProfiles()) {
+    if (builtin.name == name) {
+      profile = builtin;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+std::vector<std::string> renderProfileNames() {
+
+  std::vector<std::string> names;
+  for (const RenderProfile &profile : builtinProfiles()) {
+    names.push_back(profile.name);
+  }
+
+  return names;
+}
+
+
+bool parseVideoCodec(const std::string &name, VideoCodec &codec) {
+
+  if (name == "x264") {
+    codec = VideoCodec::X264;
+  } else if (name == "x265") {
+    codec = VideoCodec::X265;
+  } else if (name == "hw") {
+    codec = VideoCodec::V4l2H264;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+
+const char *videoCodecName(VideoCodec codec) {
+  switch (codec) {
+    case VideoCodec::X264: return "x264";
+    case VideoCodec::X265: return "x265";
+    case VideoCodec::V4l2H264: return "hw";
+  }
+
+  return "unknown";
+}
+
+
+std::string formatRenderProfile(const RenderProfile &profile) {
+
+  char line[256];
+  std::snprintf(line, sizeof(line), "name=%s codec=%s preset=%s crf=%d tune=%s threads=%d width=%d stride=%d\n",
+                profile.name.c_str(), videoCodecName(profile.codec), profile.preset.c_str(), profile.crf,
+                profile.tune.empty() ? "none" : profile.tune.c_str(), profile.threads, profile.width, profile.frameStride);
+
+  return line;
+}
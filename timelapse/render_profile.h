@@ -0,0 +1,67 @@
+#ifndef RENDER_PROFILE_H
+#define RENDER_PROFILE_H
+
+#include <string>
+#include <vector>
+
+// video encoders a render can use
+enum class VideoCodec : int {
+  X264 = 0, // libx264
+  X265 = 1, // libx265, smaller files for the same quality at several times the encode cost
+  V4l2H264 = 2 // h264_v4l2m2m hardware encoder, rate controlled by bitrate (preset, crf and tune are ignored)
+};
+
+/**
+ * How a timelapse is encoded. Built in profiles are looked up by name (see findRenderProfile()) and can be adjusted field by field.
+ */
+struct RenderProfile {
+  std::string name = "default";
+  VideoCodec codec = VideoCodec::X264;
+  std::string preset = "faster"; // x264/x265 speed preset
+  int crf = 23; // x264/x265 quality, lower is better
+  std::string tune; // x264/x265 tune (e.g. stillimage), empty for none
+  int threads = 0; // encoder threads (0 lets ffmpeg pick)
+  int width = 0; // output width, the height keeps the aspect ratio (0 keeps the frame size)
+  std::string bitrate; // hardware encoder bitrate (empty uses HW_BITRATE)
+  int frameStride = 1; // render every Nth frame, for previews
+};
+
+/**
+ * Looks up a built in profile:
+ *   default  x264 faster crf 23, the settings renders always used
+ *   quality  x264 medium crf 20 tuned for still images
+ *   fast     x264 veryfast crf 23
+ *   x265     x265 medium crf 26
+ *   hw       h264_v4l2m2m hardware encoder
+ *   draft    x264 ultrafast crf 30 at 640 pixels wide from every 10th frame, for quick sanity checks
+ * @param name Profile name
+ * @param profile Set to the profile if it exists
+ * @return true if the profile exists
+ */
+bool findRenderProfile(const std::string &name, RenderProfile &profile);
+
+/**
+ * @return Names of the built in profiles
+ */
+std::vector<std::string> renderProfileNames();
+
+/**
+ * @param name Codec name (x264, x265 or hw)
+ * @param codec Set to the codec if the name is known
+ * @return true if the name is known
+ */
+bool parseVideoCodec(const std::string &name, VideoCodec &codec);
+
+/**
+ * @return Name of the codec as accepted by parseVideoCodec()
+ */
+const char *videoCodecName(VideoCodec codec);
+
+/**
+ * Formats a profile as one line of key=value pairs.
+ * @param profile Profile to format
+ * @return The line, ending in a newline
+ */
+std::string formatRenderProfile(const RenderProfile &profile);
+
+#endif
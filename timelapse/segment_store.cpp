@@ -0,0 +1,204 @@
+#include "segment_store.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SEGMENT_MAGIC[8] = { 'T', 'L', 'S', 'E', 'G', '0', '0', '1' };
+
+struct SegmentTrailer {
+  char magic[8];
+  uint64_t count;
+  uint64_t entriesOffset;
+};
+
+
+static int writeAll(int fd, const void *data, size_t size) {
+
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+
+    bytes += written;
+    size -= written;
+  }
+
+  return 0;
+}
+
+
+int SegmentWriter::open(int dirFd, const char *name, size_t capacity) {
+
+  close();
+
+  fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Unable to create segment " << name << ": " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  length = 0;
+  entries.clear();
+  entries.reserve(capacity);
+
+  return 0;
+}
+
+
+int SegmentWriter::append(const uint8_t *data, size_t size, uint64_t index, uint64_t sensorNs, uint64_t &offset) {
+
+  if (fd < 0) {
+    return -EBADF;
+  }
+
+  int err = writeAll(fd, data, size);
+  if (err) {
+    std::cerr << "Error writing segment: " << std::strerror(-err) << std::endl;
+
+    // drop the partial frame so the next one starts where the index expects it
+    if (ftruncate(fd, length) < 0 || lseek(fd, length, SEEK_SET) < 0) {
+      std::cerr << "Unable to roll back segment: " << std::strerror(errno) << std::endl;
+    }
+    return err;
+  }
+
+  offset = length;
+  entries.push_back(SegmentEntry{index, sensorNs, length, size});
+  length += size;
+
+  return 0;
+}
+
+
+int SegmentWriter::close() {
+
+  if (fd < 0) {
+    return 0;
+  }
+
+  SegmentTrailer trailer;
+  std::memcpy(trailer.magic, SEGMENT_MAGIC, sizeof(trailer.magic));
+  trailer.count = entries.size();
+  trailer.entriesOffset = length;
+
+  int err = writeAll(fd, entries.data(), entries.size() * sizeof(SegmentEntry));
+  if (!err) {
+    err = writeAll(fd, &trailer, sizeof(trailer));
+  }
+
+  if (err) {
+    std::cerr << "Error writing segment index: " << std::strerror(-err) << std::endl;
+  }
+
+  ::close(fd);
+  fd = -1;
+  entries.clear();
+
+  return err;
+}
+
+
+int MappedFile::open(const std::filesystem::path &path) {
+
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    return -err;
+  }
+
+  if (st.st_size == 0) {
+    ::close(fd);
+    return -ENODATA;
+  }
+
+  void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  ::close(fd);
+
+  if (mem == MAP_FAILED) {
+    return -err;
+  }
+
+  // frames are read front to back
+  madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+  base = static_cast<const uint8_t *>(mem);
+  length = st.st_size;
+
+  return 0;
+}
+
+
+void MappedFile::close() {
+
+  if (base) {
+    munmap(const_cast<uint8_t *>(base), length);
+  }
+
+  base = nullptr;
+  length = 0;
+}
+
+
+int SegmentReader::open(const std::filesystem::path &path) {
+
+  close();
+
+  int err = file.open(path);
+  if (err) {
+    return err;
+  }
+
+  SegmentTrailer trailer;
+  if (file.size() < sizeof(trailer)) {
+    close();
+    return -EINVAL;
+  }
+
+  std::memcpy(&trailer, file.data() + file.size() - sizeof(trailer), sizeof(trailer));
+
+  uint64_t entriesEnd = trailer.entriesOffset + trailer.count * sizeof(SegmentEntry);
+
+  if (std::memcmp(trailer.magic, SEGMENT_MAGIC, sizeof(trailer.magic)) != 0 || entriesEnd != file.size() - sizeof(trailer)) {
+    close();
+    return -EINVAL;
+  }
+
+  index.resize(trailer.count);
+  std::memcpy(index.data(), file.data() + trailer.entriesOffset, trailer.count * sizeof(SegmentEntry));
+
+  for (const SegmentEntry &entry : index) {
+    if (entry.offset + entry.size > trailer.entriesOffset) {
+      close();
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+
+void SegmentReader::close() {
+  file.close();
+  index.clear();
+}
@@ -0,0 +1,147 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// how the frame writer lays out frames in the frame directory
+enum class FrameStore : int {
+  Files = 0, // one JPEG file per frame
+  Segments = 1 // frames appended to a few large segment files, see SegmentWriter
+};
+
+/**
+ * Index entry of one frame inside a segment.
+ */
+struct SegmentEntry {
+  uint64_t index = 0; // position among the session's saved frames
+  uint64_t sensorNs = 0; // sensor timestamp
+  uint64_t offset = 0; // byte offset of the frame inside the segment
+  uint64_t size = 0; // bytes of the frame
+};
+
+/**
+ * Append-only segment file: compressed frames back to back, followed by an index footer once the segment is closed.
+ *
+ * Layout: frame data | count * SegmentEntry | trailer { "TLSEG001", count, entries offset }
+ *
+ * A segment that was never closed (e.g. power cut) has no footer, its frames are still listed in the manifest.
+ */
+class SegmentWriter {
+public:
+  SegmentWriter() = default;
+  SegmentWriter(const SegmentWriter &) = delete;
+  SegmentWriter &operator=(const SegmentWriter &) = delete;
+
+  ~SegmentWriter() {
+    close();
+  }
+
+  /**
+   * Creates (or truncates) a segment.
+   * @param dirFd Directory the segment is created in
+   * @param name File name of the segment
+   * @param capacity Frames the index is preallocated for
+   * @return 0 on success, non-zero on error
+   */
+  int open(int dirFd, const char *name, size_t capacity);
+
+  /**
+   * Appends one frame.
+   * @param data Compressed frame
+   * @param size Bytes of data
+   * @param index Index of the frame among the session's saved frames
+   * @param sensorNs Sensor timestamp of the frame
+   * @param offset Set to the byte offset the frame was written at
+   * @return 0 on success, non-zero on error
+   */
+  int append(const uint8_t *data, size_t size, uint64_t index, uint64_t sensorNs, uint64_t &offset);
+
+  /**
+   * Writes the index footer and closes the segment. Safe to call more than once.
+   * @return 0 on success, non-zero on error
+   */
+  int close();
+
+  bool isOpen() const {
+    return fd >= 0;
+  }
+
+  size_t frames() const {
+    return entries.size();
+  }
+
+private:
+  int fd = -1;
+  uint64_t length = 0;
+  std::vector<SegmentEntry> entries;
+};
+
+/**
+ * Read-only mapping of a whole file.
+ */
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    close();
+  }
+
+  /**
+   * @param path File to map
+   * @return 0 on success, non-zero on error
+   */
+  int open(const std::filesystem::path &path);
+
+  void close();
+
+  const uint8_t *data() const {
+    return base;
+  }
+
+  size_t size() const {
+    return length;
+  }
+
+private:
+  const uint8_t *base = nullptr;
+  size_t length = 0;
+};
+
+/**
+ * Reads a closed segment through a mapping, frames are handed out as pointers into it without copying.
+ */
+class SegmentReader {
+public:
+  /**
+   * Maps a segment and parses its footer.
+   * @param path Segment to read
+   * @return 0 on success, non-zero if the segment cannot be mapped or has no valid footer
+   */
+  int open(const std::filesystem::path &path);
+
+  void close();
+
+  const std::vector<SegmentEntry> &entries() const {
+    return index;
+  }
+
+  /**
+   * @param entry Entry from entries()
+   * @return Pointer to the frame's bytes inside the mapping, valid until close()
+   */
+  const uint8_t *frame(const SegmentEntry &entry) const {
+    return file.data() + entry.offset;
+  }
+
+private:
+  MappedFile file;
+  std::vector<SegmentEntry> index;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "session_state.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+int saveSessionState(const std::filesystem::path &path, const SessionState &state) {
+
+  char text[512];
+  int length = std::snprintf(text, sizeof(text),
+                             "version=1\n"
+                             "cap_interval_ms=%d\n"
+                             "target_slots=%" PRIu64 "\n"
+                             "next_slot=%" PRIu64 "\n"
+                             "next_index=%" PRIu64 "\n"
+                             "frame_store=%s\n"
+                             "segment_frames=%d\n"
+                             "next_segment=%d\n"
+                             "started_unix_ms=%" PRId64 "\n"
+                             "updated_unix_ms=%" PRId64 "\n"
+                             "complete=%d\n",
+                             state.capIntervalMs, state.targetSlots, state.nextSlot, state.nextIndex,
+                             (state.frameStore == FrameStore::Segments) ? "segments" : "files",
+                             state.segmentFrames, state.nextSegment, state.startedUnixMs, state.updatedUnixMs,
+                             state.complete ? 1 : 0);
+
+  std::filesystem::path tmpPath = path;
+  tmpPath += ".tmp";
+
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Unable to save session state: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  // the state is a few hundred bytes, a short write means the disk is in trouble
+  ssize_t written = write(fd, text, length);
+  int err = (written == length) ? fsync(fd) : -1;
+  close(fd);
+
+  if (err < 0 || rename(tmpPath.c_str(), path.c_str()) < 0) {
+    std::cerr << "Unable to save session state: " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int loadSessionState(const std::filesystem::path &path, SessionState &state) {
+
+  FILE *file = std::fopen(path.c_str(), "r");
+  if (!file) {
+    return -1;
+  }
+
+  state = SessionState();
+
+  int version = 0;
+  char line[128];
+
+  while (std::fgets(line, sizeof(line), file)) {
+    char *separator = std::strchr(line, '=');
+    if (!separator) {
+      continue;
+    }
+    *separator = '\0';
+
+    std::string key = line;
+    const char *value = separator + 1;
+
+    if (key == "version") version = std::atoi(value);
+    else if (key == "cap_interval_ms") state.capIntervalMs = std::atoi(value);
+    else if (key == "target_slots") state.targetSlots = std::strtoull(value, nullptr, 10);
+    else if (key == "next_slot") state.nextSlot = std::strtoull(value, nullptr, 10);
+    else if (key == "next_index") state.nextIndex = std::strtoull(value, nullptr, 10);
+    else if (key == "frame_store") state.frameStore = (std::strncmp(value, "segments", 8) == 0) ? FrameStore::Segments : FrameStore::Files;
+    else if (key == "segment_frames") state.segmentFrames = std::atoi(value);
+    else if (key == "next_segment") state.nextSegment = std::atoi(value);
+    else if (key == "started_unix_ms") state.startedUnixMs = std::strtoll(value, nullptr, 10);
+    else if (key == "updated_unix_ms") state.updatedUnixMs = std::strtoll(value, nullptr, 10);
+    else if (key == "complete") state.complete = std::atoi(value) != 0;
+  }
+
+  std::fclose(file);
+
+  if (version != 1 || state.capIntervalMs <= 0 || state.targetSlots == 0) {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef SESSION_STATE_H
+#define SESSION_STATE_H
+
+#include <cstdint>
+#include <filesystem>
+
+#include "segment_store.h"
+
+// name of the session state file inside the frame directory
+inline constexpr const char *SESSION_FILE = "session.state";
+
+/**
+ * Progress of a recording session, saved periodically so a session cut short (power loss, SIGHUP) can be resumed.
+ */
+struct SessionState {
+  int capIntervalMs = 0; // interval between capture slots
+  uint64_t targetSlots = 0; // capture slots in the whole session
+  uint64_t nextSlot = 0; // first slot not captured yet
+  uint64_t nextIndex = 0; // index the next saved frame gets
+  FrameStore frameStore = FrameStore::Files;
+  int segmentFrames = 0; // frames per segment with FrameStore::Segments
+  int nextSegment = 0; // number the next segment file gets
+  int64_t startedUnixMs = 0; // when the session was first started
+  int64_t updatedUnixMs = 0; // when this state was saved
+  bool complete = false; // every slot was captured, nothing left to resume
+};
+
+/**
+ * Writes the state to a temporary file, syncs it and renames it over the old state, so a crash leaves either the old or the new state.
+ * @param path State file to replace
+ * @param state State to save
+ * @return 0 on success, non-zero on error
+ */
+int saveSessionState(const std::filesystem::path &path, const SessionState &state);
+
+/**
+ * Reads a state written by saveSessionState().
+ * @param path State file to read
+ * @param state Filled from the file
+ * @return 0 on success, non-zero if the file is missing or incomplete
+ */
+int loadSessionState(const std::filesystem::path &path, SessionState &state);
+
+#endif
@@ -0,0 +1,158 @@
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+
+static LatencyHistogram histograms[static_cast<int>(Stage::Count)];
+
+
+// values below SUB_BUCKETS get a bucket each, above that each power of two is split into SUB_BUCKETS linear buckets
+int LatencyHistogram::bucketIndex(uint64_t ns) {
+
+  if (ns < SUB_BUCKETS) {
+    return static_cast<int>(ns);
+  }
+
+  int exponent = 63 - std::countl_zero(ns);
+  int sub = static_cast<int>((ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+
+uint64_t LatencyHistogram::bucketUpperBound(int index) {
+
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t sub = index % SUB_BUCKETS;
+  uint64_t lower = (SUB_BUCKETS + sub) << shift;
+
+  return lower + ((uint64_t{1} << shift) - 1);
+}
+
+
+void LatencyHistogram::record(uint64_t ns) {
+
+  buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t current = max.load(std::memory_order_relaxed);
+  while (ns > current && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+  }
+}
+
+
+StageSummary LatencyHistogram::summary() const {
+
+  StageSummary result;
+
+  // snapshot the buckets first so the percentile ranks match the counts they are searched in
+  uint64_t snapshot[BUCKETS];
+  uint64_t total = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+    total += snapshot[i];
+  }
+
+  if (total == 0) {
+    return result;
+  }
+
+  result.count = total;
+  result.maxNs = max.load(std::memory_order_relaxed);
+  result.meanNs = sum.load(std::memory_order_relaxed) / std::max<uint64_t>(count.load(std::memory_order_relaxed), 1);
+
+  // rank of a percentile is the sample that at least that fraction of samples are at or below
+  uint64_t p50Rank = (total * 50 + 99) / 100;
+  uint64_t p99Rank = (total * 99 + 99) / 100;
+
+  uint64_t seen = 0;
+  bool p50Found = false;
+
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += snapshot[i];
+
+    if (!p50Found && seen >= p50Rank) {
+      result.p50Ns = std::min(bucketUpperBound(i), result.maxNs);
+      p50Found = true;
+    }
+
+    if (seen >= p99Rank) {
+      result.p99Ns = std::min(bucketUpperBound(i), result.maxNs);
+      break;
+    }
+  }
+
+  return result;
+}
+
+
+void LatencyHistogram::reset() {
+
+  for (std::atomic<uint64_t> &bucket : buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count.store(0, std::memory_order_relaxed);
+  sum.store(0, std::memory_order_relaxed);
+  max.store(0, std::memory_order_relaxed);
+}
+
+
+LatencyHistogram &stageHistogram(Stage stage) {
+  return histograms[static_cast<int>(stage)];
+}
+
+
+const char *stageName(Stage stage) {
+  switch (stage) {
+    case Stage::Queue: return "queue";
+    case Stage::Convert: return "convert";
+    case Stage::Encode: return "encode";
+    case Stage::Write: return "write";
+    case Stage::Live: return "live";
+    case Stage::Count: break;
+  }
+
+  return "unknown";
+}
+
+
+void resetStageStats() {
+  for (LatencyHistogram &histogram : histograms) {
+    histogram.reset();
+  }
+}
+
+
+std::string summaryLine(const char *name, const StageSummary &summary) {
+
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-10s n=%-8llu mean=%8.3fms p50=%8.3fms p99=%8.3fms max=%8.3fms\n",
+                name, static_cast<unsigned long long>(summary.count),
+                summary.meanNs / 1e6, summary.p50Ns / 1e6, summary.p99Ns / 1e6, summary.maxNs / 1e6);
+
+  return line;
+}
+
+
+std::string stageReport() {
+
+  std::string report;
+
+  for (int i = 0; i < static_cast<int>(Stage::Count); i++) {
+    StageSummary summary = histograms[i].summary();
+    if (summary.count == 0) {
+      continue;
+    }
+
+    report += summaryLine(stageName(static_cast<Stage>(i)), summary);
+  }
+
+  return report;
+}
@@ -0,0 +1,123 @@
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// pipeline stages a frame passes through, each has its own latency histogram
+enum class Stage : int {
+  Queue = 0, // frame completed by the camera until an encoder thread picks it up
+  Convert = 1, // YUV420 to YUV444 conversion on the scanline encode path
+  Encode = 2, // JPEG compression (hardware or libjpeg)
+  Write = 3, // writing a compressed frame to storage on the writer thread
+  Live = 4, // piping a raw frame into the live encoder
+  Count = 5
+};
+
+/**
+ * Latency summary of one stage, percentiles are accurate to within 1/8 of the value.
+ */
+struct StageSummary {
+  uint64_t count = 0;
+  uint64_t meanNs = 0;
+  uint64_t p50Ns = 0;
+  uint64_t p99Ns = 0;
+  uint64_t maxNs = 0;
+};
+
+/**
+ * Lock free latency histogram with log-linear buckets (8 per power of two).
+ * Recording is a couple of relaxed atomic adds, so it can be called for every frame from any thread.
+ */
+class LatencyHistogram {
+public:
+  /**
+   * Adds one sample.
+   * @param ns Latency in nanoseconds
+   */
+  void record(uint64_t ns);
+
+  /**
+   * Computes count, mean, p50, p99 and max of the samples recorded so far.
+   * Samples recorded while this runs may or may not be included.
+   */
+  StageSummary summary() const;
+
+  void reset();
+
+private:
+  static constexpr int SUB_BUCKET_BITS = 3;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static int bucketIndex(uint64_t ns);
+  static uint64_t bucketUpperBound(int index);
+
+  std::atomic<uint64_t> buckets[BUCKETS] = {};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+};
+
+/**
+ * Monotonic clock used for stage timings.
+ * @return Current time in nanoseconds
+ */
+inline uint64_t stageClockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Process wide histogram of a stage.
+ * @param stage Stage to look up
+ * @return Histogram shared by every thread recording the stage
+ */
+LatencyHistogram &stageHistogram(Stage stage);
+
+/**
+ * Short lowercase name of a stage, used in reports.
+ */
+const char *stageName(Stage stage);
+
+/**
+ * Clears every stage histogram, called when a recording session starts.
+ */
+void resetStageStats();
+
+/**
+ * Formats a summary as one report line of count, mean, p50, p99 and max in milliseconds.
+ * @param name Label at the start of the line
+ * @param summary Summary to format
+ * @return Line including the trailing newline
+ */
+std::string summaryLine(const char *name, const StageSummary &summary);
+
+/**
+ * Formats every stage that has samples as one line of count, mean, p50, p99 and max in milliseconds.
+ * @return Report text, empty if no stage has samples
+ */
+std::string stageReport();
+
+/**
+ * Records the time between construction and destruction into a stage histogram.
+ */
+class StageTimer {
+public:
+  explicit StageTimer(Stage stage) : stage(stage), startNs(stageClockNs()) {}
+
+  ~StageTimer() {
+    stageHistogram(stage).record(stageClockNs() - startNs);
+  }
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+  Stage stage;
+  uint64_t startNs;
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include "thumbnails.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <jpeglib.h>
+
+#include "manifest.h"
+#include "segment_store.h"
+
+// sheets kept in the cache, the least recently used one goes first
+static constexpr size_t SHEET_CACHE_SIZE = 8;
+
+// YCbCr black, the background of tiles a smaller or corrupt frame leaves empty
+static constexpr uint8_t BLACK[3] = { 0, 128, 128 };
+
+
+// libjpeg error handler that jumps back out of a failed decode or encode instead of exiting
+struct JpegError {
+  struct jpeg_error_mgr pub;
+  std::jmp_buf jump;
+};
+
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+  std::longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+}
+
+
+// torn frames after a power cut are expected, they are skipped without a warning per frame
+static void decodeOutputMessage(j_common_ptr) {}
+
+
+// decodes a frame at 1/scaleDenom of its size into packed YCbCr rows, false if the frame is corrupt
+// only plain data lives in here, nothing that the jump out of a failed decode would need to destroy
+static bool decodeScaled(jpeg_decompress_struct &cinfo, JpegError &error, const uint8_t *data, size_t size, int scaleDenom,
+                         std::vector<uint8_t> &pixels, int &width, int &height) {
+
+  if (setjmp(error.jump)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), static_cast<unsigned long>(size));
+  jpeg_read_header(&cinfo, TRUE);
+
+  // the IDCT runs on 1/8 of the coefficients at 1/8 scale, and the stored YCbCr is used as it is
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scaleDenom;
+  cinfo.out_color_space = JCS_YCbCr;
+  cinfo.dct_method = JDCT_IFAST;
+  cinfo.do_fancy_upsampling = FALSE;
+
+  jpeg_start_decompress(&cinfo);
+
+  width = static_cast<int>(cinfo.output_width);
+  height = static_cast<int>(cinfo.output_height);
+
+  size_t rowBytes = static_cast<size_t>(width) * 3;
+  if (pixels.size() < rowBytes * height) {
+    pixels.resize(rowBytes * height);
+  }
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = pixels.data() + cinfo.output_scanline * rowBytes;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+
+  return true;
+}
+
+
+// compresses packed YCbCr rows, no colour conversion on either side, -EIO if libjpeg fails
+static int compressSheet(const std::vector<uint8_t> &pixels, int width, int height, int quality, std::vector<uint8_t> &out) {
+
+  jpeg_compress_struct cinfo;
+  JpegError error;
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = jpegErrorExit;
+  jpeg_create_compress(&cinfo);
+
+  // libjpeg writes the buffer pointer through its address, so it is in memory and still valid after the jump
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    std::free(buffer);
+    return -EIO;
+  }
+
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  size_t rowBytes = static_cast<size_t>(width) * 3;
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(pixels.data() + cinfo.next_scanline * rowBytes);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+
+  out.assign(buffer, buffer + size);
+
+  jpeg_destroy_compress(&cinfo);
+  std::free(buffer);
+
+  return 0;
+}
+
+
+// frames of a session in index order, from the manifest or, for sessions recorded without one, from the frame files
+static int sessionFrames(const std::filesystem::path &framesDir, std::vector<FrameRecord> &records) {
+
+  if (readManifest(framesDir / MANIFEST_FILE, records) == 0) {
+    return 0;
+  }
+
+  std::error_code ec;
+  std::filesystem::directory_iterator it(framesDir, ec);
+  if (ec) {
+    return -ec.value();
+  }
+
+  for (const std::filesystem::directory_entry &entry : it) {
+    std::string name = entry.path().filename().string();
+    if (!name.starts_with("frame_") || !name.ends_with(".jpg") || name.size() >= sizeof(FrameRecord::file)) {
+      continue;
+    }
+
+    FrameRecord record;
+    record.index = std::strtoull(name.c_str() + 6, nullptr, 10);
+    record.size = entry.file_size(ec);
+    std::snprintf(record.file, sizeof(record.file), "%s", name.c_str());
+    records.push_back(record);
+  }
+
+  std::sort(records.begin(), records.end(), [](const FrameRecord &a, const FrameRecord &b) {
+    return a.index < b.index;
+  });
+
+  return 0;
+}
+
+
+// builds a sheet from the selected records
+static int buildSheet(const std::filesystem::path &framesDir, const std::vector<FrameRecord> &records, const SheetOptions &options,
+                      int scaleDenom, std::vector<uint8_t> &sheet) {
+
+  int count = static_cast<int>(records.size());
+  int columns = (options.layout == SheetLayout::Strip) ? count
+              : (options.columns > 0) ? std::min(options.columns, count)
+              : static_cast<int>(std::ceil(std::sqrt(static_cast<double>(count))));
+  int rows = (count + columns - 1) / columns;
+
+  jpeg_decompress_struct cinfo;
+  JpegError error;
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = jpegErrorExit;
+  error.pub.output_message = decodeOutputMessage;
+  jpeg_create_decompress(&cinfo);
+
+  std::vector<uint8_t> pixels;
+  std::vector<uint8_t> canvas;
+  int tileWidth = 0;
+  int tileHeight = 0;
+  int decoded = 0;
+
+  MappedFile file;
+  std::string mappedName;
+
+  for (int i = 0; i < count; i++) {
+    const FrameRecord &record = records[i];
+
+    // frames of a segment are next to each other, so each segment is mapped once
+    if (mappedName != record.file) {
+      mappedName.clear();
+      if (file.open(framesDir / record.file) < 0) {
+        continue;
+      }
+      mappedName = record.file;
+    }
+
+    if (record.offset + record.size > file.size()) {
+      continue;
+    }
+
+    int width;
+    int height;
+    if (!decodeScaled(cinfo, error, file.data() + record.offset, record.size, scaleDenom, pixels, width, height)) {
+      std::cerr << "Frame " << record.index << " could not be decoded, leaving its thumbnail empty" << std::endl;
+      continue;
+    }
+
+    // the first frame sizes every tile, a sheet libjpeg cannot encode is refused before its canvas is allocated
+    if (canvas.empty()) {
+      if (static_cast<long>(width) * columns > JPEG_MAX_DIMENSION || static_cast<long>(height) * rows > JPEG_MAX_DIMENSION) {
+        std::cerr << "Sheet of " << columns << "x" << rows << " thumbnails of " << width << "x" << height << " is too large" << std::endl;
+        jpeg_destroy_decompress(&cinfo);
+        return -E2BIG;
+      }
+
+      tileWidth = width;
+      tileHeight = height;
+      canvas.resize(static_cast<size_t>(tileWidth) * columns * tileHeight * rows * 3);
+      for (size_t p = 0; p < canvas.size(); p += 3) {
+        std::memcpy(canvas.data() + p, BLACK, 3);
+      }
+    }
+
+    size_t canvasRow = static_cast<size_t>(tileWidth) * columns * 3;
+    size_t copyBytes = static_cast<size_t>(std::min(width, tileWidth)) * 3;
+    uint8_t *tile = canvas.data() + static_cast<size_t>(i / columns) * tileHeight * canvasRow + static_cast<size_t>(i % columns) * tileWidth * 3;
+
+    for (int y = 0; y < std::min(height, tileHeight); y++) {
+      std::memcpy(tile + y * canvasRow, pixels.data() + static_cast<size_t>(y) * width * 3, copyBytes);
+    }
+
+    decoded++;
+  }
+
+  jpeg_destroy_decompress(&cinfo);
+
+  if (decoded == 0) {
+    return -EIO;
+  }
+
+  return compressSheet(canvas, tileWidth * columns, tileHeight * rows, (options.quality > 0) ? options.quality : 80, sheet);
+}
+
+
+// a cached sheet stays valid until its session gains a frame
+struct CachedSheet {
+  size_t frames = 0; // frames in the session when the sheet was built
+  FrameRecord last; // the session's last frame then
+  SheetImage image;
+  uint64_t used = 0;
+};
+
+static std::mutex cacheMutex;
+static std::map<std::string, CachedSheet> sheetCache;
+static uint64_t cacheClock = 0;
+
+
+static bool sameRecord(const FrameRecord &a, const FrameRecord &b) {
+  return a.index == b.index && a.unixMs == b.unixMs && a.offset == b.offset && a.size == b.size && std::strcmp(a.file, b.file) == 0;
+}
+
+
+int contactSheet(const std::filesystem::path &framesDir, const SheetOptions &options, SheetImage &sheet) {
+
+  std::vector<FrameRecord> records;
+  int err = sessionFrames(framesDir, records);
+  if (err < 0) {
+    return err;
+  }
+  if (records.empty()) {
+    return -ENOENT;
+  }
+
+  size_t frames = (options.frames > 0) ? std::min(options.frames, SHEET_MAX_FRAMES) : 16;
+  int scaleDenom = (options.scaleDenom == 2 || options.scaleDenom == 4) ? options.scaleDenom : 8;
+
+  char key[64];
+  std::snprintf(key, sizeof(key), "|%zu|%d|%d|%d|%d", frames, static_cast<int>(options.layout), options.columns, scaleDenom, options.quality);
+  std::string cacheKey = std::filesystem::absolute(framesDir).lexically_normal().string() + key;
+
+  size_t sessionFrameCount = records.size();
+  FrameRecord last = records.back();
+
+  {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto cached = sheetCache.find(cacheKey);
+    if (cached != sheetCache.end() && cached->second.frames == sessionFrameCount && sameRecord(cached->second.last, last)) {
+      cached->second.used = ++cacheClock;
+      sheet = cached->second.image;
+      return 0;
+    }
+  }
+
+  FrameSelection selection;
+  selection.maxFrames = frames;
+  selectFrames(records, selection);
+
+  auto image = std::make_shared<std::vector<uint8_t>>();
+  err = buildSheet(framesDir, records, options, scaleDenom, *image);
+  if (err < 0) {
+    return err;
+  }
+
+  sheet = image;
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+
+  CachedSheet &entry = sheetCache[cacheKey];
+  entry.frames = sessionFrameCount;
+  entry.last = last;
+  entry.image = sheet;
+  entry.used = ++cacheClock;
+
+  if (sheetCache.size() > SHEET_CACHE_SIZE) {
+    auto oldest = std::min_element(sheetCache.begin(), sheetCache.end(), [](const auto &a, const auto &b) {
+      return a.second.used < b.second.used;
+    });
+    sheetCache.erase(oldest);
+  }
+
+  return 0;
+}
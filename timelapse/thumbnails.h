@@ -0,0 +1,44 @@
+#ifndef THUMBNAILS_H
+#define THUMBNAILS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// how the thumbnails of a sheet are arranged
+enum class SheetLayout : int {
+  Grid = 0, // contact sheet, rows of columns thumbnails
+  Strip = 1 // scrub strip, every thumbnail in one row
+};
+
+/**
+ * What a contact sheet shows. Zero values evaluate to the defaults noted per field.
+ */
+struct SheetOptions {
+  size_t frames = 0; // evenly spaced frames of the session (0 evaluates to 16, at most SHEET_MAX_FRAMES)
+  SheetLayout layout = SheetLayout::Grid;
+  int columns = 0; // thumbnails per row of a grid (0 evaluates to a square grid)
+  int scaleDenom = 0; // thumbnail size as a fraction of the frame, 1/2, 1/4 or 1/8 (0 evaluates to 8)
+  int quality = 0; // JPEG quality of the sheet (0 evaluates to 80)
+};
+
+// most frames one sheet tiles, more are clamped to it
+constexpr size_t SHEET_MAX_FRAMES = 256;
+
+// compressed sheet, shared read only by every request served from the cache
+using SheetImage = std::shared_ptr<const std::vector<uint8_t>>;
+
+/**
+ * Tiles evenly spaced frames of a session into one JPEG.
+ * Frames are decoded with libjpeg's DCT domain scaling straight to the thumbnail size, so a full resolution frame is never decoded.
+ * Sheets are cached per frame directory and options, a cached sheet is used for as long as no frame has been added to the session.
+ * @param framesDir Frame directory of the session, read through its manifest (or its frame files if it has none)
+ * @param options What the sheet shows
+ * @param sheet Set to the compressed sheet
+ * @return 0 on success, -ENOENT if the session has no frames, -E2BIG if the sheet would exceed JPEG_MAX_DIMENSION, other negative errno on error
+ */
+int contactSheet(const std::filesystem::path &framesDir, const SheetOptions &options, SheetImage &sheet);
+
+#endif
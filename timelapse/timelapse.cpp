@@ -1,8 +1,27 @@
 #include "timelapse.h"
+#include "jpeg_encoder.h"
+#include "v4l2_encoder.h"
+#include "live_encoder.h"
+#include "frame_writer.h"
+#include "manifest.h"
+#include "segment_store.h"
+#include "session_state.h"
+#include "stage_stats.h"
+#include "render.h"
+#include "part_encoder.h"
+#include "cpu_budget.h"
+#include "preview.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "exposure.h"
 
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <map>
+#include <optional>
+#include <vector>
+#include <algorithm>
 #include <thread>
 #include <mutex>
 #include <atomic>
@@ -13,39 +32,91 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sstream>
+#include <string_view>
 #include <chrono>
 #include <condition_variable>
 #include <csignal>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <linux/videodev2.h>
+
 #include <libcamera/libcamera.h>
 #include <libcamera/framebuffer.h>
-#include <jpeglib.h> 
 
 using namespace libcamera;
 using namespace std::chrono_literals;
 
-// width/height of camera frames
+// default width/height of camera frames
 int WIDTH = 1920;
 int HEIGHT = 1080;
 
-std::atomic<bool> shouldRecordStop{false};
-std::atomic<bool> shouldCreateStop{false};
+// quality of saved frames
+int JPEG_QUALITY = 90;
+
+// hardware encoders on the Pi (bcm2835-codec)
+std::string V4L2_JPEG_DEVICE = [] {
+  const char* device = std::getenv("CAM_V4L2_JPEG_DEVICE");
+  return std::string(device ? device : "/dev/video31");
+}();
 
-std::mutex reqCompleteMutex;
-std::condition_variable reqCompleteCV;
-std::atomic<bool> requestCompleted{false};
+// keeps cameras acquired, configured and their encoders running between recordings, so a recording starts and stops without
+// setting the camera up or tearing it down (CAM_WARM_CAMERAS=1, see releaseWarmCameras())
+bool WARM_CAMERAS = [] {
+  const char* warm = std::getenv("CAM_WARM_CAMERAS");
+  return warm && std::string(warm) == "1";
+}();
+
+// bitrate used by the hardware H.264 encoder when rendering
+std::string HW_BITRATE = "10M";
+
+// stops every recording, e.g. when the server shuts down (see stopRecording() for a single camera)
+std::atomic<bool> shouldRecordStop{false};
 
 // default frame capture is 2/sec and length is 1 day
 int CAP_INTERVAL = 500; // in ms
 int TIMELAPSE_LENGTH = 1440; // in min
 
-static std::shared_ptr<Camera> camera;
+// default encoder pool is 2 threads sharing a queue of 4 frames
+int ENCODER_THREADS = 2;
+int ENCODER_QUEUE_DEPTH = 4;
+
+// default writer holds up to 8 compressed frames and syncs the filesystem every 100 frames
+int WRITER_BUFFERS = 8;
+int WRITER_SYNC_EVERY = 100;
+
+// frames per segment file when recording into the segment store
+int SEGMENT_FRAMES = 1000;
+
+// frames exposed more than this after their capture slot count as late
+int LATE_TOLERANCE_MS = 50;
+
+// the session state is saved at least this often while recording
+int SESSION_SAVE_MS = 5000;
+
+// frames per part when encoding parts in the background
+int PART_FRAMES = 1800;
+
+// live preview frames are at most this wide, sent at most this often and compressed at this quality
+int PREVIEW_WIDTH = 640;
+int PREVIEW_FPS = 5;
+int PREVIEW_QUALITY = 70;
+
+// adaptive capture compares every 16th sample of every 16th row, a sample changed if it moved by more than 16 levels,
+// and a frame is saved once 5 per mille of the samples changed
+int CHANGE_GRID_STEP = 16;
+int CHANGE_DELTA = 16;
+int CHANGE_THRESHOLD = 5;
+
+// brightness and colour of saved frames are measured on every 16th sample of every 16th row, for the manifest and stabilization
+int STATS_GRID_STEP = 16;
 
+// longest exposure stabilization sets, it stays below three quarters of the capture interval as well
+int STABILIZE_MAX_EXPOSURE_US = 100000;
 
 // get path to where frames will be stored
 std::filesystem::path FRAME_PATH = [] {
@@ -67,248 +138,719 @@ std::filesystem::path TIMELAPSE_PATH = [] {
 }();
 
 
-static void requestComplete(Request *request) {
+// completed request waiting for (or being processed by) an encoder thread
+struct EncodeJob {
+  Request *request = nullptr;
+  bool requeue = false; // pipelined capture, the request goes straight back to the camera after encoding
+  uint64_t index = 0; // position of the frame among the frames handed to the encoders
+  uint64_t completedNs = 0; // stageClockNs() when the request completed, for the queue stage
+  int64_t completedUnixMs = 0; // wall clock time the request completed, for the manifest
+  bool previewOnly = false; // pipelined frame between capture slots, only encoded for the live preview
+  bool duplicate = false; // adaptive capture found no change, listed in the manifest as a repeat of the last saved frame
+  float luma = 0; // mean luma measured on the completion thread, for the manifest
+};
+
+// what a camera was set up with, a warm camera is reused by the next recording that asks for the same
+struct CameraSetup {
+  unsigned int width = 0;
+  unsigned int height = 0;
+  CaptureFormat format = CaptureFormat::Yuv420;
+  SensorMode sensorMode = SensorMode::Auto;
+  EncoderBackend encoder = EncoderBackend::Software;
+  int encoderThreads = 0;
+  int encoderQueueDepth = 0;
+  QueuePolicy queuePolicy = QueuePolicy::Block;
+  std::vector<int> cores; // the encoder threads keep the pinning they were started with
+
+  bool operator==(const CameraSetup &) const = default;
+};
+
+// planes of a capture buffer, mapped once when the buffers are allocated and reused for every frame
+struct MappedBuffer {
+  std::vector<uint8_t *> planes;
+  std::vector<std::pair<void *, size_t>> mappings; // one per distinct dmabuf backing the planes
+};
+
+
+/**
+ * One camera's recording: its requests, encoder pool, frame store, schedule and stop flag.
+ * Sessions share no capture state, so several cameras can record side by side in one process.
+ * With WARM_CAMERAS a session outlives its recording and keeps the camera configured for the camera's next one.
+ */
+class CaptureSession {
+public:
+  CaptureSession(const std::string &cameraId, const std::filesystem::path &framesDir) : id(cameraId), framesDir(framesDir), livePreview(&previewHub(cameraId)) {}
+
+  CaptureSession(const CaptureSession &) = delete;
+  CaptureSession &operator=(const CaptureSession &) = delete;
+
+  ~CaptureSession() {
+    release();
+  }
+
+  // records from the camera until the schedule is done or the session is stopped, setting the camera up unless it is warm
+  int record(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options);
+
+  // stops the encoders and frees the requests, buffers and camera, the next recording sets the camera up again
+  void release();
+
+  // readies a warm session for another recording, only while it is not registered
+  void rearm(const std::filesystem::path &dir) {
+    framesDir = dir;
+    stopping.store(false);
+  }
+
+  // true while the camera is configured, with its buffers mapped and encoders started
+  bool warm() const {
+    return prepared;
+  }
 
-  if (shouldRecordStop.load()) {
+  // wakes the capture loop as well, so a stop never waits for the next capture slot
+  void stop() {
     {
       std::lock_guard<std::mutex> lock(reqCompleteMutex);
-      requestCompleted.store(true);
+      stopping.store(true);
     }
-    reqCompleteCV.notify_one();
-    return;
+    reqCompleteCV.notify_all();
   }
 
-  if (request->status() == Request::RequestCancelled) {
+  PipelineDepths depths() const {
+    PipelineDepths pipeline;
+    pipeline.encoderQueue = encoderPool.pending();
+    pipeline.writerQueue = frameWriter.pending();
+    return pipeline;
+  }
+
+  const std::string &cameraId() const {
+    return id;
+  }
+
+  const std::filesystem::path &directory() const {
+    return framesDir;
+  }
+
+  RecordingInfo info() const {
+    RecordingInfo recording;
+    recording.cameraId = id;
+    recording.framesDir = framesDir;
+    recording.slotsTotal = targetSlots.load();
+    recording.slotsDone = std::min(nextSlot.load(), recording.slotsTotal);
+    recording.intervalMs = frameIntervalNs.load() / 1000000;
+    recording.framesSaved = frameWriter.framesWritten();
+    return recording;
+  }
+
+private:
+  // the writer's storage check only counts while it writes this recording's stills, a warm session's writer may be left from the last one
+  bool stopRequested() const {
+    return stopping.load() || shouldRecordStop.load() || (writeStills && frameWriter.storageLow());
+  }
+
+  int prepare(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options);
+  int capture(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options);
+  void requeueRequest(Request *request);
+  void signalRequestDone();
+  void unmapBuffers();
+  int mapBuffers(const std::vector<std::unique_ptr<FrameBuffer>> &buffers);
+  int encodeFrameHardware(FrameBuffer *buffer, JpegBuffer &out);
+  int frameView(FrameBuffer *buffer, YuvFrame &frame);
+  int writeFrame(FrameBuffer *buffer, const EncodeJob &job);
+  void publishPreview(FrameBuffer *buffer);
+  void encodeJob(EncodeJob &job);
+  void discardJob(EncodeJob &job);
+  void recordSlot(uint64_t missed, uint64_t latenessNs);
+  bool frameChanged(Request *request);
+  float measureRequest(Request *request);
+  void applyStabilizer(Request *request);
+  bool frameIsDue(Request *request);
+  void requestComplete(Request *request);
+  void saveSession(bool complete);
+  void maybeSaveSession();
+
+  const std::string id;
+  std::filesystem::path framesDir; // only changed by rearm()
+  PreviewHub *livePreview; // hub of this camera's live preview
+
+  std::shared_ptr<Camera> camera;
+  std::atomic<bool> stopping{false};
+
+  // camera setup done by prepare(), kept between recordings of a warm session
+  bool prepared = false;
+  CameraSetup setup;
+  std::unique_ptr<FrameBufferAllocator> allocator;
+  Stream *stream = nullptr;
+  std::vector<std::unique_ptr<Request>> requests;
+
+  // wakes the capture loop once the single request is done with
+  std::mutex reqCompleteMutex;
+  std::condition_variable reqCompleteCV;
+  std::atomic<bool> requestDone{false};
+
+  WorkerPool<EncodeJob> encoderPool;
+
+  // only modified while the camera is stopped, encoder threads just read it
+  std::map<const FrameBuffer *, MappedBuffer> mappedBuffers;
+
+  // size, strides and chroma layout of the configured stream, frameView() only fills in the plane pointers
+  YuvFrame frameLayout;
+
+  // shared by all encoder threads when EncoderBackend::V4l2 is selected and the device opened
+  V4l2Encoder hwJpegEncoder;
+
+  // writes compressed frames to framesDir off the encoder threads
+  FrameWriter frameWriter;
+
+  // live encode state (see RecordOptions::liveEncode)
+  LiveEncoder liveEncoder;
+  bool liveEncoding = false;
+  bool writeStills = true;
+
+  // encodes finished frames into video parts while recording (see RecordOptions::encodeParts)
+  PartEncoder partEncoder;
+
+  // index of the next frame handed to the encoders, only incremented on the completion thread
+  std::atomic<uint64_t> nextJobIndex{0};
+
+  // pipelined capture state (see RecordOptions::pipelined)
+  bool pipelinedCapture = false;
+  std::atomic<int> framesCaptured{0};
+  std::atomic<bool> scheduleDone{false}; // every capture slot of the session has been filled or missed
+  std::atomic<uint64_t> targetSlots{0}; // read by info() from other threads, like the interval
+  std::atomic<uint64_t> frameIntervalNs{0};
+  uint64_t firstFrameTimestamp = 0; // sensor time of this run's first frame, anchors the slot grid at slotBase
+  uint64_t slotBase = 0; // slot this run started at, non-zero for resumed sessions
+  std::atomic<uint64_t> nextSlot{0}; // first capture slot not filled yet, only advanced by the capturing thread
+
+  // adaptive capture state (see RecordOptions::adaptive), the grids are only touched on the completion thread
+  bool adaptiveCapture = false;
+  bool duplicateStill = false;
+  size_t changeThreshold = 0; // per mille of grid samples
+  uint64_t maxStep = 1;
+  std::atomic<uint64_t> adaptiveStep{1}; // capture slots until the next frame is taken
+  std::vector<uint8_t> referenceGrid; // grid of the last saved frame
+  std::vector<uint8_t> currentGrid;
+  bool haveReference = false;
+  std::atomic<uint64_t> framesUnchanged{0};
+
+  // exposure feedback (see RecordOptions::stabilize), fed on the completion thread and applied to every request queued after
+  ExposureStabilizer stabilizer;
+  bool stabilizing = false;
+
+  // session state (see SessionState), saved every SESSION_SAVE_MS while frames are being written
+  SessionState session;
+  bool sessionSaving = false;
+  int64_t sessionSavedMs = 0;
+
+  // capture slot accounting for both capture modes, a slot is one capture interval on the schedule
+  std::atomic<uint64_t> slotsMissed{0};
+  std::atomic<uint64_t> framesLate{0};
+  std::atomic<uint64_t> maxLatenessNs{0};
+
+  // the part of the above that happened while a render was running next to capture
+  std::atomic<uint64_t> slotsMissedRendering{0};
+  std::atomic<uint64_t> framesLateRendering{0};
+};
+
+
+// hands a request back to the camera with the same buffers, unless recording is stopping
+void CaptureSession::requeueRequest(Request *request) {
+  if (stopRequested()) {
     return;
   }
 
-  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
+  request->reuse(Request::ReuseBuffers);
+  applyStabilizer(request);
+  camera->queueRequest(request);
+}
+
+
+// wakes the capture loop so the request can be reused
+void CaptureSession::signalRequestDone() {
+  {
+    std::lock_guard<std::mutex> lock(reqCompleteMutex);
+    requestDone.store(true);
+  }
+  reqCompleteCV.notify_one();
+}
 
-  for (auto bufferPair : buffers) {
-    FrameBuffer *buffer = bufferPair.second;
-    const FrameMetadata &metadata = buffer->metadata();
 
-    if (metadata.sequence % 1000 == 0) {
-      std::cout << "seq: " << std::setw(6) << std::setfill('0') << metadata.sequence << std::endl;
+// unmaps every buffer in the mapping table
+void CaptureSession::unmapBuffers() {
+
+  for (auto &bufferPair : mappedBuffers) {
+    for (auto &mapping : bufferPair.second.mappings) {
+      munmap(mapping.first, mapping.second);
     }
+  }
 
-    // create file name
-    std::ostringstream oss;
-    oss << "frame_" << std::setw(6) << std::setfill('0') << metadata.sequence << ".jpg";
-    auto filename = FRAME_PATH / oss.str();
+  mappedBuffers.clear();
+}
 
+
+// maps every plane of the allocated buffers, planes sharing a dmabuf share one mapping
+int CaptureSession::mapBuffers(const std::vector<std::unique_ptr<FrameBuffer>> &buffers) {
+
+  for (const std::unique_ptr<FrameBuffer> &buffer : buffers) {
     const auto &planes = buffer->planes();
 
-    // calculate total buffer size for all planes
-    size_t totalLength = 0;
-    for (unsigned int i = 0; i < planes.size(); ++i) {
-      totalLength += planes[i].length;
-    }
-
-    // map the entire YUV420 buffer
-    void *baseMem = mmap(nullptr,
-                         totalLength,
-                         PROT_READ,
-                         MAP_SHARED,
-                         planes[0].fd.get(),
-                         0);
-
-    if (baseMem == MAP_FAILED) {
-      std::cerr << "mmap failed: " << std::strerror(errno) << std::endl;
-      break;
-    }
-
-    uint8_t *yPlane = static_cast<uint8_t *>(baseMem);
-    uint8_t *uPlane = yPlane + planes[0].length;
-    uint8_t *vPlane = uPlane + planes[1].length;
-
-    // initialize JPEG compression
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-
-    FILE *outfile = fopen(filename.c_str(), "wb");
-    if (!outfile) {
-      std::cerr << "Error opening JPEG file: " << std::strerror(errno) << std::endl;
-      munmap(baseMem, totalLength);
-      break;
-    }
-
-    jpeg_stdio_dest(&cinfo, outfile);
-
-    // sst compression parameters
-    cinfo.image_width = WIDTH;
-    cinfo.image_height = HEIGHT;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_YCbCr;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, 90, TRUE);  // 90% quality
-    
-    cinfo.optimize_coding = TRUE;
-
-    jpeg_start_compress(&cinfo, TRUE);
-
-    // convert YUV420 planar to YUV444 for JPEG
-    std::vector<uint8_t> row_buffer(WIDTH * 3);
-    
-    for (int y = 0; y < HEIGHT; y++) {
-      for (int x = 0; x < WIDTH; x++) {
-        int yIdx = y * WIDTH + x;
-        int uvIdx = (y / 2) * (WIDTH / 2) + (x / 2);
-        
-        row_buffer[x * 3 + 0] = yPlane[yIdx]; 
-        row_buffer[x * 3 + 1] = uPlane[uvIdx];
-        row_buffer[x * 3 + 2] = vPlane[uvIdx];
+    // size each dmabuf mapping to cover every plane that lives in it
+    std::map<int, size_t> lengths;
+    for (const FrameBuffer::Plane &plane : planes) {
+      size_t end = plane.offset + plane.length;
+      lengths[plane.fd.get()] = std::max(lengths[plane.fd.get()], end);
+    }
+
+    MappedBuffer mapped;
+    std::map<int, uint8_t *> bases;
+
+    for (auto &lengthPair : lengths) {
+      void *mem = mmap(nullptr, lengthPair.second, PROT_READ, MAP_SHARED, lengthPair.first, 0);
+
+      if (mem == MAP_FAILED) {
+        int err = errno;
+        std::cerr << "mmap failed: " << std::strerror(err) << std::endl;
+        for (auto &mapping : mapped.mappings) {
+          munmap(mapping.first, mapping.second);
+        }
+        unmapBuffers();
+        return -err;
       }
-      
-      uint8_t *row_pointer = row_buffer.data();
-      jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+
+      mapped.mappings.emplace_back(mem, lengthPair.second);
+      bases[lengthPair.first] = static_cast<uint8_t *>(mem);
     }
 
-    // clean up compression
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    fclose(outfile);
+    for (const FrameBuffer::Plane &plane : planes) {
+      mapped.planes.push_back(bases[plane.fd.get()] + plane.offset);
+    }
 
-    munmap(baseMem, totalLength);
+    mappedBuffers[buffer.get()] = std::move(mapped);
   }
 
-  {
-    std::lock_guard<std::mutex> lock(reqCompleteMutex);
-    requestCompleted.store(true);
+  return 0;
+}
+
+
+// hands the frame's dmabuf to the hardware encoder, only possible when every plane lives in one dmabuf
+int CaptureSession::encodeFrameHardware(FrameBuffer *buffer, JpegBuffer &out) {
+
+  const auto &planes = buffer->planes();
+
+  size_t totalLength = 0;
+  for (const FrameBuffer::Plane &plane : planes) {
+    if (plane.fd.get() != planes[0].fd.get()) {
+      return -EINVAL;
+    }
+    totalLength += plane.length;
   }
-  reqCompleteCV.notify_one();
+
+  return hwJpegEncoder.encode(planes[0].fd.get(), totalLength, [&out](const uint8_t *data, size_t size) {
+    if (out.data.size() < size) {
+      out.data.resize(size);
+    }
+    std::memcpy(out.data.data(), data, size);
+    out.size = size;
+  });
 }
 
 
-int recordTimelapseHandler(int timelapseLength = 0, int capInterval = 0) {
+// describes the mapped planes of a frame buffer
+int CaptureSession::frameView(FrameBuffer *buffer, YuvFrame &frame) {
+
+  auto mapped = mappedBuffers.find(buffer);
+  if (mapped == mappedBuffers.end() || mapped->second.planes.empty()) {
+    std::cerr << "Frame buffer is not mapped" << std::endl;
+    return -1;
+  }
 
-  std::unique_ptr<CameraManager> cm = std::make_unique<CameraManager>();
-  cm->start();
+  const std::vector<uint8_t *> &planes = mapped->second.planes;
+  size_t chromaRows = (frameLayout.height + 1) / 2;
 
-  for (auto const &camera : cm->cameras()) {
-    std::cout << camera->id() << std::endl;
+  frame = frameLayout;
+  frame.y = planes[0];
+
+  // a buffer described as a single plane holds the chroma right after the Y plane
+  const uint8_t *chroma = (planes.size() > 1) ? planes[1] : frame.y + static_cast<size_t>(frame.yStride) * frame.height;
+
+  if (frame.chroma == ChromaLayout::Interleaved) {
+    frame.u = chroma;
+    frame.v = chroma + 1;
+  } else {
+    frame.u = chroma;
+    frame.v = (planes.size() > 2) ? planes[2] : chroma + static_cast<size_t>(frame.uvStride) * chromaRows;
   }
 
-  auto cameras = cm->cameras();
-  if (cameras.empty()) {
-    std::cout << "No cameras were identified on the system." << std::endl;
-    cm->stop();
-    return EXIT_FAILURE;
+  return 0;
+}
+
+
+// compresses a completed frame buffer and hands it to the writer, which saves it to framesDir as a JPEG
+// frames are named by their index among the saved frames, so the file names have no gaps even though the sensor sequence does
+int CaptureSession::writeFrame(FrameBuffer *buffer, const EncodeJob &job) {
+
+  const FrameMetadata &metadata = buffer->metadata();
+
+  if (metadata.sequence % 1000 == 0) {
+    std::cout << "seq: " << std::setw(6) << std::setfill('0') << metadata.sequence << std::endl;
+    std::cout << stageReport() << std::flush;
+  }
+
+  YuvFrame frame;
+  if (frameView(buffer, frame) < 0) {
+    return -1;
   }
 
-  std::string cameraId = cameras[0]->id();
-  camera = cm->get(cameraId);
+  // create file name and manifest entry
+  FrameRecord record;
+  record.index = job.index;
+  record.sensorNs = metadata.timestamp;
+  record.unixMs = job.completedUnixMs;
+  record.luma = job.luma;
+  std::snprintf(record.file, sizeof(record.file), "frame_%06llu.jpg", static_cast<unsigned long long>(job.index));
+
+  if (job.duplicate) {
+    frameWriter.submitDuplicate(record);
+    return 0;
+  }
 
-  camera->acquire();
+  // blocks while every pooled buffer is waiting on storage
+  JpegBuffer *out = frameWriter.acquire();
 
+  int err;
   {
-    std::unique_ptr<CameraConfiguration> config = camera->generateConfiguration( { StreamRole::VideoRecording });
+    StageTimer timer(Stage::Encode);
+
+    // libjpeg takes the frame if the hardware encoder is not open or fails on it
+    err = hwJpegEncoder.isOpen() ? encodeFrameHardware(buffer, *out) : -ENODEV;
+    if (err) {
+      err = encodeJpeg(frame, *out, JPEG_QUALITY);
+    }
+  }
+
+  if (err) {
+    std::cerr << "Unable to encode frame " << job.index << ": " << std::strerror(-err) << std::endl;
+    countMetric(Metric::EncodeErrors);
+    frameWriter.release(out);
+    return err;
+  }
 
-    StreamConfiguration &streamConfig = config->at(0);
-    std::cout << "Default VideoRecording configuration is: " << streamConfig.toString() << std::endl;
+  frameWriter.submit(record, out);
 
-    streamConfig.size.width = WIDTH;
-    streamConfig.size.height = HEIGHT;
-    streamConfig.pixelFormat = formats::YUV420;
+  return 0;
+}
 
-    config->validate();
-    std::cout << "Validated VideoRecording config is: " << streamConfig.toString() << std::endl;
 
-    camera->configure(config.get());
+// downscales and compresses a frame for the live preview, shared by every viewer
+void CaptureSession::publishPreview(FrameBuffer *buffer) {
 
-    FrameBufferAllocator *allocator = new FrameBufferAllocator(camera);
+  YuvFrame frame;
+  if (frameView(buffer, frame) < 0) {
+    return;
+  }
 
-    for (StreamConfiguration &cfg : *config) {
-      int ret = allocator->allocate(cfg.stream());
-      if (ret < 0) {
-        std::cerr << "Can't alloc buffers" << std::endl;
-        delete allocator;
-        return -ENOMEM;
-      }
+  PreviewFrame preview;
+  if (encodePreview(frame, PREVIEW_WIDTH, PREVIEW_QUALITY, preview) == 0) {
+    livePreview->publish(std::move(preview));
+    countMetric(Metric::PreviewFrames);
+  }
+}
+
+
+// runs on an encoder thread, the request is only handed back to the capture loop once its frame is encoded
+void CaptureSession::encodeJob(EncodeJob &job) {
 
-      size_t allocated = allocator->buffers(cfg.stream()).size();
-      std::cout << "Allocated " << allocated << " buffers for stream" << std::endl;
+  if (job.previewOnly) {
+    for (auto bufferPair : job.request->buffers()) {
+      publishPreview(bufferPair.second);
     }
+    requeueRequest(job.request);
+    return;
+  }
 
-    Stream *stream = streamConfig.stream();
-    const std::vector<std::unique_ptr<FrameBuffer>> &buffers = allocator->buffers(stream);
-    std::vector<std::unique_ptr<Request>> requests;
+  stageHistogram(Stage::Queue).record(stageClockNs() - job.completedNs);
 
-    for (unsigned int i = 0; i < buffers.size(); i++) {
-      std::unique_ptr<Request> request = camera->createRequest();
-      if (!request) {
-        std::cerr << "Can't create request" << std::endl;
-        return -ENOMEM;
-      }
+  // claimed before the still is written, it is only encoded once the still is on its way to storage
+  bool preview = livePreview->claim(stageClockNs());
 
-      const std::unique_ptr<FrameBuffer> &buffer = buffers[i];
+  for (auto bufferPair : job.request->buffers()) {
+    if (writeStills) {
+      writeFrame(bufferPair.second, job);
+    }
 
-      int ret = request->addBuffer(stream, buffer.get());
-      if (ret < 0) {
-        std::cerr << "Can't set buffer for reqeust" << std::endl;
-        return ret;
+    YuvFrame frame;
+    if (liveEncoding) {
+      if (frameView(bufferPair.second, frame) == 0) {
+        StageTimer timer(Stage::Live);
+        liveEncoder.writeFrame(job.index, frame);
+      } else {
+        liveEncoder.skipFrame(job.index);
       }
+    }
 
-      requests.push_back(std::move(request));
+    if (preview) {
+      publishPreview(bufferPair.second);
     }
+  }
+
+  if (job.requeue) {
+    requeueRequest(job.request);
+  } else {
+    signalRequestDone();
+  }
+}
+
+
+// runs when the encoder queue is full under QueuePolicy::DropOldest
+void CaptureSession::discardJob(EncodeJob &job) {
 
-    camera->requestCompleted.connect(requestComplete);
+  if (job.previewOnly) {
+    requeueRequest(job.request);
+    return;
+  }
+
+  countMetric(Metric::FramesDropped);
+
+  for (auto bufferPair : job.request->buffers()) {
+    std::cerr << "Encoders fell behind, dropping frame " << bufferPair.second->metadata().sequence << std::endl;
+  }
 
-    camera->start();
+  if (liveEncoding) {
+    liveEncoder.skipFrame(job.index);
+  }
 
-    capInterval = (capInterval > 0) ? capInterval : CAP_INTERVAL;
-    timelapseLength = (timelapseLength > 0) ? timelapseLength : TIMELAPSE_LENGTH;
+  if (job.requeue) {
+    requeueRequest(job.request);
+  } else {
+    signalRequestDone();
+  }
+}
 
-    const int totalFrames = (timelapseLength * 60 * 1000) / capInterval;
-    for (int i = 0; i < totalFrames && !shouldRecordStop.load(); i++) {
 
-      auto startTime = std::chrono::steady_clock::now();
+// wall clock time in milliseconds since the epoch
+static int64_t unixTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-      if (i > 0) {
-        std::unique_lock<std::mutex> lock(reqCompleteMutex);
-        reqCompleteCV.wait(lock, []{ return requestCompleted.load(); });
 
-        if (shouldRecordStop.load()) break;
+// sensor timestamp of the frame a request captured (0 if it has no buffers)
+static uint64_t requestTimestamp(Request *request) {
 
-        requestCompleted.store(false);
-        requests[0]->reuse(Request::ReuseBuffers);
-      }
+  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
+  if (buffers.empty()) {
+    return 0;
+  }
 
-      camera->queueRequest(requests[0].get());
+  return buffers.begin()->second->metadata().timestamp;
+}
 
-      auto timeSince = std::chrono::steady_clock::now() - startTime;
-      auto timeLeft = std::chrono::milliseconds(capInterval) - timeSince;
 
-      if (timeLeft > 0ms) std::this_thread::sleep_for(timeLeft);
-    }
+// accounts one captured frame against its slot, lateness is how long after the slot's start it was exposed
+void CaptureSession::recordSlot(uint64_t missed, uint64_t latenessNs) {
 
-    if (shouldRecordStop.load()) {
-      std::cout << "\nInterrupt received, finishing current frame..." << std::endl;
-    }
+  slotsMissed.fetch_add(missed);
+  countMetric(Metric::SlotsMissed, missed);
 
-    shouldRecordStop.store(true);
+  bool late = latenessNs > static_cast<uint64_t>(LATE_TOLERANCE_MS) * 1000000;
+  if (late) {
+    framesLate.fetch_add(1);
+    countMetric(Metric::FramesLate);
+  }
+
+  if (rendersRunning() > 0 && (missed > 0 || late)) {
+    slotsMissedRendering.fetch_add(missed);
+    framesLateRendering.fetch_add(late ? 1 : 0);
+    std::cerr << "Capture deadline missed while rendering: " << missed << " slots missed, " << latenessNs / 1000000 << "ms late" << std::endl;
+  }
+
+  uint64_t current = maxLatenessNs.load();
+  while (latenessNs > current && !maxLatenessNs.compare_exchange_weak(current, latenessNs)) {
+  }
+}
 
-    std::this_thread::sleep_for(300ms);
 
-    camera->requestCompleted.disconnect(requestComplete);
-    requests.clear();
+// adaptive capture: compares the frame to the last saved one on a coarse luma grid, an unchanged frame doubles the
+// slots until the next capture (up to maxStep) and a changed one becomes the new reference and goes back to every slot
+bool CaptureSession::frameChanged(Request *request) {
 
-    camera->stop();
+  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
 
-    allocator->free(stream);
-    delete allocator;
+  YuvFrame frame;
+  if (!adaptiveCapture || buffers.empty() || frameView(buffers.begin()->second, frame) < 0) {
+    return true;
   }
 
-  camera->release();
-  camera.reset();
+  size_t samples = sampleGrid(frame.y, frame.width, frame.height, frame.yStride, CHANGE_GRID_STEP, currentGrid.data());
 
-  cm->stop();
+  bool changed = !haveReference || countChanged(currentGrid.data(), referenceGrid.data(), samples, CHANGE_DELTA) * 1000 >= changeThreshold * samples;
 
-  return 0;
+  if (changed) {
+    referenceGrid.swap(currentGrid);
+    haveReference = true;
+    adaptiveStep.store(1);
+  } else {
+    framesUnchanged.fetch_add(1);
+    countMetric(Metric::FramesUnchanged);
+    adaptiveStep.store(std::min(adaptiveStep.load() * 2, maxStep));
+  }
+
+  return changed;
+}
+
+
+// measures a frame that is going to be saved, for its manifest record and for the stabilizer, which sets up the frames after it
+float CaptureSession::measureRequest(Request *request) {
+
+  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
+
+  YuvFrame frame;
+  FrameStats stats;
+  if (buffers.empty() || frameView(buffers.begin()->second, frame) < 0 || measureFrame(frame, STATS_GRID_STEP, stats) < 0) {
+    return 0;
+  }
+
+  if (stabilizing) {
+    const ControlList &metadata = request->metadata();
+    std::optional<Span<const float, 2>> colourGains = metadata.get(controls::ColourGains);
+
+    ExposureSettings captured;
+    captured.exposureUs = metadata.get(controls::ExposureTime).value_or(0);
+    captured.analogueGain = metadata.get(controls::AnalogueGain).value_or(0.0f);
+    captured.redGain = colourGains ? (*colourGains)[0] : 0.0f;
+    captured.blueGain = colourGains ? (*colourGains)[1] : 0.0f;
+
+    stabilizer.update(stats, captured);
+  }
+
+  return stats.luma;
+}
+
+
+// sets the stabilized exposure (and colour gains) on a request about to be queued, reuse() cleared its controls
+void CaptureSession::applyStabilizer(Request *request) {
+
+  ExposureSettings settings;
+  if (!stabilizing || !stabilizer.next(settings)) {
+    return;
+  }
+
+  ControlList &requestControls = request->controls();
+  requestControls.set(controls::ExposureTime, settings.exposureUs);
+  requestControls.set(controls::AnalogueGain, settings.analogueGain);
+
+  if (stabilizer.whiteBalance()) {
+    requestControls.set(controls::ColourGains, Span<const float, 2>({ settings.redGain, settings.blueGain }));
+  }
+}
+
+
+// pipelined capture: decides from the sensor timestamp whether this frame fills the next capture slot
+bool CaptureSession::frameIsDue(Request *request) {
+
+  uint64_t timestamp = requestTimestamp(request);
+  if (timestamp == 0) {
+    return false;
+  }
+
+  // first frame of the session anchors the slot grid
+  if (firstFrameTimestamp == 0) {
+    firstFrameTimestamp = timestamp;
+  }
+
+  // slots are absolute offsets from the first frame, so per frame jitter never accumulates into drift
+  uint64_t runSlot = (timestamp - firstFrameTimestamp) / frameIntervalNs;
+  uint64_t slot = slotBase + runSlot;
+  if (slot < nextSlot.load()) {
+    return false;
+  }
+
+  // a slot whose whole interval passed without a usable frame (e.g. every request was waiting on the encoders) is missed
+  recordSlot(slot - nextSlot.load(), timestamp - firstFrameTimestamp - runSlot * frameIntervalNs);
+  nextSlot.store(slot + 1);
+
+  return true;
+}
+
+
+// called on the libcamera completion thread, must return quickly so the pipeline is not stalled
+void CaptureSession::requestComplete(Request *request) {
+
+  // the completion thread is libcamera's, it joins the capture budget on its first frame
+  static thread_local bool budgeted = false;
+  if (!budgeted) {
+    enterCaptureBudget();
+    budgeted = true;
+  }
+
+  if (stopRequested()) {
+    signalRequestDone();
+    return;
+  }
+
+  if (request->status() == Request::RequestCancelled) {
+    return;
+  }
+
+  if (!pipelinedCapture) {
+    bool changed = frameChanged(request);
+    if (!changed && !duplicateStill) {
+      signalRequestDone();
+      return;
+    }
+
+    // the request is only queued again once its frame is encoded, so the queue holds at most this job and submit() never waits
+    encoderPool.submit(EncodeJob{request, false, nextJobIndex++, stageClockNs(), unixTimeMs(), false, !changed, measureRequest(request)});
+    countMetric(Metric::FramesCaptured);
+    return;
+  }
+
+  // every camera's completions arrive on the one manager thread, so with QueuePolicy::Block a full queue is never waited on here:
+  // the frame goes back to the camera before it touches the slot grid, the adaptive reference or the stabilizer, and a slot
+  // is only missed once its interval passes without a frame finding room (DropOldest makes room without waiting)
+  if (setup.queuePolicy == QueuePolicy::Block && !encoderPool.hasRoom()) {
+    requeueRequest(request);
+    return;
+  }
+
+  // frames between capture slots (and any after the last slot) go straight back to the sensor,
+  // unless a viewer is waiting for a preview frame and an encoder is idle
+  if (scheduleDone.load() || !frameIsDue(request)) {
+    bool preview = !scheduleDone.load() && livePreview->claim(stageClockNs()) &&
+                   encoderPool.submitIfIdle(EncodeJob{request, true, 0, stageClockNs(), 0, true});
+    if (!preview) {
+      requeueRequest(request);
+    }
+    return;
+  }
+
+  // an unchanged frame pushes the next due slot further out
+  bool changed = frameChanged(request);
+  nextSlot.store(nextSlot.load() + adaptiveStep.load() - 1);
+
+  // this thread is the pool's only producer, so the room found above is still there (trySubmit() only fails once the pool stops)
+  if (changed || duplicateStill) {
+    EncodeJob job{request, true, nextJobIndex.load(), stageClockNs(), unixTimeMs(), false, !changed, measureRequest(request)};
+    bool queued = true;
+    if (setup.queuePolicy == QueuePolicy::DropOldest) {
+      encoderPool.submit(job);
+    } else {
+      queued = encoderPool.trySubmit(job);
+    }
+
+    if (queued) {
+      nextJobIndex++;
+      framesCaptured.fetch_add(1);
+      countMetric(Metric::FramesCaptured);
+    } else {
+      requeueRequest(request);
+    }
+  } else {
+    requeueRequest(request);
+  }
+
+  if (nextSlot.load() >= targetSlots) {
+    scheduleDone.store(true);
+    signalRequestDone();
+  }
 }
 
 
@@ -330,18 +872,8 @@ const std::string getPreset(Preset preset) {
 }
 
 
-int createTimelapseHandler(int fps, int preset, int crf, std::string requestedFilename) {
-
-  // set parameters to defaults if invalid
-  fps = (fps > 0) ? fps : 60;
-  preset = (preset > 0 && preset <= 3) ? preset : 2;
-  crf = (crf > -1 && crf <= 51) ? crf : 23;
-
-  std::string fpsStr = std::to_string(fps);
-  std::string presetStr = getPreset(static_cast<Preset>(preset));
-  std::string crfStr = std::to_string(crf);
-
-  std::string frameInputPattern = (FRAME_PATH / "frame_%06d.jpg").string();
+// builds the output path of a timelapse, named after the current time unless a filename was requested
+static std::string timelapseOutputPath(const std::string &requestedFilename) {
 
   // get current time to identify timelapse
   auto time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
@@ -356,89 +888,1118 @@ int createTimelapseHandler(int fps, int preset, int crf, std::string requestedFi
     filename = oss.str();
   }
 
-  std::string timelapseOutputPath = (TIMELAPSE_PATH / filename).string();
+  return (TIMELAPSE_PATH / filename).string();
+}
+
 
-  std::cout << "Creating timelapse: " << timelapseOutputPath << std::endl;
-  std::cout << "Settings: fps=" << fps << ", preset=" << presetStr << ", crf=" << crf << std::endl;
+// ffmpeg arguments encoding a video with the profile, the hardware encoder has no presets or crf and is rate controlled by bitrate instead
+static std::vector<std::string> videoCodecArgs(const RenderProfile &profile) {
 
-  pid_t pid = fork();
-  
-  if (pid < 0) {
-    std::cerr << "Unable to fork process" << std::endl;
-    return -1;
+  std::vector<std::string> args;
+
+  if (profile.codec == VideoCodec::V4l2H264) {
+    args = { "-c:v", "h264_v4l2m2m", "-b:v", profile.bitrate.empty() ? HW_BITRATE : profile.bitrate };
+  } else {
+    args = { "-c:v", (profile.codec == VideoCodec::X265) ? "libx265" : "libx264", "-preset", profile.preset, "-crf", std::to_string(profile.crf) };
+    if (!profile.tune.empty()) {
+      args.insert(args.end(), { "-tune", profile.tune });
+    }
   }
 
-  // child process executes ffmpeg command
-  if (pid == 0) {
-    execl("/usr/bin/ffmpeg",
-        "ffmpeg",
-        "-framerate", fpsStr.c_str(),
-        "-i", frameInputPattern.c_str(),
-        "-c:v", "libx264",
-        "-preset", presetStr.c_str(),
-        "-crf", crfStr.c_str(),
-        "-pix_fmt", "yuv420p",
-        timelapseOutputPath.c_str(),
-        nullptr
-    );
+  if (profile.threads > 0) {
+    args.insert(args.end(), { "-threads", std::to_string(profile.threads) });
+  }
 
-    std::cerr << "Exec'ing ffmpeg command failed: " << std::strerror(errno) << std::endl;
-    _exit(1);
+  // -2 keeps the height even, which yuv420p needs
+  if (profile.width > 0) {
+    args.insert(args.end(), { "-vf", "scale=" + std::to_string(profile.width) + ":-2" });
   }
 
-  int childStatus;
-  while (true) {
+  return args;
+}
 
-    pid_t result = waitpid(pid, &childStatus, WNOHANG);
 
-    if (result < 0) {
-      std::cerr << "waitpid failed: " << std::strerror(errno) << std::endl;
-      return -1;
-    } 
+// profile matching the preset/crf/encoder parameters renders took before profiles existed
+static RenderProfile legacyProfile(int preset, int crf, bool hardwareEncode) {
 
-    // child process finished
-    if (result > 0) {
+  RenderProfile profile;
+  findRenderProfile(hardwareEncode ? "hw" : "default", profile);
 
-      // if ended on its own
-      if (WIFEXITED(childStatus)) {
+  if (preset > 0 && preset <= 3) {
+    profile.preset = getPreset(static_cast<Preset>(preset));
+  }
+  if (crf > -1 && crf <= 51) {
+    profile.crf = crf;
+  }
 
-        int err = WEXITSTATUS(childStatus);
-        if (!err) {
-          std::cout << "Timelapse successfully created: " << timelapseOutputPath << std::endl;
-          return 0;
-        } else {
-          std::cerr << "ffmpeg exited with code " << err << std::endl;
-          return err;
-        }
+  return profile;
+}
 
-      } else if (WIFSIGNALED(childStatus)) { // if signaled/interrupted
-        std::cout << "ffmpeg killed by signal " << WTERMSIG(childStatus) << std::endl;
-        return -1;
-      }
-    }
 
-    // check if flagged to stop
-    if (shouldCreateStop.load()) {
+// saves the session's progress, frames up to nextIndex are either written or lost with the run
+void CaptureSession::saveSession(bool complete) {
 
-      std::cout << "Stopping timelapse creation..." << std::endl;
+  if (!sessionSaving) {
+    return;
+  }
 
-      kill(pid, SIGTERM);
+  session.nextSlot = std::min(nextSlot.load(), session.targetSlots);
+  session.nextIndex = nextJobIndex.load();
+  session.nextSegment = frameWriter.nextSegment();
+  session.updatedUnixMs = unixTimeMs();
+  session.complete = complete;
 
-      // allow for ffmpeg to shut down
-      std::this_thread::sleep_for(2000ms);
+  saveSessionState(framesDir / SESSION_FILE, session);
+  sessionSavedMs = session.updatedUnixMs;
+}
 
-      // check if ffmpeg still running and force kill it if it was not shut down gracefully
-      int running = waitpid(pid, &childStatus, WNOHANG);
-      if (!running) {
-        std::cout << "Force killing ffmpeg" << std::endl;
-        kill(pid, SIGKILL);
-        waitpid(pid, &childStatus, 0);
-      }
 
-      shouldCreateStop.store(false);
-      return -1;
-    }
+// called from the capture loops
+void CaptureSession::maybeSaveSession() {
+  if (sessionSaving && unixTimeMs() - sessionSavedMs >= SESSION_SAVE_MS) {
+    saveSession(false);
+  }
+}
 
-    std::this_thread::sleep_for(400ms);
+
+// libcamera allows one CameraManager per process, recordings share it and the last one to finish stops it
+// (with WARM_CAMERAS it keeps running until releaseWarmCameras(), so listing and finding cameras never restarts it either)
+static std::mutex managerMutex;
+static std::shared_ptr<CameraManager> cameraManager;
+static int managerUsers = 0;
+
+
+static std::shared_ptr<CameraManager> acquireCameraManager() {
+
+  std::lock_guard<std::mutex> lock(managerMutex);
+
+  if (!cameraManager) {
+    std::shared_ptr<CameraManager> cm = std::make_shared<CameraManager>();
+    if (cm->start() < 0) {
+      std::cerr << "Can't start camera manager" << std::endl;
+      return nullptr;
+    }
+    cameraManager = cm;
   }
+
+  managerUsers++;
+
+  return cameraManager;
+}
+
+
+static void releaseCameraManager() {
+
+  std::lock_guard<std::mutex> lock(managerMutex);
+
+  if (--managerUsers == 0 && !WARM_CAMERAS) {
+    cameraManager->stop();
+    cameraManager.reset();
+  }
+}
+
+
+int openCameraManager() {
+  return acquireCameraManager() ? 0 : -ENODEV;
+}
+
+
+void closeCameraManager() {
+  releaseCameraManager();
+}
+
+
+// sessions kept between recordings with WARM_CAMERAS, by camera ID, a recording takes its camera's session out while it runs
+static std::mutex warmMutex;
+static std::map<std::string, std::unique_ptr<CaptureSession>> warmSessions;
+
+
+// the camera's warm session if it has one, otherwise a new session that sets the camera up
+static std::unique_ptr<CaptureSession> checkoutSession(const std::string &cameraId, const std::filesystem::path &framesDir) {
+
+  std::unique_ptr<CaptureSession> session;
+
+  {
+    std::lock_guard<std::mutex> lock(warmMutex);
+
+    auto it = warmSessions.find(cameraId);
+    if (it != warmSessions.end()) {
+      session = std::move(it->second);
+      warmSessions.erase(it);
+    }
+  }
+
+  if (!session) {
+    return std::make_unique<CaptureSession>(cameraId, framesDir);
+  }
+
+  session->rearm(framesDir);
+
+  return session;
+}
+
+
+// keeps a session whose camera is still set up for the camera's next recording, any other session releases its camera here
+static void checkinSession(std::unique_ptr<CaptureSession> session) {
+
+  if (!WARM_CAMERAS || !session->warm()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(warmMutex);
+  warmSessions[session->cameraId()] = std::move(session);
+}
+
+
+void releaseWarmCameras() {
+
+  std::map<std::string, std::unique_ptr<CaptureSession>> released;
+
+  {
+    std::lock_guard<std::mutex> lock(warmMutex);
+    released.swap(warmSessions);
+  }
+
+  released.clear();
+
+  std::lock_guard<std::mutex> lock(managerMutex);
+
+  if (managerUsers == 0 && cameraManager) {
+    cameraManager->stop();
+    cameraManager.reset();
+  }
+}
+
+
+// recordings in progress, only read or changed with sessionsMutex held
+static std::mutex sessionsMutex;
+static std::vector<CaptureSession *> sessions;
+
+
+// registers a session unless its camera or frame directory is already recording
+static bool registerSession(CaptureSession *session) {
+
+  std::lock_guard<std::mutex> lock(sessionsMutex);
+
+  for (CaptureSession *other : sessions) {
+    std::error_code ec;
+    if (other->cameraId() == session->cameraId() || std::filesystem::equivalent(other->directory(), session->directory(), ec)) {
+      return false;
+    }
+  }
+
+  sessions.push_back(session);
+
+  return true;
+}
+
+
+static void unregisterSession(CaptureSession *session) {
+
+  std::lock_guard<std::mutex> lock(sessionsMutex);
+  sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+}
+
+
+// the first camera records into FRAME_PATH, the others next to it (e.g. FRAME_PATH-1 for the second)
+static std::filesystem::path defaultFramesDir(size_t index) {
+
+  if (index == 0) {
+    return FRAME_PATH;
+  }
+
+  std::filesystem::path dir = FRAME_PATH;
+  if (!dir.has_filename()) {
+    dir = dir.parent_path();
+  }
+
+  return dir.string() + "-" + std::to_string(index);
+}
+
+
+// looks up a camera among the cameras of a started manager, see findCamera()
+static int findManagedCamera(CameraManager &cm, const std::string &camera, std::string &cameraId, std::filesystem::path &framesDir) {
+
+  auto cameras = cm.cameras();
+
+  for (size_t i = 0; i < cameras.size(); i++) {
+    bool match = camera.empty() ? (i == 0) : (cameras[i]->id() == camera || std::to_string(i) == camera);
+    if (match) {
+      cameraId = cameras[i]->id();
+      framesDir = defaultFramesDir(i);
+      return 0;
+    }
+  }
+
+  return -ENODEV;
+}
+
+
+int findCamera(const std::string &camera, std::string &cameraId, std::filesystem::path &framesDir) {
+
+  std::shared_ptr<CameraManager> cm = acquireCameraManager();
+  if (!cm) {
+    return -ENODEV;
+  }
+
+  int err = findManagedCamera(*cm, camera, cameraId, framesDir);
+  releaseCameraManager();
+
+  return err;
+}
+
+
+std::vector<std::string> cameraIds() {
+
+  std::vector<std::string> ids;
+
+  std::shared_ptr<CameraManager> cm = acquireCameraManager();
+  if (!cm) {
+    return ids;
+  }
+
+  for (auto const &camera : cm->cameras()) {
+    ids.push_back(camera->id());
+  }
+  releaseCameraManager();
+
+  return ids;
+}
+
+
+std::vector<RecordingInfo> recordings() {
+
+  std::lock_guard<std::mutex> lock(sessionsMutex);
+
+  std::vector<RecordingInfo> infos;
+  for (CaptureSession *session : sessions) {
+    infos.push_back(session->info());
+  }
+
+  return infos;
+}
+
+
+bool stopRecording(const std::string &cameraId) {
+
+  std::lock_guard<std::mutex> lock(sessionsMutex);
+
+  bool stopped = false;
+  for (CaptureSession *session : sessions) {
+    if (cameraId.empty() || session->cameraId() == cameraId) {
+      session->stop();
+      stopped = true;
+    }
+  }
+
+  return stopped;
+}
+
+
+PipelineDepths pipelineDepths() {
+
+  std::lock_guard<std::mutex> lock(sessionsMutex);
+
+  PipelineDepths depths;
+  for (CaptureSession *session : sessions) {
+    PipelineDepths sessionDepths = session->depths();
+    depths.encoderQueue += sessionDepths.encoderQueue;
+    depths.writerQueue += sessionDepths.writerQueue;
+  }
+
+  return depths;
+}
+
+
+int recordTimelapseHandler(int timelapseLength = 0, int capInterval = 0) {
+
+  RecordOptions options;
+  options.timelapseLength = timelapseLength;
+  options.capInterval = capInterval;
+
+  return recordTimelapseHandler(options);
+}
+
+
+int recordTimelapseHandler(const RecordOptions &options) {
+
+  std::shared_ptr<CameraManager> cm = acquireCameraManager();
+  if (!cm) {
+    return EXIT_FAILURE;
+  }
+
+  for (auto const &camera : cm->cameras()) {
+    std::cout << camera->id() << std::endl;
+  }
+
+  if (cm->cameras().empty()) {
+    std::cout << "No cameras were identified on the system." << std::endl;
+    releaseCameraManager();
+    return EXIT_FAILURE;
+  }
+
+  std::string cameraId;
+  std::filesystem::path framesDir;
+  if (findManagedCamera(*cm, options.cameraId, cameraId, framesDir) < 0) {
+    std::cerr << "No camera " << options.cameraId << " on the system" << std::endl;
+    releaseCameraManager();
+    return -ENODEV;
+  }
+
+  if (!options.framesDir.empty()) {
+    framesDir = options.framesDir;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(framesDir, ec);
+
+  std::unique_ptr<CaptureSession> session = checkoutSession(cameraId, framesDir);
+
+  int err;
+  if (registerSession(session.get())) {
+    // a stop from here on finds the session, one that came earlier only reached the token
+    if (options.stopToken && options.stopToken->load()) {
+      std::cout << "Recording of camera " << cameraId << " stopped before it started" << std::endl;
+      err = 0;
+    } else {
+      std::cout << "Recording camera " << cameraId << " into " << framesDir << std::endl;
+      err = session->record(cm->get(cameraId), options);
+    }
+    unregisterSession(session.get());
+  } else {
+    std::cerr << "Camera " << cameraId << " or frame directory " << framesDir << " is already recording" << std::endl;
+    err = -EBUSY;
+  }
+
+  // the camera is released before the manager may stop
+  checkinSession(std::move(session));
+  releaseCameraManager();
+
+  return err;
+}
+
+
+// bits per sample of a raw Bayer format, from its name (e.g. SRGGB10_CSI2P), 0 if it has none
+static unsigned int rawBitDepth(const PixelFormat &format) {
+
+  std::string name = format.toString();
+
+  size_t digits = name.find_first_of("0123456789");
+  if (digits == std::string::npos) {
+    return 0;
+  }
+
+  return static_cast<unsigned int>(std::strtoul(name.c_str() + digits, nullptr, 10));
+}
+
+
+// picks a sensor mode from the ones the camera offers for raw capture
+// binned is the largest mode at most half the pixel array each way, full is the largest mode, ties go to the deeper mode
+static int chooseSensorMode(Camera &camera, SensorMode mode, SensorConfiguration &sensor) {
+
+  std::unique_ptr<CameraConfiguration> raw = camera.generateConfiguration({ StreamRole::Raw });
+  if (!raw || raw->empty()) {
+    return -ENOTSUP;
+  }
+
+  std::optional<Size> pixelArray = camera.properties().get(properties::PixelArraySize);
+  if (!pixelArray) {
+    return -ENOTSUP;
+  }
+
+  const StreamFormats &formats = raw->at(0).formats();
+
+  Size best;
+  unsigned int bestDepth = 0;
+
+  for (const PixelFormat &format : formats.pixelformats()) {
+    unsigned int depth = rawBitDepth(format);
+
+    for (const Size &size : formats.sizes(format)) {
+      if (mode == SensorMode::Binned && (size.width > pixelArray->width / 2 || size.height > pixelArray->height / 2)) {
+        continue;
+      }
+
+      uint64_t area = static_cast<uint64_t>(size.width) * size.height;
+      uint64_t bestArea = static_cast<uint64_t>(best.width) * best.height;
+
+      if (depth > 0 && (area > bestArea || (area == bestArea && depth > bestDepth))) {
+        best = size;
+        bestDepth = depth;
+      }
+    }
+  }
+
+  if (best.isNull()) {
+    return -ENOENT;
+  }
+
+  sensor = SensorConfiguration();
+  sensor.outputSize = best;
+  sensor.bitDepth = bestDepth;
+
+  return 0;
+}
+
+
+// converts a crop region into ScalerCrop coordinates, the largest crop rectangle the configured mode allows
+static bool scalerCrop(Camera &camera, const CropRegion &crop, Rectangle &rect) {
+
+  std::optional<Rectangle> maximum = camera.properties().get(properties::ScalerCropMaximum);
+  if (!maximum || maximum->isNull()) {
+    return false;
+  }
+
+  double x = std::clamp(crop.x, 0.0, 1.0);
+  double y = std::clamp(crop.y, 0.0, 1.0);
+  double width = std::clamp(crop.width, 0.0, 1.0 - x);
+  double height = std::clamp(crop.height, 0.0, 1.0 - y);
+
+  rect.x = maximum->x + static_cast<int>(x * maximum->width);
+  rect.y = maximum->y + static_cast<int>(y * maximum->height);
+  rect.width = std::max(static_cast<unsigned int>(width * maximum->width), 1u);
+  rect.height = std::max(static_cast<unsigned int>(height * maximum->height), 1u);
+
+  return true;
+}
+
+
+// acquires and configures the camera, maps its buffers and starts the encoders, a warm camera set up the same way is left as it is
+int CaptureSession::prepare(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options) {
+
+  CameraSetup wanted;
+  wanted.width = (options.width > 0) ? options.width : WIDTH;
+  wanted.height = (options.height > 0) ? options.height : HEIGHT;
+  wanted.format = options.format;
+  wanted.sensorMode = options.sensorMode;
+  wanted.encoder = options.encoder;
+  wanted.encoderThreads = (options.encoderThreads > 0) ? options.encoderThreads : ENCODER_THREADS;
+  wanted.encoderQueueDepth = (options.encoderQueueDepth > 0) ? options.encoderQueueDepth : ENCODER_QUEUE_DEPTH;
+  wanted.queuePolicy = options.queuePolicy;
+  wanted.cores = options.cores;
+
+  // the manager hands out a new Camera if the camera was unplugged and came back, that one is set up from scratch
+  if (prepared && camera == sessionCamera && setup == wanted) {
+    std::cout << "Camera " << id << " is warm, reusing its configuration, buffers and encoders" << std::endl;
+    return 0;
+  }
+
+  release();
+
+  camera = sessionCamera;
+  if (!camera || camera->acquire() < 0) {
+    std::cerr << "Can't acquire camera " << id << std::endl;
+    camera.reset();
+    return -EBUSY;
+  }
+
+  std::unique_ptr<CameraConfiguration> config = camera->generateConfiguration( { StreamRole::VideoRecording });
+
+  StreamConfiguration &streamConfig = config->at(0);
+  std::cout << "Default VideoRecording configuration is: " << streamConfig.toString() << std::endl;
+
+  const PixelFormat pixelFormat = (options.format == CaptureFormat::Nv12) ? formats::NV12 : formats::YUV420;
+
+  streamConfig.size.width = wanted.width;
+  streamConfig.size.height = wanted.height;
+  streamConfig.pixelFormat = pixelFormat;
+
+  if (options.sensorMode != SensorMode::Auto) {
+    SensorConfiguration sensor;
+    if (chooseSensorMode(*camera, options.sensorMode, sensor) == 0) {
+      std::cout << "Sensor mode: " << sensor.outputSize.toString() << " " << sensor.bitDepth << " bit" << std::endl;
+      config->sensorConfig = sensor;
+    } else {
+      std::cerr << "No matching sensor mode, letting the pipeline pick one" << std::endl;
+    }
+  }
+
+  // the pipeline may change the size or stride to something it supports, everything downstream follows the validated stream
+  CameraConfiguration::Status status = config->validate();
+  if (status == CameraConfiguration::Invalid) {
+    std::cerr << "Camera rejected configuration " << streamConfig.toString() << std::endl;
+    release();
+    return -EINVAL;
+  }
+  if (status == CameraConfiguration::Adjusted) {
+    std::cout << "Camera adjusted configuration" << std::endl;
+  }
+  std::cout << "Validated VideoRecording config is: " << streamConfig.toString() << std::endl;
+
+  if (streamConfig.pixelFormat != pixelFormat) {
+    std::cerr << "Camera can't capture " << pixelFormat.toString() << std::endl;
+    release();
+    return -EINVAL;
+  }
+
+  if (camera->configure(config.get()) < 0) {
+    std::cerr << "Can't configure camera" << std::endl;
+    release();
+    return -EINVAL;
+  }
+
+  // the stride covers the Y plane, YUV420 chroma rows are half as long and NV12 rows hold both chroma samples
+  frameLayout = YuvFrame();
+  frameLayout.width = static_cast<int>(streamConfig.size.width);
+  frameLayout.height = static_cast<int>(streamConfig.size.height);
+  frameLayout.yStride = (streamConfig.stride > 0) ? static_cast<int>(streamConfig.stride) : frameLayout.width;
+  frameLayout.chroma = (pixelFormat == formats::NV12) ? ChromaLayout::Interleaved : ChromaLayout::Planar;
+  frameLayout.uvStride = (frameLayout.chroma == ChromaLayout::Interleaved) ? frameLayout.yStride : frameLayout.yStride / 2;
+
+  allocator = std::make_unique<FrameBufferAllocator>(camera);
+
+  for (StreamConfiguration &cfg : *config) {
+    int ret = allocator->allocate(cfg.stream());
+    if (ret < 0) {
+      std::cerr << "Can't alloc buffers" << std::endl;
+      release();
+      return -ENOMEM;
+    }
+
+    size_t allocated = allocator->buffers(cfg.stream()).size();
+    std::cout << "Allocated " << allocated << " buffers for stream" << std::endl;
+  }
+
+  stream = streamConfig.stream();
+  const std::vector<std::unique_ptr<FrameBuffer>> &buffers = allocator->buffers(stream);
+
+  // buffers never change while the camera stays configured, so map them once here instead of per frame
+  int ret = mapBuffers(buffers);
+  if (ret < 0) {
+    std::cerr << "Can't map buffers" << std::endl;
+    release();
+    return ret;
+  }
+
+  for (unsigned int i = 0; i < buffers.size(); i++) {
+    std::unique_ptr<Request> request = camera->createRequest();
+    if (!request) {
+      std::cerr << "Can't create request" << std::endl;
+      release();
+      return -ENOMEM;
+    }
+
+    const std::unique_ptr<FrameBuffer> &buffer = buffers[i];
+
+    int ret = request->addBuffer(stream, buffer.get());
+    if (ret < 0) {
+      std::cerr << "Can't set buffer for reqeust" << std::endl;
+      release();
+      return ret;
+    }
+
+    requests.push_back(std::move(request));
+  }
+
+  if (options.encoder == EncoderBackend::V4l2) {
+    uint32_t rawFormat = (frameLayout.chroma == ChromaLayout::Interleaved) ? V4L2_PIX_FMT_NV12 : V4L2_PIX_FMT_YUV420;
+
+    if (hwJpegEncoder.open(V4L2_JPEG_DEVICE, V4L2_PIX_FMT_JPEG, frameLayout.width, frameLayout.height, frameLayout.yStride, JPEG_QUALITY,
+                           rawFormat) < 0) {
+      std::cerr << "Hardware JPEG encoder unavailable, falling back to libjpeg" << std::endl;
+    }
+  }
+
+  std::cout << "Encoder pool: " << wanted.encoderThreads << " threads, queue depth " << wanted.encoderQueueDepth
+            << ", policy " << ((options.queuePolicy == QueuePolicy::DropOldest) ? "drop-oldest" : "block") << std::endl;
+
+  encoderPool.start(wanted.encoderThreads, wanted.encoderQueueDepth, options.queuePolicy,
+                    [this](EncodeJob &job) { encodeJob(job); },
+                    [this](EncodeJob &job) { discardJob(job); });
+
+  setup = wanted;
+  prepared = true;
+
+  return 0;
+}
+
+
+void CaptureSession::release() {
+
+  encoderPool.stop();
+  requests.clear();
+
+  hwJpegEncoder.close();
+  unmapBuffers();
+
+  if (allocator) {
+    allocator->free(stream);
+    allocator.reset();
+  }
+  stream = nullptr;
+
+  if (camera) {
+    camera->release();
+    camera.reset();
+  }
+
+  prepared = false;
+}
+
+
+int CaptureSession::record(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options) {
+
+  // the calling thread outlives the recording (a capture job's worker records every run of its camera), so it must not
+  // keep the capture budget, or the next recording's writer, part encoder and encoders would start realtime on the capture core
+  ThreadBudget callerBudget = currentThreadBudget();
+
+  int err = capture(sessionCamera, options);
+
+  restoreThreadBudget(callerBudget);
+
+  return err;
+}
+
+
+int CaptureSession::capture(std::shared_ptr<Camera> sessionCamera, const RecordOptions &options) {
+
+  int timelapseLength = options.timelapseLength;
+  int capInterval = options.capInterval;
+
+  // a resumed session keeps its schedule, numbering and frame store, only the remaining slots are captured
+  bool resuming = options.resume;
+  if (resuming) {
+    if (loadSessionState(framesDir / SESSION_FILE, session) < 0) {
+      std::cerr << "No session to resume in " << framesDir << std::endl;
+      return -ENOENT;
+    }
+    if (session.complete) {
+      std::cerr << "Session in " << framesDir << " is already complete" << std::endl;
+      return -EINVAL;
+    }
+
+    std::cout << "Resuming session at frame " << session.nextIndex << ", slot " << session.nextSlot << " of " << session.targetSlots << std::endl;
+  }
+
+  // every thread of the pipeline started from here on inherits the camera's cores
+  pinThread(options.cores);
+
+  int err = prepare(sessionCamera, options);
+  if (err < 0) {
+    return err;
+  }
+
+  // a warm camera's requests come back from the last recording completed or cancelled
+  for (std::unique_ptr<Request> &request : requests) {
+    request->reuse(Request::ReuseBuffers);
+  }
+  requestDone.store(false);
+  const uint64_t droppedBefore = encoderPool.dropped();
+
+  const uint64_t firstIndex = resuming ? session.nextIndex : 0;
+  nextJobIndex.store(firstIndex);
+  liveEncoding = false;
+  // stage latencies are process wide, they start over with the first recording
+  if (recordings().size() == 1) {
+    resetStageStats();
+  }
+  writeStills = options.writeStills || !options.liveEncode;
+
+  // video settings shared by the live encode and the background parts
+  int videoFps = (options.liveFps > 0) ? options.liveFps : 60;
+  int videoPreset = (options.livePreset > 0 && options.livePreset <= 3) ? options.livePreset : 2;
+  int videoCrf = (options.liveCrf > -1 && options.liveCrf <= 51) ? options.liveCrf : 23;
+
+  std::vector<std::string> codecArgs = videoCodecArgs(legacyProfile(videoPreset, videoCrf, options.encoder == EncoderBackend::V4l2));
+
+  if (options.liveEncode) {
+    if (liveEncoder.start(frameLayout.width, frameLayout.height, videoFps, codecArgs, timelapseOutputPath(options.liveFilename), firstIndex,
+                          frameLayout.chroma) == 0) {
+      liveEncoding = true;
+    } else {
+      std::cerr << "Live encoder unavailable, writing stills only" << std::endl;
+      writeStills = true;
+    }
+  }
+
+  capInterval = (capInterval > 0) ? capInterval : CAP_INTERVAL;
+  timelapseLength = (timelapseLength > 0) ? timelapseLength : TIMELAPSE_LENGTH;
+
+  int totalFrames = (timelapseLength * 60 * 1000) / capInterval;
+
+  if (resuming) {
+    capInterval = session.capIntervalMs;
+    totalFrames = session.targetSlots;
+  } else {
+    session = SessionState();
+    session.capIntervalMs = capInterval;
+    session.targetSlots = totalFrames;
+    session.frameStore = options.frameStore;
+    session.segmentFrames = (options.segmentFrames > 0) ? options.segmentFrames : SEGMENT_FRAMES;
+    session.startedUnixMs = unixTimeMs();
+  }
+
+  sessionSaving = false;
+
+  if (writeStills) {
+    WriterOptions writerOptions;
+    writerOptions.buffers = (options.writerBuffers > 0) ? options.writerBuffers : WRITER_BUFFERS;
+    writerOptions.syncEvery = (options.syncEvery != 0) ? options.syncEvery : WRITER_SYNC_EVERY;
+
+    // sized for a typical frame up front so steady state encodes never grow them
+    writerOptions.bufferCapacity = static_cast<size_t>(frameLayout.width) * frameLayout.height / 2;
+
+    writerOptions.store = session.frameStore;
+    writerOptions.segmentFrames = session.segmentFrames;
+    writerOptions.appendManifest = resuming;
+    writerOptions.firstSegment = session.nextSegment;
+    writerOptions.quotaBytes = options.quotaBytes;
+    writerOptions.minFreePercent = options.minFreePercent;
+
+    // without stills only a live encode would keep anything of the recording
+    err = frameWriter.start(framesDir, writerOptions);
+    if (err < 0 && !liveEncoding) {
+      std::cerr << "Can't start frame writer, nothing would be saved" << std::endl;
+      writeStills = false;
+      return -EIO;
+    } else if (err < 0) {
+      std::cerr << "Can't start frame writer, only the live encode is saved" << std::endl;
+      writeStills = false;
+    } else {
+      sessionSaving = true;
+    }
+  }
+
+  // parts are encoded from the manifest, so they need the stills
+  if (options.encodeParts && writeStills) {
+    int partFrames = (options.partFrames > 0) ? options.partFrames : PART_FRAMES;
+
+    if (partEncoder.start(framesDir, videoFps, codecArgs, partFrames, resuming) < 0) {
+      std::cerr << "Part encoder unavailable, renders will encode every frame" << std::endl;
+    }
+  }
+
+  livePreview->setFps(PREVIEW_FPS);
+
+  camera->requestCompleted.connect(this, &CaptureSession::requestComplete);
+
+  // the crop maps onto the sensor mode picked by configure(), the ISP scales it to the frame size
+  ControlList startControls(controls::controls);
+  bool cropped = options.crop.width > 0 && options.crop.height > 0;
+  Rectangle crop;
+
+  if (cropped && scalerCrop(*camera, options.crop, crop)) {
+    std::cout << "Scaler crop: " << crop.toString() << std::endl;
+    startControls.set(controls::ScalerCrop, crop);
+  } else if (cropped) {
+    std::cerr << "Camera can't crop, capturing the full field of view" << std::endl;
+  }
+
+  camera->start(&startControls);
+
+  pipelinedCapture = options.pipelined;
+  framesCaptured.store(0);
+  scheduleDone.store(false);
+  targetSlots = totalFrames;
+  frameIntervalNs = static_cast<uint64_t>(capInterval) * 1000000;
+  firstFrameTimestamp = 0;
+  slotBase = resuming ? session.nextSlot : 0;
+  nextSlot.store(slotBase);
+  slotsMissed.store(0);
+  framesLate.store(0);
+  maxLatenessNs.store(0);
+  slotsMissedRendering.store(0);
+  framesLateRendering.store(0);
+
+  adaptiveCapture = options.adaptive;
+  duplicateStill = options.duplicateStill;
+  changeThreshold = (options.changeThreshold > 0) ? options.changeThreshold : CHANGE_THRESHOLD;
+  int maxInterval = (options.maxInterval > 0) ? options.maxInterval : 8 * capInterval;
+  maxStep = std::max(maxInterval / capInterval, 1);
+  adaptiveStep.store(1);
+  currentGrid.assign(gridSamples(frameLayout.width, frameLayout.height, CHANGE_GRID_STEP), 0);
+  referenceGrid.assign(currentGrid.size(), 0);
+  haveReference = false;
+  framesUnchanged.store(0);
+
+  // the camera's AE/AWB set up the first frame, the stabilizer takes over from the frame after it
+  stabilizing = options.stabilize != Stabilization::Off;
+  const ControlInfoMap &cameraControls = camera->controls();
+  if (stabilizing && (!cameraControls.count(&controls::ExposureTime) || !cameraControls.count(&controls::AnalogueGain))) {
+    std::cerr << "Camera has no manual exposure controls, not stabilizing" << std::endl;
+    stabilizing = false;
+  }
+
+  StabilizerOptions stabilizerOptions;
+  stabilizerOptions.whiteBalance = options.stabilize == Stabilization::Full && cameraControls.count(&controls::ColourGains);
+  stabilizerOptions.targetLuma = static_cast<float>(options.targetLuma);
+  stabilizerOptions.maxExposureUs = std::min(STABILIZE_MAX_EXPOSURE_US, capInterval * 750);
+  stabilizer.reset(stabilizerOptions);
+
+  if (stabilizing) {
+    std::cout << "Stabilizing exposure" << (stabilizerOptions.whiteBalance ? " and white balance" : "") << " from the first frame on" << std::endl;
+  }
+
+  if (adaptiveCapture) {
+    std::cout << "Adaptive capture: every " << capInterval << "ms to every " << maxStep * capInterval << "ms, unchanged frames are "
+              << (duplicateStill ? "duplicated" : "skipped") << std::endl;
+  }
+
+  // the session exists on disk before its first frame
+  saveSession(false);
+
+  // every worker thread is running by now, so only capture itself ends up on the reserved core
+  enterCaptureBudget(options.cores);
+
+  if (pipelinedCapture) {
+    std::cout << "Pipelined capture: keeping " << requests.size() << " requests in flight" << std::endl;
+
+    for (std::unique_ptr<Request> &request : requests) {
+      camera->queueRequest(request.get());
+    }
+
+    // completions pace themselves against sensor timestamps, just wait for the target or a stop
+    std::unique_lock<std::mutex> lock(reqCompleteMutex);
+    while (!scheduleDone.load() && !stopRequested()) {
+      reqCompleteCV.wait_for(lock, 100ms);
+      maybeSaveSession();
+    }
+  }
+
+  // single request capture: slot n is due at scheduleStart + n * capInterval, so time spent encoding
+  // or waiting on the request comes out of the sleep instead of pushing every later frame back
+  const auto interval = std::chrono::milliseconds(capInterval);
+  const auto scheduleStart = std::chrono::steady_clock::now();
+  uint64_t slot = slotBase;
+
+  while (!pipelinedCapture && slot < targetSlots && !stopRequested()) {
+
+    // stop() wakes the wait, so a stop is picked up right away instead of at the next slot
+    {
+      std::unique_lock<std::mutex> lock(reqCompleteMutex);
+      reqCompleteCV.wait_until(lock, scheduleStart + (slot - slotBase) * interval, [this] { return stopping.load(); });
+    }
+
+    if (stopRequested()) break;
+
+    camera->queueRequest(requests[0].get());
+
+    {
+      std::unique_lock<std::mutex> lock(reqCompleteMutex);
+      reqCompleteCV.wait(lock, [this]{ return requestDone.load(); });
+    }
+
+    if (stopRequested()) break;
+
+    requestDone.store(false);
+
+    // lateness is measured on the sensor clock against the first frame, which cancels the fixed queue to exposure delay
+    uint64_t timestamp = requestTimestamp(requests[0].get());
+    if (firstFrameTimestamp == 0) {
+      firstFrameTimestamp = timestamp;
+    }
+    uint64_t sensorElapsed = timestamp - firstFrameTimestamp;
+    uint64_t slotOffset = (slot - slotBase) * frameIntervalNs;
+    recordSlot(0, (sensorElapsed > slotOffset) ? sensorElapsed - slotOffset : 0);
+
+    requests[0]->reuse(Request::ReuseBuffers);
+    applyStabilizer(requests[0].get());
+
+    // if the frame overran whole slots, skip them instead of firing a burst of catch up frames
+    // (slots adaptive capture passes over on purpose do not count as missed)
+    uint64_t planned = slot + adaptiveStep.load();
+    uint64_t currentSlot = slotBase + (std::chrono::steady_clock::now() - scheduleStart) / interval;
+    uint64_t next = std::max(planned, currentSlot);
+    uint64_t missed = std::min(next, targetSlots.load()) - std::min(planned, targetSlots.load());
+    slotsMissed.fetch_add(missed);
+    countMetric(Metric::SlotsMissed, missed);
+    slot = next;
+
+    nextSlot.store(slot);
+    maybeSaveSession();
+  }
+
+  if (writeStills && frameWriter.storageLow()) {
+    std::cout << "\nLess than " << options.minFreePercent << "% of storage free (" << frameWriter.freeBytes() << " bytes), stopping..." << std::endl;
+  } else if (stopRequested()) {
+    std::cout << "\nInterrupt received, finishing current frame..." << std::endl;
+  }
+
+  stopping.store(true);
+
+  // nothing needs to settle first: stop() hands back every request still queued, cancelled, before it returns, and
+  // completions seen from here on are dropped (in single request mode the loop has already waited for its request)
+  camera->stop();
+  camera->requestCompleted.disconnect(this, &CaptureSession::requestComplete);
+
+  std::cout << "Capture schedule: " << nextJobIndex.load() - firstIndex << " frames, " << slotsMissed.load() << " missed slots, "
+            << framesLate.load() << " late frames (max " << maxLatenessNs.load() / 1000000 << "ms late), "
+            << slotsMissedRendering.load() << " missed and " << framesLateRendering.load() << " late while rendering" << std::endl;
+
+  if (adaptiveCapture) {
+    std::cout << "Adaptive capture: " << framesUnchanged.load() << " unchanged frames " << (duplicateStill ? "duplicated" : "skipped") << std::endl;
+  }
+
+  // let the encoders finish any queued frames before their requests are reused or go away, the threads stay for the next recording
+  encoderPool.drain();
+  uint64_t dropped = encoderPool.dropped() - droppedBefore;
+  if (dropped > 0) {
+    std::cout << "Encoders dropped " << dropped << " frames" << std::endl;
+  }
+
+  // flush frames still waiting on storage
+  frameWriter.stop();
+  if (writeStills) {
+    std::cout << "Wrote " << frameWriter.framesWritten() << " frames (" << frameWriter.bytesWritten() << " bytes)" << std::endl;
+    if (frameWriter.framesEvicted() > 0) {
+      std::cout << "Evicted " << frameWriter.framesEvicted() << " frames to stay within the storage quota" << std::endl;
+    }
+  }
+
+  // a part still encoding is abandoned, the next render encodes its frames with the tail
+  partEncoder.stop();
+
+  // every frame is on disk now, a session stopped early can be picked up again with resume
+  saveSession(nextSlot.load() >= targetSlots);
+  sessionSaving = false;
+
+  // every frame is in the pipe now, let ffmpeg finish the video
+  if (liveEncoding) {
+    int err = liveEncoder.finish();
+    std::cout << "Live encode finished with code " << err << std::endl;
+    liveEncoding = false;
+  }
+
+  std::cout << "Stage latencies:\n" << stageReport() << std::flush;
+
+  // a warm camera stays configured, with its buffers mapped and its encoders waiting for the camera's next recording
+  if (!WARM_CAMERAS) {
+    release();
+  }
+
+  return 0;
+}
+
+
+int createTimelapseHandler(int fps, int preset, int crf, std::string requestedFilename, bool hardwareEncode,
+                           const std::filesystem::path &framesDir, RenderControl *control) {
+
+  RenderOptions options;
+  options.fps = fps;
+  options.profile = legacyProfile(preset, crf, hardwareEncode);
+  options.filename = requestedFilename;
+  options.framesDir = framesDir;
+
+  return createTimelapseHandler(options, control);
+}
+
+
+int createTimelapseHandler(const RenderOptions &options, RenderControl *control) {
+
+  RenderControl uncancellable;
+  if (!control) {
+    control = &uncancellable;
+  }
+
+  // set parameters to defaults if invalid
+  int fps = (options.fps > 0) ? options.fps : 60;
+  std::string fpsStr = std::to_string(fps);
+  const RenderProfile &profile = options.profile;
+  const std::filesystem::path &framesDir = options.framesDir.empty() ? FRAME_PATH : options.framesDir;
+
+  std::string outputPath = timelapseOutputPath(options.filename);
+  std::vector<std::string> codecArgs = videoCodecArgs(profile);
+
+  std::string settings = formatRenderProfile(profile);
+  settings.pop_back();
+
+  std::cout << "Creating timelapse: " << outputPath << " from " << framesDir << std::endl;
+  std::cout << "Settings: fps=" << fps << " " << settings << std::endl;
+
+  // frames listed in the manifest are rendered from a concat list (or piped in from the segments), so gaps in the numbering cannot cut the video short
+  std::vector<FrameRecord> records;
+  bool haveManifest = readManifest(framesDir / MANIFEST_FILE, records) == 0 && !records.empty();
+
+  // unselected frames are left out of the list, so ffmpeg never decodes them
+  FrameSelection selection = options.selection;
+  selection.stride = std::max(selection.stride, 1) * std::max(profile.frameStride, 1);
+  if (options.maxSeconds > 0) {
+    selection.maxFrames = static_cast<size_t>(options.maxSeconds) * fps;
+  }
+
+  if (haveManifest) {
+    size_t recorded = records.size();
+    selectFrames(records, selection);
+
+    if (records.size() != recorded) {
+      std::cout << "Selected " << records.size() << " of " << recorded << " frames" << std::endl;
+    }
+    if (records.empty()) {
+      std::cerr << "No frames match the selection" << std::endl;
+      return -1;
+    }
+  } else if (selection.stride > 1 || selection.maxFrames > 0 || selection.startUnixMs > 0 || selection.endUnixMs > 0 || selection.dayStartMinute >= 0) {
+    std::cout << "No manifest in " << framesDir << ", rendering every frame" << std::endl;
+  }
+
+  if (!haveManifest && options.deflicker > 0) {
+    std::cout << "No manifest in " << framesDir << ", rendering without deflicker" << std::endl;
+  }
+
+  control->totalFrames.store(records.size());
+
+  int err;
+
+  if (!haveManifest) {
+    // frames recorded without a manifest
+    std::vector<std::string> args = { "ffmpeg", "-framerate", fpsStr, "-i", (framesDir / "frame_%06d.jpg").string() };
+    args.insert(args.end(), codecArgs.begin(), codecArgs.end());
+    args.insert(args.end(), { "-pix_fmt", "yuv420p", outputPath });
+
+    err = runFfmpeg(args, framesDir, nullptr, *control);
+  } else {
+    // gains from the luma measured during capture, applied while the frames are encoded anyway
+    std::vector<float> gains;
+    if (options.deflicker > 0) {
+      bool measured = std::any_of(records.begin(), records.end(), [](const FrameRecord &record) { return record.luma > 0; });
+      if (measured) {
+        gains = deflickerGains(records, options.deflicker);
+        std::cout << "Deflickering over " << options.deflicker << " frames on each side" << std::endl;
+      } else {
+        std::cout << "No luma in the manifest of " << framesDir << ", rendering without deflicker" << std::endl;
+      }
+    }
+
+    // parts encoded in the background with the same settings are stream copied, only the frames after them are encoded now
+    // (parts were encoded without gains, so a deflickered render encodes every frame)
+    std::vector<std::filesystem::path> videos;
+    size_t covered = gains.empty() ? reusableParts(framesDir, records, fps, codecArgs, videos) : 0;
+
+    if (covered == 0) {
+      std::cout << "Rendering " << records.size() << " frames from the manifest" << std::endl;
+      err = renderRecords(framesDir, records, fps, codecArgs, outputPath, framesDir / "frames.ffconcat", *control, gains.empty() ? nullptr : &gains);
+    } else {
+      std::filesystem::path partsDir = framesDir / PARTS_DIR;
+      std::cout << "Reusing " << videos.size() << " encoded parts (" << covered << " frames), rendering "
+                << records.size() - covered << " remaining frames" << std::endl;
+
+      err = 0;
+      if (covered < records.size()) {
+        std::vector<FrameRecord> tail(records.begin() + covered, records.end());
+        std::filesystem::path tailPath = partsDir / "tail.mp4";
+
+        control->framesBase.store(covered);
+        control->framesDone.store(covered);
+
+        err = renderRecords(framesDir, tail, fps, codecArgs, tailPath.string(), framesDir / "tail.ffconcat", *control);
+        videos.push_back(tailPath);
+      }
+
+      if (!err) {
+        control->framesBase.store(0);
+        err = concatVideos(videos, outputPath, partsDir / "render.ffconcat", *control);
+      }
+    }
+  }
+
+  if (control->cancelled()) {
+    std::cout << "Stopped timelapse creation" << std::endl;
+    return -1;
+  }
+
+  if (!err) {
+    std::cout << "Timelapse successfully created: " << outputPath << std::endl;
+  }
+
+  return err;
 }
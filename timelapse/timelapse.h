@@ -5,14 +5,112 @@
 #include <mutex>
 #include <condition_variable>
 #include <filesystem>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "render.h"
+#include "segment_store.h"
+#include "worker_pool.h"
+
+// stops every recording (see stopRecording() for one camera)
 extern std::atomic<bool> shouldRecordStop;
-extern std::atomic<bool> shouldCreateStop;
 
 extern std::filesystem::path FRAME_PATH;
 extern std::filesystem::path TIMELAPSE_PATH;
 
+// keeps cameras set up between recordings (CAM_WARM_CAMERAS=1, see releaseWarmCameras())
+extern bool WARM_CAMERAS;
+
+// where saved frames are compressed
+enum class EncoderBackend : int {
+  Software = 0, // libjpeg on the encoder threads
+  V4l2 = 1 // V4L2 M2M hardware encoder fed with the capture dmabuf, falls back to libjpeg if unavailable
+};
+
+// pixel format of the capture stream
+enum class CaptureFormat : int {
+  Yuv420 = 0, // planar U and V
+  Nv12 = 1 // interleaved UV, the native output of some ISPs
+};
+
+// sensor readout the capture stream is scaled from
+enum class SensorMode : int {
+  Auto = 0, // whatever the pipeline picks for the stream size
+  Binned = 1, // the largest mode at most half the pixel array each way (2x2 binned on most sensors), a quarter of the pixels to read out
+  Full = 2 // the largest mode, the full pixel array
+};
+
+// exposure and white balance feedback while recording (see ExposureStabilizer)
+enum class Stabilization : int {
+  Off = 0, // the camera's own AE/AWB, frame to frame
+  Exposure = 1, // smoothed exposure, the camera's own AWB
+  Full = 2 // smoothed exposure and grey world white balance
+};
+
+/**
+ * Region of the sensor's field of view to capture, as fractions of it (0 to 1). A zero width or height captures all of it.
+ */
+struct CropRegion {
+  double x = 0;
+  double y = 0;
+  double width = 0;
+  double height = 0;
+};
+
+/**
+ * Options for a recording session. Zero values evaluate to the defaults noted per field.
+ */
+struct RecordOptions {
+  std::string cameraId; // camera to record, its libcamera ID or its index among the cameras (empty evaluates to the first camera)
+  std::filesystem::path framesDir; // frame directory of the recording (empty evaluates to the camera's default, see findCamera())
+  std::vector<int> cores; // cores the camera's capture, encoder and writer threads are pinned to (empty uses the capture budget, see cpu_budget.h)
+  int width = 0; // frame width in pixels (0 evaluates to 1920), the camera may adjust it to the closest size it supports
+  int height = 0; // frame height in pixels (0 evaluates to 1080)
+  CaptureFormat format = CaptureFormat::Yuv420; // pixel format of the captured frames
+  SensorMode sensorMode = SensorMode::Auto; // sensor readout the frames are scaled from
+  CropRegion crop; // part of the field of view scaled into the frames (full field of view by default)
+  int timelapseLength = 0; // length of timelapse in minutes (0 evaluates to 24 hours)
+  int capInterval = 0; // interval of frame capture in milliseconds (0 evaluates to 500 milliseconds)
+  int encoderThreads = 0; // number of JPEG encoder threads (0 evaluates to 2)
+  int encoderQueueDepth = 0; // frames that may wait for an encoder (0 evaluates to 4)
+  QueuePolicy queuePolicy = QueuePolicy::Block; // what to do with a new frame when the encoder queue is full (pipelined capture never waits: with Block the frame is requeued untouched, its slot is missed if no later frame finds room in time)
+  int writerBuffers = 0; // compressed frames that may wait for storage before encoders block (0 evaluates to 8)
+  int syncEvery = 0; // frames between filesystem syncs (0 evaluates to 100, negative only syncs when recording stops)
+  uint64_t quotaBytes = 0; // rolling window: once the session's stills take more than this, the oldest are deleted (0 for no limit)
+  int minFreePercent = 0; // recording stops once less than this share of the frame directory's filesystem is free, it can be resumed (0 to never stop)
+  FrameStore frameStore = FrameStore::Files; // one JPEG per frame, or frames appended to segment files
+  int segmentFrames = 0; // frames per segment file with FrameStore::Segments (0 evaluates to 1000)
+  EncoderBackend encoder = EncoderBackend::Software; // backend used to compress saved frames
+  bool pipelined = false; // keep every allocated request in flight and pick frames by sensor timestamp instead of queueing one request per interval
+  bool liveEncode = false; // stream raw frames into ffmpeg while recording so the video is ready shortly after capture stops
+  bool writeStills = true; // write each frame to FRAME_PATH as a JPEG (always true when not live encoding)
+  int liveFps = 0; // framerate of the live encoded video and the encoded parts (0 evaluates to 60)
+  int livePreset = 0; // x264 speed preset of the live encoded video and the encoded parts, same values as createTimelapseHandler (0 evaluates to 2)
+  int liveCrf = -1; // crf of the live encoded video and the encoded parts (-1 evaluates to 23)
+  std::string liveFilename; // output file of the live encoded video in TIMELAPSE_PATH (empty evaluates to the time recording started)
+  bool encodeParts = false; // encode finished frames into video parts in the background, renders with the same fps/preset/crf/encoder only encode the frames after them
+  int partFrames = 0; // frames per encoded part (0 evaluates to 1800)
+  bool adaptive = false; // compare each frame to the last saved one on a coarse luma grid, frames that barely changed are not saved and stretch the interval
+  int maxInterval = 0; // longest interval adaptive capture stretches to in milliseconds, capInterval is the shortest (0 evaluates to 8 times capInterval)
+  int changeThreshold = 0; // per mille of grid samples that must have changed for adaptive capture to save a frame (0 evaluates to 5)
+  bool duplicateStill = false; // list frames adaptive capture did not save in the manifest as repeats of the last saved frame, so renders keep their pacing
+  Stabilization stabilize = Stabilization::Off; // take over exposure (and white balance) from the first frame on, moving them smoothly between frames
+  int targetLuma = 0; // mean luma stabilized exposure aims for (0 evaluates to 100)
+  bool resume = false; // continue the session saved in FRAME_PATH (its interval, length, numbering and frame store replace the values above)
+  std::shared_ptr<std::atomic<bool>> stopToken; // once set the recording stops, also when it was set before the recording got to register (see CaptureJobs)
+};
+
+/**
+ * Captures timelapse using system camera and writes frames to specified path.
+ * Completed frames are handed to a pool of encoder threads so the libcamera completion thread is never blocked by JPEG encoding.
+ * Frames are scheduled on a fixed grid of capture slots, slots that overrun are skipped and reported instead of delaying the rest.
+ * Each call records one camera with its own pipeline, so different cameras can be recorded at the same time from different threads.
+ * @param options Recording options (see RecordOptions)
+ * @return 0 on success, non-zero on error (-EBUSY if the camera or frame directory is already recording)
+ */
+int recordTimelapseHandler(const RecordOptions &options);
+
 /**
  * Captures timelapse using system camera and writes frames to specified path.
  * @param timelapseLength Length of timelapse in minutes (default is 0 which evaluates to 24 hours)
@@ -22,13 +120,97 @@ extern std::filesystem::path TIMELAPSE_PATH;
 int recordTimelapseHandler(int timelapseLength, int capInterval);
 
 /**
- * Creates timelapse using ffmpeg command and writers final mp4 to specified path.
+ * Frames waiting between the stages of the capture pipeline, for monitoring.
+ */
+struct PipelineDepths {
+  size_t encoderQueue = 0; // completed frames waiting for an encoder thread
+  size_t writerQueue = 0; // compressed frames waiting for storage
+};
+
+/**
+ * @return Current queue depths summed over every recording, all zero while no camera is recording
+ */
+PipelineDepths pipelineDepths();
+
+/**
+ * A camera that is recording.
+ */
+struct RecordingInfo {
+  std::string cameraId;
+  std::filesystem::path framesDir;
+  uint64_t slotsDone = 0; // capture slots of the schedule filled or missed so far (resumed sessions count from their start)
+  uint64_t slotsTotal = 0; // 0 until the camera is configured
+  uint64_t intervalMs = 0; // capture interval
+  uint64_t framesSaved = 0; // frames written by this run
+};
+
+/**
+ * @return Every recording in progress
+ */
+std::vector<RecordingInfo> recordings();
+
+/**
+ * Asks recordings to stop, recordTimelapseHandler() returns once the frames are flushed.
+ * @param cameraId libcamera ID of the camera to stop (empty stops every recording)
+ * @return true if a recording was asked to stop
+ */
+bool stopRecording(const std::string &cameraId = "");
+
+/**
+ * Keeps the camera manager started until closeCameraManager(), so finding and listing cameras (see findCamera() and cameraIds())
+ * does not start it and enumerate the cameras again on every call, e.g. for a server that resolves a camera on each request.
+ * @return 0 on success, -ENODEV if the manager could not be started
+ */
+int openCameraManager();
+
+/**
+ * Drops the reference taken by openCameraManager(), the manager stops once no recording uses it either.
+ */
+void closeCameraManager();
+
+/**
+ * Releases the cameras WARM_CAMERAS keeps acquired, configured and with their encoder threads running between recordings,
+ * and stops the camera manager unless a recording still uses it. Other processes can only open a warm camera after this.
+ * Call once the recordings have returned, e.g. on shutdown.
+ */
+void releaseWarmCameras();
+
+/**
+ * @return libcamera IDs of the cameras on the system, in the order their indices refer to
+ */
+std::vector<std::string> cameraIds();
+
+/**
+ * Resolves a camera by libcamera ID or index.
+ * @param camera ID or index (empty for the first camera)
+ * @param cameraId Set to the camera's libcamera ID
+ * @param framesDir Set to the camera's default frame directory: FRAME_PATH for the first camera, FRAME_PATH-N for camera N
+ * @return 0 on success, -ENODEV if there is no such camera
+ */
+int findCamera(const std::string &camera, std::string &cameraId, std::filesystem::path &framesDir);
+
+/**
+ * Creates timelapse using ffmpeg command and writes final mp4 to TIMELAPSE_PATH.
+ * ffmpeg runs under the render CPU budget (see cpu_budget.h), so it can run next to a recording.
+ * Parts encoded during recording with the same settings (see RecordOptions::encodeParts) are stream copied, only the frames after them are encoded.
+ * @param options Render options (see RenderOptions and RenderProfile)
+ * @param control Cancels the render and receives its progress (default is nullptr, the render cannot be cancelled)
+ * @return 0 on success, non-zero on error
+ */
+int createTimelapseHandler(const RenderOptions &options, RenderControl *control = nullptr);
+
+/**
+ * Creates timelapse using ffmpeg command and writers final mp4 to specified path, with the default profile adjusted by preset and crf.
  * @param fps Framerate used in ffpmeg command (default is 0 which evaluates to 60)
  * @param preset Speed preset corresponding to presets in ffmpeg command (default is 0 which evaluates to 2). Used to index enum (1 - medium, 2 - faster, 3 - veryfast)
  * @param crf Encoding mode that determines visual quality and file size (default is -1 which evaluates to 23)
  * @param requestedFilename The name of the output file that the timelapse will be written to (default is an empty string which evaluates to the exact time the timelapse creation started)
+ * @param hardwareEncode Encode with the h264_v4l2m2m hardware encoder instead of libx264 (preset and crf are ignored)
+ * @param framesDir Frame directory to render (default is FRAME_PATH). A session still recording there is rendered up to the frames in its manifest when the render starts
+ * @param control Cancels the render and receives its progress (default is nullptr, the render cannot be cancelled)
  * @return 0 on success, non-zero on error
  */
-int createTimelapseHandler(int fps, int preset, int crf, std::string requestedFilename);
+int createTimelapseHandler(int fps, int preset, int crf, std::string requestedFilename, bool hardwareEncode = false,
+                           const std::filesystem::path &framesDir = FRAME_PATH, RenderControl *control = nullptr);
 
 #endif
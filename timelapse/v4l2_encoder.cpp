@@ -0,0 +1,346 @@
+#include "v4l2_encoder.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+// raw buffers are imported per dmabuf, compressed buffers are owned by the device
+static constexpr unsigned int OUTPUT_BUFFERS = 8;
+static constexpr unsigned int CAPTURE_BUFFERS = 4;
+
+// upper bound for one compressed frame
+static constexpr unsigned int CAPTURE_BUFFER_SIZE = 4 << 20;
+
+static constexpr int ENCODE_TIMEOUT_MS = 1000;
+
+
+// retries ioctls interrupted by signals
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int ret;
+  do {
+    ret = ioctl(fd, request, arg);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+
+int V4l2Encoder::open(const std::string &device, uint32_t codec, int width, int height, int stride, int quality, uint32_t rawFormat) {
+
+  close();
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  fd = ::open(device.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    int err = errno;
+    std::cerr << "Unable to open V4L2 encoder " << device << ": " << std::strerror(err) << std::endl;
+    return -err;
+  }
+
+  auto fail = [this](const char *what) {
+    int err = errno;
+    std::cerr << "V4L2 encoder " << what << " failed: " << std::strerror(err) << std::endl;
+    for (auto &mapping : captureMaps) {
+      munmap(mapping.first, mapping.second);
+    }
+    captureMaps.clear();
+    ::close(fd);
+    fd = -1;
+    return -err;
+  };
+
+  v4l2_capability caps = {};
+  if (xioctl(fd, VIDIOC_QUERYCAP, &caps) < 0) {
+    return fail("VIDIOC_QUERYCAP");
+  }
+
+  if (!(caps.device_caps & V4L2_CAP_VIDEO_M2M_MPLANE)) {
+    errno = ENODEV;
+    return fail("capability check");
+  }
+
+  // raw side, laid out exactly like the libcamera buffer so it can be imported as is
+  v4l2_format fmt = {};
+  fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = height;
+  fmt.fmt.pix_mp.pixelformat = rawFormat;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+  fmt.fmt.pix_mp.colorspace = (codec == V4L2_PIX_FMT_JPEG) ? V4L2_COLORSPACE_JPEG : V4L2_COLORSPACE_SMPTE170M;
+  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+
+  if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+    return fail("VIDIOC_S_FMT (output)");
+  }
+
+  if (fmt.fmt.pix_mp.plane_fmt[0].bytesperline != static_cast<unsigned int>(stride)) {
+    std::cerr << "V4L2 encoder wants stride " << fmt.fmt.pix_mp.plane_fmt[0].bytesperline
+              << ", capture buffers have " << stride << std::endl;
+    errno = EINVAL;
+    return fail("stride check");
+  }
+
+  // compressed side
+  fmt = {};
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = height;
+  fmt.fmt.pix_mp.pixelformat = codec;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.plane_fmt[0].sizeimage = CAPTURE_BUFFER_SIZE;
+
+  if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+    return fail("VIDIOC_S_FMT (capture)");
+  }
+
+  // encoder controls are best effort, the driver defaults are usable
+  v4l2_control ctrl = {};
+  ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+  ctrl.value = quality;
+  xioctl(fd, VIDIOC_S_CTRL, &ctrl);
+
+  v4l2_requestbuffers reqbufs = {};
+  reqbufs.count = OUTPUT_BUFFERS;
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_DMABUF;
+
+  if (xioctl(fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+    return fail("VIDIOC_REQBUFS (output)");
+  }
+  outputCount = reqbufs.count;
+
+  reqbufs = {};
+  reqbufs.count = CAPTURE_BUFFERS;
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_MMAP;
+
+  if (xioctl(fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+    return fail("VIDIOC_REQBUFS (capture)");
+  }
+
+  for (unsigned int i = 0; i < reqbufs.count; i++) {
+    v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+    v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    buf.length = 1;
+    buf.m.planes = planes;
+
+    if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+      return fail("VIDIOC_QUERYBUF");
+    }
+
+    void *mem = mmap(nullptr, planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, planes[0].m.mem_offset);
+    if (mem == MAP_FAILED) {
+      return fail("mmap");
+    }
+    captureMaps.emplace_back(mem, planes[0].length);
+
+    if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+      return fail("VIDIOC_QBUF (capture)");
+    }
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    return fail("VIDIOC_STREAMON (output)");
+  }
+
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    return fail("VIDIOC_STREAMON (capture)");
+  }
+
+  std::cout << "Opened V4L2 encoder " << device << " (" << caps.card << ")" << std::endl;
+
+  return 0;
+}
+
+
+void V4l2Encoder::close() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (fd < 0) {
+    return;
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  xioctl(fd, VIDIOC_STREAMOFF, &type);
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  xioctl(fd, VIDIOC_STREAMOFF, &type);
+
+  for (auto &mapping : captureMaps) {
+    munmap(mapping.first, mapping.second);
+  }
+  captureMaps.clear();
+  outputIndices.clear();
+
+  ::close(fd);
+  fd = -1;
+}
+
+
+// every dmabuf keeps the same output buffer index so the driver can cache its import
+int V4l2Encoder::outputIndex(int dmabufFd) {
+
+  auto it = outputIndices.find(dmabufFd);
+  if (it != outputIndices.end()) {
+    return it->second;
+  }
+
+  unsigned int index = outputIndices.size() % outputCount;
+  outputIndices[dmabufFd] = index;
+
+  return index;
+}
+
+
+int V4l2Encoder::waitFor(short events) {
+
+  pollfd pfd = { fd, events, 0 };
+
+  int ret;
+  do {
+    ret = poll(&pfd, 1, ENCODE_TIMEOUT_MS);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret == 0) {
+    return -ETIMEDOUT;
+  }
+
+  return (ret < 0) ? -errno : 0;
+}
+
+
+// takes every buffer back from the device and starts streaming again with all compressed buffers queued, called with the mutex held
+int V4l2Encoder::restartStreams() {
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  xioctl(fd, VIDIOC_STREAMOFF, &type);
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  xioctl(fd, VIDIOC_STREAMOFF, &type);
+
+  for (unsigned int i = 0; i < captureMaps.size(); i++) {
+    v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+    v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    buf.length = 1;
+    buf.m.planes = planes;
+
+    if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+      int err = errno;
+      std::cerr << "V4L2 encoder restart VIDIOC_QBUF (capture) failed: " << std::strerror(err) << std::endl;
+      return -err;
+    }
+  }
+
+  type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    int err = errno;
+    std::cerr << "V4L2 encoder restart VIDIOC_STREAMON (output) failed: " << std::strerror(err) << std::endl;
+    return -err;
+  }
+
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+    int err = errno;
+    std::cerr << "V4L2 encoder restart VIDIOC_STREAMON (capture) failed: " << std::strerror(err) << std::endl;
+    return -err;
+  }
+
+  return 0;
+}
+
+
+int V4l2Encoder::encode(int dmabufFd, size_t length, const Sink &sink) {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (fd < 0) {
+    return -ENODEV;
+  }
+
+  // queue the raw frame straight from the camera buffer
+  v4l2_plane rawPlane = {};
+  rawPlane.m.fd = dmabufFd;
+  rawPlane.length = length;
+  rawPlane.bytesused = length;
+
+  v4l2_buffer raw = {};
+  raw.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  raw.memory = V4L2_MEMORY_DMABUF;
+  raw.index = outputIndex(dmabufFd);
+  raw.field = V4L2_FIELD_NONE;
+  raw.length = 1;
+  raw.m.planes = &rawPlane;
+
+  if (xioctl(fd, VIDIOC_QBUF, &raw) < 0) {
+    int err = errno;
+    std::cerr << "V4L2 encoder VIDIOC_QBUF (output) failed: " << std::strerror(err) << std::endl;
+    return -err;
+  }
+
+  // wait for the compressed frame
+  v4l2_plane codedPlane = {};
+  v4l2_buffer coded = {};
+  coded.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  coded.memory = V4L2_MEMORY_MMAP;
+  coded.length = 1;
+  coded.m.planes = &codedPlane;
+
+  int ret = 0;
+  while (xioctl(fd, VIDIOC_DQBUF, &coded) < 0) {
+    ret = (errno == EAGAIN) ? waitFor(POLLIN) : -errno;
+    if (ret < 0) {
+      std::cerr << "V4L2 encoder VIDIOC_DQBUF (capture) failed: " << std::strerror(-ret) << std::endl;
+      break;
+    }
+  }
+
+  if (ret == 0) {
+    const uint8_t *data = static_cast<const uint8_t *>(captureMaps[coded.index].first);
+    sink(data + codedPlane.data_offset, codedPlane.bytesused - codedPlane.data_offset);
+
+    xioctl(fd, VIDIOC_QBUF, &coded);
+  }
+
+  // take the raw buffer back so the camera can reuse it
+  v4l2_plane releasedPlane = {};
+  v4l2_buffer released = {};
+  released.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  released.memory = V4L2_MEMORY_DMABUF;
+  released.length = 1;
+  released.m.planes = &releasedPlane;
+
+  int err = 0;
+  while (xioctl(fd, VIDIOC_DQBUF, &released) < 0) {
+    err = (errno == EAGAIN) ? waitFor(POLLOUT) : -errno;
+    if (err < 0) {
+      std::cerr << "V4L2 encoder VIDIOC_DQBUF (output) failed: " << std::strerror(-err) << std::endl;
+      break;
+    }
+  }
+
+  // after a failure the device may still hold the camera's dmabuf, or finish the frame late and pair it with the next one,
+  // so both queues are restarted to take every buffer back before the request returns to the camera
+  if (ret < 0 || err < 0) {
+    restartStreams();
+  }
+
+  return (ret < 0) ? ret : err;
+}
@@ -0,0 +1,75 @@
+#ifndef V4L2_ENCODER_H
+#define V4L2_ENCODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Hardware encoder driven through a V4L2 memory-to-memory device (bcm2835-codec on the Pi).
+ * Raw frames are queued as dmabufs straight from the camera, so the encoder reads the capture buffer without a copy.
+ * A single device instance is shared by all callers, encode() serializes access to it.
+ */
+class V4l2Encoder {
+public:
+  using Sink = std::function<void(const uint8_t *data, size_t size)>;
+
+  V4l2Encoder() = default;
+  V4l2Encoder(const V4l2Encoder &) = delete;
+  V4l2Encoder &operator=(const V4l2Encoder &) = delete;
+
+  ~V4l2Encoder() {
+    close();
+  }
+
+  /**
+   * Opens and configures the encoder device for YUV420 input.
+   * @param device Path to the V4L2 M2M device (e.g. /dev/video31)
+   * @param codec V4L2 fourcc of the compressed output (V4L2_PIX_FMT_JPEG, the only codec whose controls are set)
+   * @param width Frame width in pixels
+   * @param height Frame height in pixels
+   * @param stride Bytes between rows of the Y plane, must match the capture buffers exactly
+   * @param quality JPEG quality (0-100)
+   * @param rawFormat V4L2 fourcc of the raw input, V4L2_PIX_FMT_YUV420 or V4L2_PIX_FMT_NV12 like the capture buffers
+   * @return 0 on success, negative errno on error
+   */
+  int open(const std::string &device, uint32_t codec, int width, int height, int stride, int quality, uint32_t rawFormat);
+
+  /**
+   * Stops streaming, unmaps the output buffers and closes the device. Safe to call more than once.
+   */
+  void close();
+
+  bool isOpen() const {
+    return fd >= 0;
+  }
+
+  /**
+   * Encodes one frame held in a dmabuf and passes the compressed bytes to the sink before returning.
+   * @param dmabufFd File descriptor of the dmabuf holding the whole YUV420 frame (Y, U and V planes back to back)
+   * @param length Number of bytes of the frame in the dmabuf
+   * @param sink Called once with the compressed frame, the data is only valid during the call
+   * @return 0 on success, negative errno on error (the device holds none of the frame's buffers by then either way)
+   */
+  int encode(int dmabufFd, size_t length, const Sink &sink);
+
+private:
+  int outputIndex(int dmabufFd);
+  int waitFor(short events);
+  int restartStreams();
+
+  std::mutex mutex;
+  int fd = -1;
+
+  // compressed buffers are mmapped from the device, raw buffers are imported dmabufs
+  std::vector<std::pair<void *, size_t>> captureMaps;
+  std::map<int, unsigned int> outputIndices;
+  unsigned int outputCount = 0;
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// what to do with a new job when every queue slot is taken
+enum class QueuePolicy : int {
+  Block = 0,     // producer waits until a worker frees a slot
+  DropOldest = 1 // oldest queued job is discarded to make room
+};
+
+
+/**
+ * Fixed-size pool of worker threads fed through a bounded FIFO queue.
+ * Jobs are stored by value in a ring buffer allocated once in start(), so submitting does not allocate.
+ * Every submitted job is handed to exactly one of the two handlers: process (by a worker) or discard (when dropped).
+ */
+template <typename Job>
+class WorkerPool {
+public:
+  using Handler = std::function<void(Job &)>;
+
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  ~WorkerPool() {
+    stop();
+  }
+
+  /**
+   * Spawns the worker threads.
+   * @param threads Number of worker threads (at least 1)
+   * @param depth Maximum number of queued jobs not yet picked up by a worker (at least 1)
+   * @param policy Behaviour of submit() when the queue is full
+   * @param process Called on a worker thread for each job
+   * @param discard Called for each job that is dropped instead of processed
+   */
+  void start(size_t threads, size_t depth, QueuePolicy policy, Handler process, Handler discard) {
+    stop();
+
+    slots.assign(std::max<size_t>(depth, 1), Job{});
+    head = 0;
+    count = 0;
+    busy = 0;
+    stopping = false;
+    droppedJobs.store(0);
+
+    queuePolicy = policy;
+    processJob = std::move(process);
+    discardJob = std::move(discard);
+
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++) {
+      workers.emplace_back([this] { run(); });
+    }
+  }
+
+  /**
+   * Queues a job for the workers, applying the queue policy if every slot is taken.
+   * @return true if the job was queued without dropping anything, false otherwise
+   */
+  bool submit(const Job &job) {
+    std::optional<Job> victim;
+    bool queued = false;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      if (queuePolicy == QueuePolicy::Block) {
+        notFull.wait(lock, [this] { return count < slots.size() || stopping; });
+      } else if (count == slots.size() && !stopping) {
+        victim = slots[head];
+        head = (head + 1) % slots.size();
+        count--;
+      }
+
+      if (!stopping) {
+        slots[(head + count) % slots.size()] = job;
+        count++;
+        queued = true;
+      }
+    }
+
+    if (queued) {
+      notEmpty.notify_one();
+    } else {
+      victim = job;
+    }
+
+    if (victim) {
+      droppedJobs.fetch_add(1);
+      discardJob(*victim);
+    }
+
+    return queued && !victim;
+  }
+
+  /**
+   * Queues a job only if a queue slot is free, whatever the queue policy. Never blocks and never drops anything.
+   * @return true if the job was queued
+   */
+  bool trySubmit(const Job &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      if (count == slots.size() || stopping) {
+        return false;
+      }
+
+      slots[(head + count) % slots.size()] = job;
+      count++;
+    }
+    notEmpty.notify_one();
+
+    return true;
+  }
+
+  /**
+   * Whether a job submitted now would find a free queue slot. Workers only ever free slots, so for a pool with a single
+   * producer the answer holds until that producer submits.
+   * @return true if a queue slot is free
+   */
+  bool hasRoom() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count < slots.size() && !stopping;
+  }
+
+  /**
+   * Queues a job only if a worker is idle and no other job is waiting for one, for optional work that must never delay or displace other jobs.
+   * The job never takes the last free queue slot, so a depth 1 queue only ever takes other jobs. Never blocks and never drops anything.
+   * @return true if the job was queued
+   */
+  bool submitIfIdle(const Job &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      if (count > 0 || busy >= workers.size() || slots.size() - count < 2 || stopping) {
+        return false;
+      }
+
+      slots[(head + count) % slots.size()] = job;
+      count++;
+    }
+    notEmpty.notify_one();
+
+    return true;
+  }
+
+  /**
+   * Waits until every queued job has been processed, keeping the workers for the jobs submitted after.
+   * Returns right away if the pool is not started.
+   */
+  void drain() {
+    if (workers.empty()) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return count == 0 && busy == 0; });
+  }
+
+  /**
+   * Lets the workers finish every queued job, then joins them. Safe to call more than once.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+
+    for (std::thread &worker : workers) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+    workers.clear();
+  }
+
+  // number of jobs waiting for a worker
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+  }
+
+  // number of jobs discarded since start()
+  uint64_t dropped() const {
+    return droppedJobs.load();
+  }
+
+private:
+  void run() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return count > 0 || stopping; });
+
+        // drain whatever is left before exiting
+        if (count == 0) {
+          return;
+        }
+
+        job = slots[head];
+        head = (head + 1) % slots.size();
+        count--;
+        busy++;
+      }
+      notFull.notify_one();
+
+      processJob(job);
+
+      bool drained;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy--;
+        drained = count == 0 && busy == 0;
+      }
+      if (drained) {
+        idle.notify_all();
+      }
+    }
+  }
+
+  mutable std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::condition_variable idle; // signalled when the last busy worker finds the queue empty
+
+  std::vector<Job> slots;
+  size_t head = 0;
+  size_t count = 0;
+  size_t busy = 0; // workers processing a job
+  bool stopping = false;
+
+  QueuePolicy queuePolicy = QueuePolicy::Block;
+  Handler processJob;
+  Handler discardJob;
+
+  std::atomic<uint64_t> droppedJobs{0};
+  std::vector<std::thread> workers;
+};
+
+#endif